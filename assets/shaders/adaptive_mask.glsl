@@ -0,0 +1,44 @@
+#version 430 core
+layout(local_size_x = 8, local_size_y = 4, local_size_z = 1) in;
+
+// Lists the pixels whose estimate is still noisier than c_adaptiveThreshold for compute.glsl to sample.
+// The work list header doubles as the indirect dispatch arguments: every 32nd listed pixel opens a workgroup.
+layout(rgba32f, binding = 2) uniform readonly image2D imgVariance;
+uniform float c_adaptiveThreshold;
+
+#include "tonemap.glsl"
+
+layout(std430, binding = 20) buffer AdaptiveWork {
+    uint numGroupsX;
+    uint numGroupsY;
+    uint numGroupsZ;
+    uint activeCount;
+    uint activePixels[];
+};
+
+const uint c_workGroupSize = 32;
+// Luminance the error of darker pixels is measured against, so black pixels do not divide by zero
+const float c_minLuminance = 0.001;
+
+void main() {
+    ivec2 fragCoord = ivec2(gl_GlobalInvocationID.xy);
+    // Frames, mean luminance and sum of squared deviations of the per-frame luminance
+    vec4 stats = imageLoad(imgVariance, fragCoord);
+    float standardError = sqrt(stats.z / (stats.x * max(stats.x - 1.0, 1.0)));
+    // The slope of the display transform at the pixel's luminance turns the error into display units. Past white
+    // the curve is flat, so a clipped pixel only converges once its lower error bar is past white as well.
+    float luminance = max(stats.y, c_minLuminance);
+    float slope = displaySlope(luminance);
+    if (slope == 0.0) {
+        slope = displaySlope(max(luminance - standardError, c_minLuminance));
+    }
+    float displayError = standardError * slope;
+    if (displayError <= c_adaptiveThreshold) {
+        return;
+    }
+    uint slot = atomicAdd(activeCount, 1u);
+    if (slot % c_workGroupSize == 0u) {
+        atomicAdd(numGroupsX, 1u);
+    }
+    activePixels[slot] = uint(fragCoord.x) | (uint(fragCoord.y) << 16);
+}
@@ -1,8 +1,18 @@
 #version 430 core
 out vec4 FragColor;
-uniform sampler2D screen;
+// Sum of the linear radiance of a pixel's samples in rgb and their count in alpha, or their mean with
+// c_accumulateMean, stored top row first
+uniform sampler2D accumulation;
+uniform bool c_accumulateMean;
 in vec2 UVs;
+
+#include "tonemap.glsl"
+
 void main()
 {
-    FragColor = texture(screen, UVs);
+    vec4 accumulated = texture(accumulation, vec2(UVs.x, 1.0 - UVs.y));
+    vec3 colour = c_accumulateMean ? accumulated.rgb : accumulated.rgb / max(accumulated.a, 1.0);
+    colour = tonemap(colour);
+    // Square root gamma, which adaptive_mask.glsl measures the error in
+    FragColor = vec4(sqrt(clamp(colour, 0.0, 1.0)), 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,33 @@
+#version 430 core
+#include "lbvh_common.glsl"
+
+// Reduces the centroid bounds the Morton codes are quantized in, first per workgroup then globally
+
+shared uint groupBounds[6];
+
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    uint lid = gl_LocalInvocationID.x;
+    if (lid < 3u) {
+        groupBounds[lid] = 0xFFFFFFFFu;
+        groupBounds[lid + 3u] = 0u;
+    }
+    barrier();
+
+    if (i < c_primCount) {
+        vec3 bmin, bmax;
+        primitiveBounds(primitiveRef(i), bmin, bmax);
+        vec3 center = (bmin + bmax) * 0.5;
+        for (int axis = 0; axis < 3; ++axis) {
+            uint bits = orderedFloatBits(center[axis]);
+            atomicMin(groupBounds[axis], bits);
+            atomicMax(groupBounds[axis + 3], bits);
+        }
+    }
+    barrier();
+
+    if (lid < 3u) {
+        atomicMin(geometryBounds[lid], groupBounds[lid]);
+        atomicMax(geometryBounds[lid + 3u], groupBounds[lid + 3u]);
+    }
+}
@@ -0,0 +1,105 @@
+// Declarations shared by the LBVH build passes, which run one invocation per primitive
+// over a single geometry's spheres followed by its quads
+layout(local_size_x = 256, local_size_y = 1, local_size_z = 1) in;
+
+#define LBVH_GROUP_SIZE 256u
+#define RADIX_BITS 4u
+#define RADIX_BUCKETS 16u
+#define QUAD_REF_BIT 0x80000000u
+#define NO_PARENT 0xFFFFFFFFu
+
+const float c_quadBoundsEpsilon = 1e-4f;
+
+uniform uint c_primCount;
+uniform uint c_numSpheres;
+uniform uint c_sphereOffset;
+uniform uint c_quadOffset;
+uniform uint c_nodeOffset;
+uniform uint c_refOffset;
+
+// Quad origin a and edges u = b - a, v = d - a, with w split over the fourth components
+struct QuadPlane {
+    vec4 a;
+    vec4 u;
+    vec4 v;
+};
+
+struct BVHNode {
+    vec3 aabbMin;
+    uint leftFirst;
+    vec3 aabbMax;
+    uint primCount;
+};
+
+layout(std430, binding = 13) readonly buffer SphereGeometry {
+    vec4 sphereGeometry[]; // center, radius
+};
+
+layout(std430, binding = 14) readonly buffer QuadPlanes {
+    QuadPlane quadPlanes[];
+};
+
+layout(std430, binding = 2) coherent buffer BVHNodes {
+    BVHNode nodes[];
+};
+
+layout(std430, binding = 3) buffer PrimitiveRefs {
+    uint primitiveRefs[];
+};
+
+// Morton codes and primitive references, two halves of c_primCount entries the radix sort ping-pongs between
+layout(std430, binding = 9) buffer SortKeys {
+    uint sortKeys[];
+};
+
+layout(std430, binding = 10) buffer SortValues {
+    uint sortValues[];
+};
+
+// Per block digit histograms followed by the block sums of every scan level
+layout(std430, binding = 11) buffer ScanData {
+    uint scanData[];
+};
+
+// Geometry bounds as order preserving uints, then five arrays of c_primCount entries:
+// internal node parents, leaf parents, leaf slots, internal node slots and visit flags
+layout(std430, binding = 12) coherent buffer LBVHTree {
+    uint geometryBounds[6];
+    uint treeData[];
+};
+
+uint internalParentIndex(uint node) { return node; }
+uint leafParentIndex(uint leaf) { return c_primCount + leaf; }
+uint leafSlotIndex(uint leaf) { return 2u * c_primCount + leaf; }
+uint internalSlotIndex(uint node) { return 3u * c_primCount + node; }
+uint visitFlagIndex(uint node) { return 4u * c_primCount + node; }
+
+// Maps floats to uints with the same ordering so bounds can be reduced with integer atomics
+uint orderedFloatBits(float f) {
+    uint bits = floatBitsToUint(f);
+    return (bits & 0x80000000u) != 0u ? ~bits : bits | 0x80000000u;
+}
+
+float orderedBitsToFloat(uint bits) {
+    return uintBitsToFloat((bits & 0x80000000u) != 0u ? bits & 0x7FFFFFFFu : ~bits);
+}
+
+// Reference of the i-th primitive of the geometry, as stored in PrimitiveRefs
+uint primitiveRef(uint i) {
+    return i < c_numSpheres ? i : (i - c_numSpheres) | QUAD_REF_BIT;
+}
+
+void primitiveBounds(uint ref, out vec3 bmin, out vec3 bmax) {
+    if ((ref & QUAD_REF_BIT) != 0u) {
+        QuadPlane plane = quadPlanes[c_quadOffset + (ref & ~QUAD_REF_BIT)];
+        vec3 b = plane.a.xyz + plane.u.xyz;
+        vec3 c = b + plane.v.xyz;
+        vec3 d = plane.a.xyz + plane.v.xyz;
+        bmin = min(min(plane.a.xyz, b), min(c, d)) - vec3(c_quadBoundsEpsilon);
+        bmax = max(max(plane.a.xyz, b), max(c, d)) + vec3(c_quadBoundsEpsilon);
+    } else {
+        vec4 sphere = sphereGeometry[c_sphereOffset + ref];
+        bmin = sphere.xyz - vec3(sphere.w);
+        bmax = sphere.xyz + vec3(sphere.w);
+    }
+}
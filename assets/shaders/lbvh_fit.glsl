@@ -0,0 +1,34 @@
+#version 430 core
+#include "lbvh_common.glsl"
+
+// Bottom-up bounds pass, one invocation per leaf. Each invocation climbs towards the root and stops at the
+// first internal node it reaches before the node's other child is done; the second arrival merges both boxes.
+
+void main() {
+    uint leaf = gl_GlobalInvocationID.x;
+    if (leaf >= c_primCount) {
+        return;
+    }
+
+    vec3 bmin, bmax;
+    primitiveBounds(primitiveRefs[c_refOffset + leaf], bmin, bmax);
+    uint slot = c_nodeOffset + treeData[leafSlotIndex(leaf)];
+    nodes[slot].aabbMin = bmin;
+    nodes[slot].aabbMax = bmax;
+    memoryBarrierBuffer();
+
+    uint node = treeData[leafParentIndex(leaf)];
+    while (node != NO_PARENT) {
+        if (atomicAdd(treeData[visitFlagIndex(node)], 1u) == 0u) {
+            return;
+        }
+        uint left = c_nodeOffset + 2u * node + 1u;
+        bmin = min(nodes[left].aabbMin, nodes[left + 1u].aabbMin);
+        bmax = max(nodes[left].aabbMax, nodes[left + 1u].aabbMax);
+        slot = c_nodeOffset + treeData[internalSlotIndex(node)];
+        nodes[slot].aabbMin = bmin;
+        nodes[slot].aabbMax = bmax;
+        memoryBarrierBuffer();
+        node = treeData[internalParentIndex(node)];
+    }
+}
@@ -0,0 +1,95 @@
+#version 430 core
+#include "lbvh_common.glsl"
+
+// Emits the binary radix tree over the sorted Morton codes (Karras 2012), one internal node per invocation.
+// The children of internal node k are stored as the pair at slots 2k + 1 and 2k + 2, so the tree keeps
+// the BVHNodes layout traceBLAS expects (right child at leftFirst + 1) and internal node 0 is the root at slot 0.
+// Leaves hold one primitive and reference their position in the sorted order.
+
+// Length of the common prefix of sorted keys i and j, with the index breaking ties between equal keys
+int commonPrefix(int i, int j) {
+    if (j < 0 || j >= int(c_primCount)) {
+        return -1;
+    }
+    uint a = sortKeys[i];
+    uint b = sortKeys[j];
+    if (a == b) {
+        return 32 + 31 - findMSB(uint(i ^ j));
+    }
+    return 31 - findMSB(a ^ b);
+}
+
+void writeChild(uint slot, uint child, bool leaf, uint parent) {
+    nodes[c_nodeOffset + slot].leftFirst = leaf ? child : 2u * child + 1u;
+    nodes[c_nodeOffset + slot].primCount = leaf ? 1u : 0u;
+    if (leaf) {
+        treeData[leafSlotIndex(child)] = slot;
+        treeData[leafParentIndex(child)] = parent;
+    } else {
+        treeData[internalSlotIndex(child)] = slot;
+        treeData[internalParentIndex(child)] = parent;
+    }
+}
+
+void main() {
+    uint index = gl_GlobalInvocationID.x;
+    if (index >= c_primCount) {
+        return;
+    }
+    primitiveRefs[c_refOffset + index] = sortValues[index];
+
+    if (c_primCount == 1u) {
+        nodes[c_nodeOffset].leftFirst = 0u;
+        nodes[c_nodeOffset].primCount = 1u;
+        treeData[leafSlotIndex(0u)] = 0u;
+        treeData[leafParentIndex(0u)] = NO_PARENT;
+        return;
+    }
+    if (index == c_primCount - 1u) {
+        return;
+    }
+
+    int i = int(index);
+    if (i == 0) {
+        nodes[c_nodeOffset].leftFirst = 1u;
+        nodes[c_nodeOffset].primCount = 0u;
+        treeData[internalSlotIndex(0u)] = 0u;
+        treeData[internalParentIndex(0u)] = NO_PARENT;
+    }
+    treeData[visitFlagIndex(index)] = 0u;
+
+    // Direction of the range covered by node i and an upper bound on its length
+    int d = commonPrefix(i, i + 1) - commonPrefix(i, i - 1) >= 0 ? 1 : -1;
+    int prefixMin = commonPrefix(i, i - d);
+    int lengthMax = 2;
+    while (commonPrefix(i, i + lengthMax * d) > prefixMin) {
+        lengthMax *= 2;
+    }
+
+    // Binary search for the other end of the range
+    int rangeLength = 0;
+    for (int step = lengthMax / 2; step >= 1; step /= 2) {
+        if (commonPrefix(i, i + (rangeLength + step) * d) > prefixMin) {
+            rangeLength += step;
+        }
+    }
+    int j = i + rangeLength * d;
+
+    // Binary search for the split, the last key sharing more than the range's common prefix with i
+    int prefixNode = commonPrefix(i, j);
+    int split = 0;
+    int divisor = 2;
+    for (int step = (rangeLength + 1) / 2; ; step = (rangeLength + divisor - 1) / divisor) {
+        if (commonPrefix(i, i + (split + step) * d) > prefixNode) {
+            split += step;
+        }
+        if (step <= 1) {
+            break;
+        }
+        divisor *= 2;
+    }
+    int gamma = i + split * d + min(d, 0);
+
+    writeChild(2u * index + 1u, uint(gamma), min(i, j) == gamma, index);
+    writeChild(2u * index + 2u, uint(gamma + 1), max(i, j) == gamma + 1, index);
+}
@@ -0,0 +1,30 @@
+#version 430 core
+#include "lbvh_common.glsl"
+
+// First step of a radix sort pass: counts the keys of every block per digit, stored digit-major
+// so an exclusive scan over scanData yields each block's first output slot per digit
+
+uniform uint c_radixShift;
+uniform uint c_numBlocks;
+uniform uint c_sortSrc;
+
+shared uint groupHistogram[RADIX_BUCKETS];
+
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    uint lid = gl_LocalInvocationID.x;
+    if (lid < RADIX_BUCKETS) {
+        groupHistogram[lid] = 0u;
+    }
+    barrier();
+
+    if (i < c_primCount) {
+        uint digit = (sortKeys[c_sortSrc + i] >> c_radixShift) & (RADIX_BUCKETS - 1u);
+        atomicAdd(groupHistogram[digit], 1u);
+    }
+    barrier();
+
+    if (lid < RADIX_BUCKETS) {
+        scanData[lid * c_numBlocks + gl_WorkGroupID.x] = groupHistogram[lid];
+    }
+}
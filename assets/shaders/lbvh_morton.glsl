@@ -0,0 +1,33 @@
+#version 430 core
+#include "lbvh_common.glsl"
+
+// Writes the 30-bit Morton code of every primitive centroid and its reference into the first sort half
+
+// Spreads the low 10 bits of v so two zero bits separate each of them
+uint expandBits(uint v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= c_primCount) {
+        return;
+    }
+
+    vec3 boundsMin = vec3(orderedBitsToFloat(geometryBounds[0]), orderedBitsToFloat(geometryBounds[1]), orderedBitsToFloat(geometryBounds[2]));
+    vec3 boundsMax = vec3(orderedBitsToFloat(geometryBounds[3]), orderedBitsToFloat(geometryBounds[4]), orderedBitsToFloat(geometryBounds[5]));
+
+    uint ref = primitiveRef(i);
+    vec3 bmin, bmax;
+    primitiveBounds(ref, bmin, bmax);
+    vec3 extent = max(boundsMax - boundsMin, vec3(1e-20));
+    vec3 cell = clamp((bmin + bmax) * 0.5 - boundsMin, vec3(0.0), extent) / extent * 1023.0;
+    uvec3 q = uvec3(cell);
+
+    sortKeys[i] = (expandBits(q.x) << 2) | (expandBits(q.y) << 1) | expandBits(q.z);
+    sortValues[i] = ref;
+}
@@ -0,0 +1,33 @@
+#version 430 core
+#include "lbvh_common.glsl"
+
+// Exclusive scan of scanData[c_scanOffset, c_scanOffset + c_scanCount) within each block of 256,
+// writing every block's total to scanData[c_sumsOffset + block] for the next level
+
+uniform uint c_scanOffset;
+uniform uint c_scanCount;
+uniform uint c_sumsOffset;
+
+shared uint groupScan[LBVH_GROUP_SIZE];
+
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    uint lid = gl_LocalInvocationID.x;
+    uint value = i < c_scanCount ? scanData[c_scanOffset + i] : 0u;
+    groupScan[lid] = value;
+    barrier();
+
+    for (uint offset = 1u; offset < LBVH_GROUP_SIZE; offset <<= 1) {
+        uint addend = lid >= offset ? groupScan[lid - offset] : 0u;
+        barrier();
+        groupScan[lid] += addend;
+        barrier();
+    }
+
+    if (i < c_scanCount) {
+        scanData[c_scanOffset + i] = groupScan[lid] - value;
+    }
+    if (lid == LBVH_GROUP_SIZE - 1u) {
+        scanData[c_sumsOffset + gl_WorkGroupID.x] = groupScan[lid];
+    }
+}
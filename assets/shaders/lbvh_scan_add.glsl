@@ -0,0 +1,15 @@
+#version 430 core
+#include "lbvh_common.glsl"
+
+// Adds the scanned total of all preceding blocks to every element of a block scanned by lbvh_scan
+
+uniform uint c_scanOffset;
+uniform uint c_scanCount;
+uniform uint c_sumsOffset;
+
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    if (i < c_scanCount) {
+        scanData[c_scanOffset + i] += scanData[c_sumsOffset + gl_WorkGroupID.x];
+    }
+}
@@ -0,0 +1,48 @@
+#version 430 core
+#include "lbvh_common.glsl"
+
+// Second step of a radix sort pass: moves every key and value to its digit's slot for this block,
+// keeping keys with the same digit in their input order so the sort stays stable
+
+uniform uint c_radixShift;
+uniform uint c_numBlocks;
+uniform uint c_sortSrc;
+uniform uint c_sortDst;
+
+// Per digit counts of the keys up to each invocation, 16 bits per digit packed two to a uint
+shared uvec4 digitCountsLow[LBVH_GROUP_SIZE];
+shared uvec4 digitCountsHigh[LBVH_GROUP_SIZE];
+
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    uint lid = gl_LocalInvocationID.x;
+    bool valid = i < c_primCount;
+    uint key = valid ? sortKeys[c_sortSrc + i] : 0u;
+    uint digit = (key >> c_radixShift) & (RADIX_BUCKETS - 1u);
+
+    uvec4 counts = uvec4(0u);
+    if (valid) {
+        counts[(digit >> 1) & 3u] = 1u << (16u * (digit & 1u));
+    }
+    digitCountsLow[lid] = digit < 8u ? counts : uvec4(0u);
+    digitCountsHigh[lid] = digit < 8u ? uvec4(0u) : counts;
+    barrier();
+
+    for (uint offset = 1u; offset < LBVH_GROUP_SIZE; offset <<= 1) {
+        uvec4 low = lid >= offset ? digitCountsLow[lid - offset] : uvec4(0u);
+        uvec4 high = lid >= offset ? digitCountsHigh[lid - offset] : uvec4(0u);
+        barrier();
+        digitCountsLow[lid] += low;
+        digitCountsHigh[lid] += high;
+        barrier();
+    }
+
+    if (!valid) {
+        return;
+    }
+    uvec4 inclusive = digit < 8u ? digitCountsLow[lid] : digitCountsHigh[lid];
+    uint rank = ((inclusive[(digit >> 1) & 3u] >> (16u * (digit & 1u))) & 0xFFFFu) - 1u;
+    uint dst = scanData[digit * c_numBlocks + gl_WorkGroupID.x] + rank;
+    sortKeys[c_sortDst + dst] = key;
+    sortValues[c_sortDst + dst] = sortValues[c_sortSrc + i];
+}
@@ -0,0 +1,114 @@
+// Declarations shared by the compute.glsl megakernel and the wavefront_*.glsl kernels: the settings, the ray and hit
+// records and the constants of every stage of a path
+uniform ivec2 iResolution;
+uniform vec3 c_lookFrom;
+uniform vec3 c_lookAt;
+uniform vec3 c_lookUp;
+uniform float c_FOVDegrees;
+uniform uint c_numBounces;
+uniform float c_defocusAngle;
+uniform float c_focusDist;
+uniform uint c_samplesPerPixel;
+uniform bool c_sky;
+uniform uint frameCounter;
+uniform uint numOfInstances;
+uniform uint c_accelMode;
+uniform uint c_bvhWidth;
+uniform bool c_countRays;
+uniform uint c_renderMode;
+uniform float c_aoDistance;
+uniform bool c_anyHitOcclusion;
+uniform bool c_soaGeometry;
+uniform bool c_nextEventEstimation;
+uniform bool c_lightBVH;
+uniform uint numOfEmitters;
+uniform float emitterPower;
+uniform uint c_sampler;
+
+const float c_minimumRayHitTime = 0.00001f;
+const float c_superFar = 10000.0f;
+const float c_rayPosNormalNudge = 0.001f;
+const float c_pi = 3.141592;
+const float c_twopi = 6.283185;
+// Fuzz below this is treated as a perfect mirror, whose delta lobe light samples cannot reach
+const float c_glossyFuzz = 0.001;
+
+const uint c_accelGrid = 1u;
+const uint c_renderAmbientOcclusion = 1u;
+const uint c_quadRefBit = 0x80000000u;
+const uint c_wideLeafBit = 0x80000000u;
+const uint c_gridHeader = 12u;
+const uint c_gridSubgridBit = 0x80000000u;
+const uint c_wideNodeHeader = 8u;
+const uint c_bvhStackSize = 64;
+const uint c_wideStackSize = 128; // WIDE_STACK_SIZE in bvh.h, collapse_bvh rejects trees that need more
+
+// Rays and primitive tests of this invocation, added to the RayCounter buffer while benchmarking
+uint raysTraced = 0u;
+uint sphereTestCount = 0u;
+uint quadTestCount = 0u;
+
+struct Ray {
+    vec3 origin;
+    vec3 direction;
+};
+
+vec3 getRayPointAt(Ray r, float t) {
+    return r.origin + t * r.direction;
+}
+
+struct HitRecord {
+    vec3 p;
+    vec3 normal;
+    float t;
+    bool frontFace;
+    vec3 albedo;
+    float reflectivity;
+    float fuzz;
+    float refractionIndex;
+    vec3 emission;
+    float emissionStrength;
+    // Emitter hits only: the emitter's primitive, its weight in the alias table and the pdf per unit
+    // of world space area of sampleEmitter picking the hit point once it has picked the emitter
+    uint instance;
+    uint primitiveRef;
+    float emitterWeight;
+    float emitterPointPdf;
+};
+
+void setFaceNormal(in Ray r, in vec3 outwardNormal, inout HitRecord rec) {
+    rec.frontFace = dot(r.direction, outwardNormal) < 0;
+    rec.normal = rec.frontFace ? outwardNormal : -outwardNormal;
+}
+
+struct Interval {
+    float min;
+    float max;
+};
+
+// Closest hit as recorded during traversal, turned into a HitRecord by resolveHit once traversal ends
+struct HitInfo {
+    float t;
+    uint instance;
+    uint primitiveRef; // c_quadRefBit marks quads
+    vec2 barycentrics; // quad coordinates along the a to b and a to d edges, unused for spheres
+};
+
+float getIntervalSize(in Interval interval) {
+    return interval.max - interval.min;
+}
+
+bool intervalContains(in Interval interval, in float x) {
+    return interval.min <= x && x <= interval.max;
+}
+
+bool intervalSurrounds(in Interval interval, in float x) {
+    return interval.min < x && interval.max > x;
+}
+
+// Gradient from white at the horizon to blue overhead, lighting the rays that leave the scene while c_sky is on
+vec3 skyColour(in Ray ray) {
+    vec3 unitDirection = normalize(ray.direction);
+    float t = 0.5 * (unitDirection.y + 1.0);
+    return (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
+}
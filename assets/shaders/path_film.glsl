@@ -0,0 +1,134 @@
+// Screen side of a path: the camera ray of a pixel sample, the pixels a dispatch covers and the running sums
+// the pixels accumulate their samples into
+// Linear radiance summed over a pixel's samples and their count in alpha, which fragment.glsl divides and tonemaps.
+// Half float formats keep the running mean instead, their sums would stop growing past a few thousand samples.
+// The image is written without a format and read through a texture, so every format runs the same program.
+layout(binding = 1) writeonly uniform image2D imgAccumulation;
+layout(binding = 2) uniform sampler2D accumulationTexture;
+uniform bool c_accumulateMean;
+// Frames, mean luminance and sum of squared deviations of the per-frame luminance, the running variance
+// adaptive_mask.glsl decides convergence by
+layout(rgba32f, binding = 2) uniform image2D imgVariance;
+// Dispatched over the work list of unconverged pixels instead of the whole screen
+uniform bool c_adaptiveSampling;
+// The AdaptiveWork buffer of adaptive_mask.glsl, read as a buffer texture since every shader storage block the
+// megakernel may have is taken. Word 3 holds the pixel count and the packed pixels follow the four header words.
+layout(binding = 1) uniform usamplerBuffer adaptiveWork;
+const int c_adaptiveHeaderWords = 4;
+// Pixels a workgroup of the per-pixel dispatch covers
+const uint c_tileWidth = 8u;
+const uint c_tileHeight = 4u;
+
+// Viewport and lens of the camera in world space
+struct Camera {
+    vec3 viewportUpperLeft;
+    vec3 pixelDeltaU;
+    vec3 pixelDeltaV;
+    vec3 defocusDiskU;
+    vec3 defocusDiskV;
+};
+
+Camera setupCamera() {
+    float aspectRatio = float(iResolution.x) / float(iResolution.y);
+
+    float theta = radians(c_FOVDegrees);
+    float h = tan(theta / 2);
+    float viewportHeight = 2.0 * h * c_focusDist;
+    float viewportWidth = aspectRatio * viewportHeight;
+
+    vec3 w = normalize(c_lookFrom - c_lookAt);
+    vec3 u = normalize(cross(c_lookUp, w));
+    vec3 v = cross(w, u);
+
+    vec3 viewportU = viewportWidth * u;
+    vec3 viewportV = viewportHeight * -v;
+
+    Camera camera;
+    camera.pixelDeltaU = viewportU / float(iResolution.x);
+    camera.pixelDeltaV = viewportV / float(iResolution.y);
+
+    camera.viewportUpperLeft = c_lookFrom - (c_focusDist * w) - viewportV / 2.0 - viewportU / 2;
+
+    float defocusRadius = c_defocusAngle <= 0.0 ? 0.0 : c_focusDist * tan(radians(c_defocusAngle / 2.0));
+    camera.defocusDiskU = u * defocusRadius;
+    camera.defocusDiskV = v * defocusRadius;
+    return camera;
+}
+
+Ray getRay(in ivec2 fragCoord, in Camera camera, inout uint rngState) {
+    vec2 offset = vec2(RandomFloat(rngState), RandomFloat(rngState));
+    vec3 pixelSample = camera.viewportUpperLeft
+    + (float(fragCoord.x) + offset.x) * camera.pixelDeltaU
+    + (float(fragCoord.y) + offset.y) * camera.pixelDeltaV;
+
+    vec3 rayOrigin = (c_defocusAngle <= 0) ? c_lookFrom : defocusDiskSample(camera.defocusDiskU, camera.defocusDiskV, rngState) + c_lookFrom;
+    vec3 rayDirection = normalize(pixelSample - rayOrigin);
+
+    return Ray(rayOrigin, rayDirection);
+}
+
+// Pixel at a slot of the adaptive work list, false past its end
+bool workListPixel(in uint slot, out ivec2 fragCoord) {
+    fragCoord = ivec2(0);
+    if (slot >= texelFetch(adaptiveWork, 3).r) {
+        return false;
+    }
+    uint packedPixel = texelFetch(adaptiveWork, c_adaptiveHeaderWords + int(slot)).r;
+    fragCoord = ivec2(packedPixel & 0xffffu, packedPixel >> 16);
+    return true;
+}
+
+// Pixel of this invocation and its slot, the row major pixel index or the position in the adaptive work list.
+// False for invocations past the end of the work list.
+bool dispatchPixel(out ivec2 fragCoord, out uint slot) {
+    fragCoord = ivec2(gl_GlobalInvocationID.xy);
+    slot = uint(fragCoord.y) * uint(iResolution.x) + uint(fragCoord.x);
+    if (!c_adaptiveSampling) {
+        return true;
+    }
+    slot = gl_WorkGroupID.x * (gl_WorkGroupSize.x * gl_WorkGroupSize.y) + gl_LocalInvocationIndex;
+    return workListPixel(slot, fragCoord);
+}
+
+// Pixel of a frame's item-th work item and its slot like dispatchPixel. Items walk the screen in the tiles of a
+// regular dispatch, so consecutive items stay close on screen, or the adaptive work list in order.
+// False once the frame's items run out.
+bool workItemPixel(in uint item, out ivec2 fragCoord, out uint slot) {
+    if (c_adaptiveSampling) {
+        slot = item;
+        return workListPixel(item, fragCoord);
+    }
+    uint tileSize = c_tileWidth * c_tileHeight;
+    uint tilesX = uint(iResolution.x) / c_tileWidth;
+    uint tile = item / tileSize;
+    uint lane = item % tileSize;
+    fragCoord = ivec2((tile % tilesX) * c_tileWidth + lane % c_tileWidth, (tile / tilesX) * c_tileHeight + lane / c_tileWidth);
+    slot = uint(fragCoord.y) * uint(iResolution.x) + uint(fragCoord.x);
+    return tile < tilesX * (uint(iResolution.y) / c_tileHeight);
+}
+
+// Pixels converge at their own pace, so each counts its own frames. The first frame after a reset starts over.
+vec4 loadPixelStats(in ivec2 fragCoord) {
+    return frameCounter == 0u ? vec4(0.0) : imageLoad(imgVariance, fragCoord);
+}
+
+// Adds a frame's samples of a pixel, whose mean is colour, to its running sums
+void accumulatePixel(in ivec2 fragCoord, in vec4 stats, in vec3 colour) {
+    // The first frame after a reset starts over like loadPixelStats
+    vec4 accumulated = frameCounter == 0u ? vec4(0.0) : texelFetch(accumulationTexture, fragCoord, 0);
+
+    // Welford's update of the running luminance variance
+    float luminance = dot(colour, vec3(0.2126, 0.7152, 0.0722));
+    stats.x += 1.0;
+    float delta = luminance - stats.y;
+    stats.y += delta / stats.x;
+    stats.z += delta * (luminance - stats.y);
+    imageStore(imgVariance, fragCoord, stats);
+
+    if (c_accumulateMean) {
+        imageStore(imgAccumulation, fragCoord, vec4(mix(accumulated.rgb, colour, 1.0 / stats.x), 1.0));
+        return;
+    }
+    float samples = float(c_samplesPerPixel);
+    imageStore(imgAccumulation, fragCoord, accumulated + vec4(colour * samples, samples));
+}
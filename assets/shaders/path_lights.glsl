@@ -0,0 +1,231 @@
+// Emitters and the light BVH and alias table light samples pick them from
+
+// Emissive primitives sampled for direct light, with the instance indexed in TLAS leaf order
+struct Emitter {
+    uint instance;
+    uint primitiveRef;
+};
+
+layout(std430, binding = 16) buffer Emitters {
+    Emitter emitters[];
+};
+
+// Walker alias table over the emitters, weighted by emission strength times world space area
+struct EmitterAlias {
+    float threshold;
+    uint alias;
+};
+
+layout(std430, binding = 17) buffer EmitterAliases {
+    EmitterAlias emitterAliases[];
+};
+
+// Light BVH over the emitters with one emitter per leaf. Besides the box every node bounds the directions its
+// emitters face, a cone of half angle thetaO around axis, and how far past them they emit, thetaE.
+struct LightNode {
+    vec3 aabbMin;
+    float power;
+    vec3 aabbMax;
+    uint leftFirst; // left child for inner nodes (right is leftFirst + 1), emitter index for leaves
+    vec3 axis;
+    float cosThetaO;
+    float cosThetaE;
+    uint emitterCount; // 0 for inner nodes
+};
+
+layout(std430, binding = 18) buffer LightNodes {
+    LightNode lightNodes[];
+};
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of the angles a and b
+float cosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+    return cosA > cosB ? 1.0 : cosA * cosB + sinA * sinB;
+}
+
+float sinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+    return cosA > cosB ? 0.0 : sinA * cosB - cosA * sinB;
+}
+
+// Bound on the light a node's emitters send to a surface at origin facing normal: the power over the squared
+// distance, times the cosines at the emitters and at the surface at the most favourable angles the box and the
+// normal cone allow. Zero when no emitter in the node can light the surface.
+float lightNodeImportance(in LightNode node, in vec3 origin, in vec3 normal) {
+    vec3 center = (node.aabbMin + node.aabbMax) * 0.5;
+    vec3 toOrigin = origin - center;
+    float distanceSquared = dot(toOrigin, toOrigin);
+    float radiusSquared = dot(node.aabbMax - center, node.aabbMax - center);
+    // Distances are clamped to half the box diagonal, the bounding sphere's radius, so points next to small nodes
+    // do not blow up
+    float clampedDistanceSquared = max(distanceSquared, radiusSquared);
+    // Every direction is possible from inside the box's bounding sphere
+    if (distanceSquared <= radiusSquared) {
+        return node.power / clampedDistanceSquared;
+    }
+    vec3 direction = toOrigin * inversesqrt(distanceSquared);
+    float cosThetaB = sqrt(1.0 - radiusSquared / distanceSquared);
+    float sinThetaB = sqrt(radiusSquared / distanceSquared);
+
+    // Angle from the normal cone to the surface, less what the bounding sphere subtends
+    float cosThetaW = dot(node.axis, direction);
+    float sinThetaW = sqrt(max(0.0, 1.0 - cosThetaW * cosThetaW));
+    float sinThetaO = sqrt(max(0.0, 1.0 - node.cosThetaO * node.cosThetaO));
+    float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, node.cosThetaO);
+    float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, node.cosThetaO);
+    float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+    if (cosThetaP <= node.cosThetaE) {
+        return 0.0;
+    }
+
+    // Angle from the surface normal to the bounding sphere
+    float cosThetaI = dot(normal, -direction);
+    float sinThetaI = sqrt(max(0.0, 1.0 - cosThetaI * cosThetaI));
+    float cosThetaIP = cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+    if (cosThetaIP <= 0.0) {
+        return 0.0;
+    }
+    return node.power * cosThetaP * cosThetaIP / clampedDistanceSquared;
+}
+
+bool lightNodeHolds(in LightNode node, in vec3 point) {
+    return all(greaterThanEqual(point, node.aabbMin - c_rayPosNormalNudge)) && all(lessThanEqual(point, node.aabbMax + c_rayPosNormalNudge));
+}
+
+// Walks the light BVH from the root to a leaf, choosing between children in proportion to their importance
+// at origin. Returns the leaf's emitter and the probability of reaching it, zero when no emitter can light origin.
+float sampleLightBVH(in vec3 origin, in vec3 normal, inout uint rngState, out uint emitterIndex) {
+    LightNode node = lightNodes[0];
+    if (lightNodeImportance(node, origin, normal) <= 0.0) {
+        return 0.0;
+    }
+    float pmf = 1.0;
+    // One number picks the whole path, rescaled to [0, 1) after every choice, so the descent costs a single dimension
+    float u = RandomFloat(rngState);
+    while (node.emitterCount == 0u) {
+        LightNode left = lightNodes[node.leftFirst];
+        LightNode right = lightNodes[node.leftFirst + 1u];
+        float leftImportance = lightNodeImportance(left, origin, normal);
+        float rightImportance = lightNodeImportance(right, origin, normal);
+        float total = leftImportance + rightImportance;
+        if (total <= 0.0) {
+            return 0.0;
+        }
+        float leftProbability = leftImportance / total;
+        if (u < leftProbability) {
+            node = left;
+            pmf *= leftProbability;
+            u = min(u / leftProbability, c_oneMinusEpsilon);
+        } else {
+            node = right;
+            pmf *= rightImportance / total;
+            u = min((u - leftProbability) / (1.0 - leftProbability), c_oneMinusEpsilon);
+        }
+    }
+    emitterIndex = node.leftFirst;
+    return pmf;
+}
+
+// Probability of sampleLightBVH reaching the emitter hit at point. Its leaf is found by descending into every child
+// whose box holds the point, carrying the probability of the path down to it.
+float lightBVHPmf(in vec3 origin, in vec3 normal, in vec3 point, uint instance, uint primitiveRef) {
+    if (lightNodeImportance(lightNodes[0], origin, normal) <= 0.0) {
+        return 0.0;
+    }
+    uint stack[c_bvhStackSize];
+    float stackPmf[c_bvhStackSize];
+    uint stackPtr = 0u;
+    uint nodeIndex = 0u;
+    float pmf = 1.0;
+    while (true) {
+        LightNode node = lightNodes[nodeIndex];
+        if (node.emitterCount > 0u) {
+            Emitter emitter = emitters[node.leftFirst];
+            if (emitter.instance == instance && emitter.primitiveRef == primitiveRef) {
+                return pmf;
+            }
+        } else {
+            LightNode left = lightNodes[node.leftFirst];
+            LightNode right = lightNodes[node.leftFirst + 1u];
+            float leftImportance = lightNodeImportance(left, origin, normal);
+            float rightImportance = lightNodeImportance(right, origin, normal);
+            float total = leftImportance + rightImportance;
+            if (rightImportance > 0.0 && lightNodeHolds(right, point) && stackPtr < c_bvhStackSize) {
+                stack[stackPtr] = node.leftFirst + 1u;
+                stackPmf[stackPtr++] = pmf * rightImportance / total;
+            }
+            if (leftImportance > 0.0 && lightNodeHolds(left, point) && stackPtr < c_bvhStackSize) {
+                stack[stackPtr] = node.leftFirst;
+                stackPmf[stackPtr++] = pmf * leftImportance / total;
+            }
+        }
+        if (stackPtr == 0u) {
+            return 0.0;
+        }
+        --stackPtr;
+        nodeIndex = stack[stackPtr];
+        pmf = stackPmf[stackPtr];
+    }
+    return 0.0;
+}
+
+// Picks an emitter, by its importance at origin through the light BVH or by power from the alias table, and a point
+// on it uniformly by area. Returns false when no emitter can light origin, otherwise the world space point, its normal,
+// the emitted radiance and the pdf of the sample per unit of world space area.
+bool sampleEmitter(in vec3 origin, in vec3 surfaceNormal, inout uint rngState, out vec3 point, out vec3 normal, out vec3 radiance, out float pdfArea) {
+    uint emitterIndex;
+    float pmf = 0.0;
+    if (c_lightBVH) {
+        pmf = sampleLightBVH(origin, surfaceNormal, rngState, emitterIndex);
+        if (pmf <= 0.0) {
+            return false;
+        }
+    } else {
+        uint slot = min(uint(RandomFloat(rngState) * float(numOfEmitters)), numOfEmitters - 1u);
+        EmitterAlias entry = emitterAliases[slot];
+        emitterIndex = RandomFloat(rngState) < entry.threshold ? slot : entry.alias;
+    }
+    Emitter emitter = emitters[emitterIndex];
+    Instance inst = instances[emitter.instance];
+    vec3 objectPoint;
+    vec3 objectNormal;
+    float objectArea;
+    uint materialId;
+    bool quad = (emitter.primitiveRef & c_quadRefBit) != 0u;
+    if (quad) {
+        uint q = inst.quadOffset + (emitter.primitiveRef & ~c_quadRefBit);
+        QuadPlane plane = quadPlanes[q];
+        objectPoint = plane.a.xyz + RandomFloat(rngState) * plane.u.xyz + RandomFloat(rngState) * plane.v.xyz;
+        vec3 n = cross(plane.u.xyz, plane.v.xyz);
+        objectArea = length(n);
+        objectNormal = n / objectArea;
+        materialId = quads[q].materialId;
+    } else {
+        uint s = inst.sphereOffset + emitter.primitiveRef;
+        vec4 sphere = sphereGeometry[s];
+        objectNormal = randomUnitVector(rngState);
+        objectPoint = sphere.xyz + sphere.w * objectNormal;
+        objectArea = 2.0 * c_twopi * sphere.w * sphere.w;
+        materialId = spheres[s].materialId;
+    }
+
+    // Back to world space, the transposed world to object rows carry normals
+    mat3 normalToWorld = mat3(inst.worldToObject[0].xyz, inst.worldToObject[1].xyz, inst.worldToObject[2].xyz);
+    vec3 translation = vec3(inst.worldToObject[0].w, inst.worldToObject[1].w, inst.worldToObject[2].w);
+    point = transpose(inverse(normalToWorld)) * (objectPoint - translation);
+    normal = normalize(normalToWorld * objectNormal);
+
+    Material material = materials[materialId];
+    radiance = material.emission * material.emissionStrength;
+    if (!c_lightBVH) {
+        pmf = emitterWeight(inst, quad, objectArea, objectNormal, material.emissionStrength) / emitterPower;
+    }
+    pdfArea = pmf / (objectArea * pointAreaScale(inst, objectNormal));
+    return true;
+}
+
+// Probability of sampleEmitter picking the emitter hit by rec for a light sample taken at origin
+float emitterPmf(in vec3 origin, in vec3 normal, in HitRecord rec) {
+    if (c_lightBVH) {
+        return lightBVHPmf(origin, normal, rec.p, rec.instance, rec.primitiveRef);
+    }
+    return rec.emitterWeight / emitterPower;
+}
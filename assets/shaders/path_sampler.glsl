@@ -0,0 +1,163 @@
+// Sampler backends. The RNG state of a path is the index of its next dimension, every backend turns it together
+// with samplePixel and sampleIndex into a number, so a sample depends on nothing but those three.
+const uint c_samplerRandom = 0;
+const uint c_samplerSobol = 1;
+const uint c_samplerBlueNoise = 2;
+const uint c_sobolDimensions = 4;
+const uint c_blueNoiseSize = 64;
+const uint c_rank1Dimensions = 256;
+// Dimensions of the camera sample (pixel jitter and lens), then of every bounce: the BSDF sample in its first
+// four and the light sample in its last four
+const uint c_cameraDimensions = 4;
+const uint c_bounceDimensions = 8;
+const uint c_lightDimensions = 4;
+// Largest float below 1
+const float c_oneMinusEpsilon = 0.99999994;
+
+layout(std430, binding = 19) buffer SamplerTables {
+    uint sobolMatrices[c_sobolDimensions * 32];
+    uint blueNoise[c_blueNoiseSize * c_blueNoiseSize];
+    uint rank1Generators[c_rank1Dimensions];
+};
+
+uvec2 samplePixel;
+uint sampleIndex;
+
+// Counter based hash of four keys into four independent outputs (Jarzynski and Olano 2020)
+uvec4 pcg4d(in uvec4 v) {
+    v = v * 1664525u + 1013904223u;
+    v.x += v.y * v.w;
+    v.y += v.z * v.x;
+    v.z += v.x * v.y;
+    v.w += v.y * v.z;
+    v ^= v >> 16u;
+    v.x += v.y * v.w;
+    v.y += v.z * v.x;
+    v.z += v.x * v.y;
+    v.w += v.y * v.z;
+    return v;
+}
+
+// Point sampleIndex of Sobol dimension (below c_sobolDimensions) in 32 bit fixed point
+uint sobol(in uint index, in uint dimension) {
+    uint x = 0u;
+    for (uint bit = 0u; index != 0u; index >>= 1, ++bit) {
+        if ((index & 1u) != 0u) {
+            x ^= sobolMatrices[dimension * 32u + bit];
+        }
+    }
+    return x;
+}
+
+// Hash based nested uniform scramble, an Owen scramble seeded per pixel and dimension (Burley 2020)
+uint nestedUniformScramble(in uint x, in uint seed) {
+    x = bitfieldReverse(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return bitfieldReverse(x);
+}
+
+// Dimensions are padded in groups of four Sobol dimensions, each group shuffling the sample order on its own
+// so the groups do not correlate with each other
+uint sobolSample(in uint dimension) {
+    uint indexSeed = pcg4d(uvec4(samplePixel, dimension / c_sobolDimensions, 0u)).x;
+    uint scrambleSeed = pcg4d(uvec4(samplePixel, dimension, 1u)).x;
+    uint index = nestedUniformScramble(sampleIndex, indexSeed);
+    uint x = sobol(index, dimension % c_sobolDimensions);
+    return nestedUniformScramble(x, scrambleSeed);
+}
+
+// Rank-1 (Kronecker) lattice with its own generator per dimension, rotated per pixel by the blue noise tile.
+// Each dimension reads the tile at its own offset along the R2 sequence, so dimensions do not share a shift.
+uint blueNoiseSample(in uint dimension) {
+    uvec2 offset = uvec2(dimension * 0xc13fa9a9u, dimension * 0x91e10da5u) >> 26;
+    uvec2 tile = (samplePixel + offset) % c_blueNoiseSize;
+    return blueNoise[tile.y * c_blueNoiseSize + tile.x] + sampleIndex * rank1Generators[dimension % c_rank1Dimensions];
+}
+
+float RandomFloat(inout uint state) {
+    uint dimension = state++;
+    uint x;
+    if (c_sampler == c_samplerSobol) {
+        x = sobolSample(dimension);
+    } else if (c_sampler == c_samplerBlueNoise) {
+        x = blueNoiseSample(dimension);
+    } else {
+        x = pcg4d(uvec4(samplePixel, sampleIndex, dimension)).x;
+    }
+    // The top 24 bits, all a float in [0, 1) holds, so the result cannot round up to 1
+    return float(x >> 8) / 16777216.0;
+}
+
+// The samplers below map uniform numbers in closed form, so every call costs the same fixed number of them
+
+// Uniform on the unit sphere: z is uniform in [-1, 1] by Archimedes' hat-box theorem
+vec3 randomUnitVector(inout uint state) {
+    float z = 1.0 - 2.0 * RandomFloat(state);
+    float phi = c_twopi * RandomFloat(state);
+    float r = sqrt(max(0.0, 1.0 - z * z));
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+// Uniform in the unit ball, the radius grows with the cube root of the enclosed volume
+vec3 randomInUnitSphere(inout uint state) {
+    return randomUnitVector(state) * pow(RandomFloat(state), 1.0 / 3.0);
+}
+
+vec3 randomOnHemisphere(vec3 normal, inout uint state) {
+    vec3 onUnitSphere = randomUnitVector(state);
+    if (dot(onUnitSphere, normal) > 0.0) {
+        return onUnitSphere;
+    } else {
+        return -onUnitSphere;
+    }
+}
+
+// Shirley and Chiu's concentric mapping of the unit square onto the unit disk, which keeps strata compact
+vec2 concentricSampleDisk(in vec2 u) {
+    vec2 offset = 2.0 * u - 1.0;
+    if (offset == vec2(0.0)) {
+        return vec2(0.0);
+    }
+    float r;
+    float theta;
+    if (abs(offset.x) > abs(offset.y)) {
+        r = offset.x;
+        theta = 0.25 * c_pi * (offset.y / offset.x);
+    } else {
+        r = offset.y;
+        theta = 0.5 * c_pi - 0.25 * c_pi * (offset.x / offset.y);
+    }
+    return r * vec2(cos(theta), sin(theta));
+}
+
+vec3 randomInUnitDisk(inout uint state) {
+    return vec3(concentricSampleDisk(vec2(RandomFloat(state), RandomFloat(state))), 0.0);
+}
+
+// Orthonormal basis around a unit normal, without the branches on its direction (Duff et al. 2017)
+void orthonormalBasis(in vec3 n, out vec3 tangent, out vec3 bitangent) {
+    float s = n.z >= 0.0 ? 1.0 : -1.0;
+    float a = -1.0 / (s + n.z);
+    float b = n.x * n.y * a;
+    tangent = vec3(1.0 + s * n.x * n.x * a, s * b, -s * n.x);
+    bitangent = vec3(b, s + n.y * n.y * a, -n.y);
+}
+
+// Cosine weighted direction around a unit normal: the concentric disk lifted onto the hemisphere (Malley's method)
+vec3 randomCosineDirection(in vec3 normal, inout uint state) {
+    vec2 d = concentricSampleDisk(vec2(RandomFloat(state), RandomFloat(state)));
+    float z = sqrt(max(0.0, 1.0 - dot(d, d)));
+    vec3 tangent;
+    vec3 bitangent;
+    orthonormalBasis(normal, tangent, bitangent);
+    return d.x * tangent + d.y * bitangent + z * normal;
+}
+
+vec3 defocusDiskSample(in vec3 defocusDiskU, in vec3 defocusDiskV, inout uint rngState) {
+    vec3 p = randomInUnitDisk(rngState);
+    return vec3(0) + (p.x * defocusDiskU) + (p.y * defocusDiskV);
+}
@@ -0,0 +1,150 @@
+// Primitive records, instances and materials, read by traversal, light sampling and resolveHit
+
+struct Quad {
+    vec3 a;
+    uint materialId;
+    vec3 b;
+    vec3 c;
+    vec3 d;
+    vec3 normal;
+    vec3 w;
+};
+
+layout(std430, binding = 1) buffer Quads {
+    Quad quads[];
+};
+
+struct Sphere {
+    vec3 center;
+    float radius;
+    uint materialId;
+};
+
+layout(std430, binding = 0) buffer Spheres {
+    Sphere spheres[];
+};
+
+// Placement of a geometry's BLAS, stored in TLAS leaf order
+struct Instance {
+    vec4 worldToObject[3]; // rows of the 3x4 world to object transform
+    uint sphereOffset;
+    uint quadOffset;
+    uint nodeOffset;
+    uint refOffset;
+};
+
+layout(std430, binding = 4) buffer Instances {
+    Instance instances[];
+};
+
+// Geometry only copies of the spheres and quads read during traversal, so a primitive test loads
+// 16 or 48 bytes instead of the whole record. The records in Spheres and Quads are read by resolveHit.
+layout(std430, binding = 13) buffer SphereGeometry {
+    vec4 sphereGeometry[]; // center, radius
+};
+
+// Quad origin a and edges u = b - a, v = d - a, with w split over the fourth components
+struct QuadPlane {
+    vec4 a;
+    vec4 u;
+    vec4 v;
+};
+
+layout(std430, binding = 14) buffer QuadPlanes {
+    QuadPlane quadPlanes[];
+};
+
+// Surfaces shared by all geometries, indexed by the primitives' materialId
+struct Material {
+    vec3 albedo;
+    float reflectivity;
+    vec3 emission;
+    float emissionStrength;
+    float fuzz;
+    float refractionIndex;
+};
+
+layout(std430, binding = 15) buffer Materials {
+    Material materials[];
+};
+
+// The object space direction is left unnormalized so hit distances stay in world units
+Ray toObjectSpace(in Ray ray, in Instance inst) {
+    return Ray(
+        vec3(dot(inst.worldToObject[0].xyz, ray.origin) + inst.worldToObject[0].w,
+             dot(inst.worldToObject[1].xyz, ray.origin) + inst.worldToObject[1].w,
+             dot(inst.worldToObject[2].xyz, ray.origin) + inst.worldToObject[2].w),
+        vec3(dot(inst.worldToObject[0].xyz, ray.direction),
+             dot(inst.worldToObject[1].xyz, ray.direction),
+             dot(inst.worldToObject[2].xyz, ray.direction)));
+}
+
+// Ratio of world to object space area at a point with the given object space normal. By Nanson's formula it is
+// the length of the normal carried to world space over the determinant of the world to object transform.
+float pointAreaScale(in Instance inst, in vec3 objectNormal) {
+    mat3 normalToWorld = mat3(inst.worldToObject[0].xyz, inst.worldToObject[1].xyz, inst.worldToObject[2].xyz);
+    return length(normalToWorld * objectNormal) / abs(determinant(normalToWorld));
+}
+
+// Ratio of world to object space area of a whole sphere as upload_emitters weights it, exact under uniform scale
+float sphereAreaScale(in Instance inst) {
+    mat3 normalToWorld = mat3(inst.worldToObject[0].xyz, inst.worldToObject[1].xyz, inst.worldToObject[2].xyz);
+    return pow(abs(determinant(normalToWorld)), -2.0 / 3.0);
+}
+
+// Weight of an emitter in the alias table as upload_emitters computes it, emission strength times world space area
+float emitterWeight(in Instance inst, bool quad, float objectArea, in vec3 objectNormal, float emissionStrength) {
+    return emissionStrength * objectArea * (quad ? pointAreaScale(inst, objectNormal) : sphereAreaScale(inst));
+}
+
+// Fetches the material of the hit traversal settled on and builds its world space normal
+HitRecord resolveHit(in Ray ray, in HitInfo hit) {
+    Instance inst = instances[hit.instance];
+    Ray objectRay = toObjectSpace(ray, inst);
+    HitRecord rec;
+    rec.t = hit.t;
+    vec3 outwardNormal;
+    uint materialId;
+    float objectArea;
+    bool quad = (hit.primitiveRef & c_quadRefBit) != 0u;
+    if (quad) {
+        Quad record = quads[inst.quadOffset + (hit.primitiveRef & ~c_quadRefBit)];
+        outwardNormal = record.normal;
+        materialId = record.materialId;
+        objectArea = length(cross(record.b - record.a, record.d - record.a));
+    } else {
+        Sphere record = spheres[inst.sphereOffset + hit.primitiveRef];
+        outwardNormal = (getRayPointAt(objectRay, hit.t) - record.center) / record.radius;
+        materialId = record.materialId;
+        objectArea = 2.0 * c_twopi * record.radius * record.radius;
+    }
+    setFaceNormal(objectRay, outwardNormal, rec);
+    Material material = materials[materialId];
+    rec.albedo = material.albedo;
+    rec.reflectivity = material.reflectivity;
+    rec.fuzz = material.fuzz;
+    rec.refractionIndex = material.refractionIndex;
+    rec.emission = material.emission;
+    rec.emissionStrength = material.emissionStrength;
+    if (material.emissionStrength > 0.0 && material.emission != vec3(0.0)) {
+        rec.instance = hit.instance;
+        rec.primitiveRef = hit.primitiveRef;
+        rec.emitterWeight = emitterWeight(inst, quad, objectArea, outwardNormal, material.emissionStrength);
+        rec.emitterPointPdf = 1.0 / (objectArea * pointAreaScale(inst, outwardNormal));
+    }
+
+    // Back to world space, normals go through the inverse transpose
+    rec.p = getRayPointAt(ray, hit.t);
+    vec3 n = rec.normal;
+    rec.normal = normalize(inst.worldToObject[0].xyz * n.x + inst.worldToObject[1].xyz * n.y + inst.worldToObject[2].xyz * n.z);
+    return rec;
+}
+
+// Material of the primitive a hit settled on, without resolving the rest of the hit
+uint hitMaterialId(in HitInfo hit) {
+    Instance inst = instances[hit.instance];
+    if ((hit.primitiveRef & c_quadRefBit) != 0u) {
+        return quads[inst.quadOffset + (hit.primitiveRef & ~c_quadRefBit)].materialId;
+    }
+    return spheres[inst.sphereOffset + hit.primitiveRef].materialId;
+}
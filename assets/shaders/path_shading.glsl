@@ -0,0 +1,165 @@
+// Materials: the lobes a hit scatters into, their pdfs and the light arriving along a path at a hit
+
+float reflectance(float cosine, float refraction_index) {
+    float r0 = ((1.0 - refraction_index) / (1.0 + refraction_index));
+    r0 = r0 * r0;
+    return r0 + (1.0 - r0) * pow((1.0 - cosine), 5.0);
+}
+
+// Lobes the next direction is drawn from at a hit and the probability of each: the mirror lobe, jittered by
+// fuzz when glossy, and the cosine weighted diffuse lobe. Refraction takes what is left of a dielectric.
+struct ScatterLobes {
+    vec3 mirror;
+    float specular;
+    float diffuse;
+    bool glossy;
+};
+
+ScatterLobes getScatterLobes(in Ray ray, in HitRecord rec) {
+    ScatterLobes lobes;
+    vec3 unitDirection = normalize(ray.direction);
+    lobes.mirror = reflect(unitDirection, rec.normal);
+    lobes.glossy = rec.fuzz > c_glossyFuzz;
+    if (rec.refractionIndex > 0) {
+        float ri = rec.frontFace ? (1.0 / rec.refractionIndex) : rec.refractionIndex;
+        float cosTheta = min(dot(-unitDirection, rec.normal), 1.0);
+        float sinTheta = sqrt(1.0 - cosTheta * cosTheta);
+        lobes.specular = ri * sinTheta > 1.0 ? 1.0 : reflectance(cosTheta, ri);
+        lobes.diffuse = 0.0;
+    } else {
+        lobes.specular = rec.reflectivity;
+        lobes.diffuse = 1.0 - rec.reflectivity;
+    }
+    return lobes;
+}
+
+// Solid angle pdf of mirror + fuzz * randomUnitVector pointing along direction. The sampled point lies on a
+// sphere of radius fuzz around the unit mirror direction, which the direction crosses at up to two distances t.
+float fuzzyReflectionPdf(in vec3 mirror, in float fuzz, in vec3 direction) {
+    float b = dot(direction, mirror);
+    float discriminant = b * b - 1.0 + fuzz * fuzz;
+    if (discriminant <= 0.0) {
+        return 0.0;
+    }
+    float root = sqrt(discriminant);
+    float tFar = b + root;
+    float tNear = b - root;
+    float sum = (tFar > 0.0 ? tFar * tFar : 0.0) + (tNear > 0.0 ? tNear * tNear : 0.0);
+    return sum / (2.0 * c_twopi * fuzz * root);
+}
+
+// Solid angle pdf of the lobes light samples can reach scattering into direction. The material reflects
+// albedo times this pdf per unit of projected solid angle, so it doubles as the reflected fraction.
+float scatterPdf(in ScatterLobes lobes, in HitRecord rec, in vec3 direction) {
+    float pdf = lobes.diffuse * max(dot(rec.normal, direction), 0.0) / c_pi;
+    if (lobes.glossy) {
+        pdf += lobes.specular * fuzzyReflectionPdf(lobes.mirror, rec.fuzz, direction);
+    }
+    return pdf;
+}
+
+float powerHeuristic(float pdf, float otherPdf) {
+    float pdfSquared = pdf * pdf;
+    return pdfSquared / (pdfSquared + otherPdf * otherPdf);
+}
+
+// Whether light samples can reach any lobe of the hit, delta lobes aside
+bool takesLightSamples(in ScatterLobes lobes) {
+    return lobes.diffuse > 0.0 || (lobes.glossy && lobes.specular > 0.0);
+}
+
+// Light emitted at a hit, weighted against the light sample taken at the hit the ray was scattered from, whose
+// solid angle pdf and normal are bsdfPdf and scatterNormal. Back faces never come out of sampleEmitter, so they keep
+// their full weight.
+vec3 emittedLight(in Ray ray, in HitRecord rec, in float bsdfPdf, in vec3 scatterNormal, in bool sampleLights) {
+    vec3 emitted = rec.emission * rec.emissionStrength;
+    if (emitted == vec3(0.0)) {
+        return vec3(0.0);
+    }
+    float weight = 1.0;
+    if (sampleLights && bsdfPdf > 0.0 && rec.frontFace) {
+        vec3 toHit = rec.p - ray.origin;
+        float cosLight = dot(rec.normal, -normalize(toHit));
+        float lightPdfArea = emitterPmf(ray.origin, scatterNormal, rec) * rec.emitterPointPdf;
+        weight = powerHeuristic(bsdfPdf, lightPdfArea * dot(toHit, toHit) / cosLight);
+    }
+    return emitted * weight;
+}
+
+// Light reaching a hit from one emitter sample unless shadowRay meets something before shadowDistance, weighted
+// against the scattered ray finding the same emitter. Zero when the sample faces away or falls outside the lobes.
+vec3 sampleUnshadowedLight(in HitRecord rec, in ScatterLobes lobes, inout uint rngState, out Ray shadowRay, out float shadowDistance) {
+    shadowRay = Ray(vec3(0.0), vec3(0.0));
+    shadowDistance = 0.0;
+    vec3 lightPoint;
+    vec3 lightNormal;
+    vec3 radiance;
+    float pdfArea;
+    vec3 origin = rec.p + c_rayPosNormalNudge * rec.normal;
+    if (!sampleEmitter(origin, rec.normal, rngState, lightPoint, lightNormal, radiance, pdfArea)) {
+        return vec3(0.0);
+    }
+    vec3 toLight = lightPoint - origin;
+    float distanceSquared = dot(toLight, toLight);
+    float lightDistance = sqrt(distanceSquared);
+    vec3 direction = toLight / lightDistance;
+    float cosSurface = dot(rec.normal, direction);
+    float cosLight = dot(lightNormal, -direction);
+    if (cosSurface <= 0.0 || cosLight <= 0.0) {
+        return vec3(0.0);
+    }
+    float bsdfPdf = scatterPdf(lobes, rec, direction);
+    if (bsdfPdf <= 0.0) {
+        return vec3(0.0);
+    }
+    // Stop short of the emitter so it does not shadow itself
+    shadowRay = Ray(origin, direction);
+    shadowDistance = lightDistance - c_rayPosNormalNudge;
+    float lightPdf = pdfArea * distanceSquared / cosLight;
+    return rec.albedo * radiance * bsdfPdf / lightPdf * powerHeuristic(lightPdf, bsdfPdf);
+}
+
+// Continues the path from a hit: draws the next direction from the lobes, leaves its solid angle pdf in bsdfPdf,
+// zero for delta lobes which light samples cannot reach, and plays Russian roulette. False when the path ends.
+bool scatterRay(inout Ray ray, in HitRecord rec, in ScatterLobes lobes, inout vec3 rayColour, out float bsdfPdf, inout uint rngState) {
+    // Determine new ray direction (refraction)
+    vec3 newDirection;
+    bool deltaBounce;
+    if (rec.refractionIndex > 0) {
+        if (RandomFloat(rngState) < lobes.specular) {
+            newDirection = lobes.mirror + rec.fuzz * randomUnitVector(rngState);
+            ray = Ray(rec.p + c_rayPosNormalNudge * rec.normal, newDirection);
+            deltaBounce = !lobes.glossy;
+        } else {
+            float ri = rec.frontFace ? (1.0 / rec.refractionIndex) : rec.refractionIndex;
+            newDirection = refract(normalize(ray.direction), rec.normal, ri);
+            ray = Ray(rec.p + c_rayPosNormalNudge * newDirection, newDirection);
+            deltaBounce = true;
+        }
+    } else {
+        // Determine new ray direction (diffuse or specular)
+        bool isSpecularBounce = lobes.specular > 0.0 && RandomFloat(rngState) < lobes.specular;
+        if (isSpecularBounce) {
+            newDirection = lobes.mirror + rec.fuzz * randomUnitVector(rngState);
+        } else {
+            newDirection = randomCosineDirection(rec.normal, rngState);
+        }
+        deltaBounce = isSpecularBounce && !lobes.glossy;
+        ray = Ray(rec.p + c_rayPosNormalNudge * rec.normal, newDirection);
+    }
+    // Directions below the surface never come out of a light sample either
+    vec3 unitNewDirection = normalize(newDirection);
+    bool belowSurface = dot(unitNewDirection, rec.normal) <= 0.0;
+    bsdfPdf = deltaBounce || belowSurface ? 0.0 : scatterPdf(lobes, rec, unitNewDirection);
+
+    // Modulate ray colour based on material properties
+    rayColour *= rec.albedo;
+
+    // Russian Roulette termination
+    float probability = max(rayColour.r, max(rayColour.g, rayColour.b));
+    if (RandomFloat(rngState) >= probability) {
+        return false;
+    }
+    rayColour /= probability; // Normalize ray colour
+    return true;
+}
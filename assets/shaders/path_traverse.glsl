@@ -0,0 +1,504 @@
+// Acceleration structures and the closest-hit and any-hit queries over them
+
+struct BVHNode {
+    vec3 aabbMin;
+    uint leftFirst;
+    vec3 aabbMax;
+    uint primCount;
+};
+
+layout(std430, binding = 2) buffer BVHNodes {
+    BVHNode bvhNodes[];
+};
+
+// References into spheres[] or, with c_quadRefBit set, into quads[]
+layout(std430, binding = 3) buffer PrimitiveRefs {
+    uint primitiveRefs[];
+};
+
+layout(std430, binding = 5) buffer TLASNodes {
+    BVHNode tlasNodes[];
+};
+
+// Collapsed 4 or 8 wide BLAS nodes, each a header (origin, child count, scale), one reference per child
+// and the child boxes quantized to one byte per plane
+layout(std430, binding = 6) buffer WideBVHNodes {
+    uint wideNodes[];
+};
+
+// Rays traced and primitives tested during the dispatch, only counted while benchmarking
+layout(std430, binding = 7) buffer RayCounter {
+    uint rayCount;
+    uint sphereTests;
+    uint quadTests;
+};
+
+// Uniform grids, a header (min corner, cell size, resolution) followed by (first, count) per cell
+// and the cells' primitive references; cells with c_gridSubgridBit in count point to a second level grid
+layout(std430, binding = 8) buffer GridData {
+    uint gridData[];
+};
+
+float ScalarTriple(vec3 u, vec3 v, vec3 w) {
+    return dot(cross(u, v), w);
+}
+
+// Distance to a front facing quad inside the interval, c_superFar when it is missed, and the hit's
+// quad coordinates along the edges u and v. One plane intersection followed by a 2D bounds check
+// using the host precomputed w, which is parallel to the normal and doubles as the plane normal.
+float intersectQuad(in Ray ray, in Interval interval, in vec3 a, in vec3 u, in vec3 v, in vec3 w, out vec2 barycentrics) {
+    barycentrics = vec2(0.0);
+    // Back faces, rays parallel to the plane and degenerate quads with a zero w all miss
+    float denom = dot(w, ray.direction);
+    if (denom >= 0.0) {
+        return c_superFar;
+    }
+
+    float t = dot(w, a - ray.origin) / denom;
+    if (!intervalSurrounds(interval, t)) {
+        return c_superFar;
+    }
+
+    vec3 planar = getRayPointAt(ray, t) - a;
+    float alpha = dot(w, cross(planar, v));
+    float beta = dot(w, cross(u, planar));
+    if (alpha < 0.0 || alpha > 1.0 || beta < 0.0 || beta > 1.0) {
+        return c_superFar;
+    }
+
+    barycentrics = vec2(alpha, beta);
+    return t;
+}
+
+
+// Nearest sphere root inside the interval, c_superFar when there is none
+float intersectSphere(in Ray ray, in Interval interval, in vec3 center, in float radius) {
+    vec3 oc = ray.origin - center;
+    float a = dot(ray.direction, ray.direction);
+    float half_b = dot(oc, ray.direction);
+    float c = dot(oc, oc) - radius * radius;
+    float discriminant = half_b * half_b - a * c;
+
+    if (discriminant > 0) {
+        float sqrtd = sqrt(discriminant);
+        float root = (-half_b - sqrtd) / a;
+        if (intervalSurrounds(interval, root)) {
+            return root;
+        }
+        root = (-half_b + sqrtd) / a;
+        if (intervalSurrounds(interval, root)) {
+            return root;
+        }
+    }
+    return c_superFar;
+}
+
+float intersectAABB(in Ray ray, in vec3 invDirection, in vec3 aabbMin, in vec3 aabbMax, in float tMax) {
+    vec3 t0 = (aabbMin - ray.origin) * invDirection;
+    vec3 t1 = (aabbMax - ray.origin) * invDirection;
+    vec3 tSmall = min(t0, t1);
+    vec3 tBig = max(t0, t1);
+    float tNear = max(max(tSmall.x, tSmall.y), tSmall.z);
+    float tFar = min(min(tBig.x, tBig.y), tBig.z);
+    if (tNear <= tFar && tFar > 0.0 && tNear < tMax) {
+        return tNear;
+    }
+    return c_superFar;
+}
+
+// Records the primitive in hit if the ray meets it inside the interval. Only positions are read here,
+// materials and normals are fetched once for the final hit by resolveHit.
+bool hitPrimitive(in Ray ray, in Interval interval, inout HitInfo hit, in Instance inst, in uint primitiveRef) {
+    float t;
+    vec2 barycentrics = vec2(0.0);
+    if ((primitiveRef & c_quadRefBit) != 0u) {
+        uint q = inst.quadOffset + (primitiveRef & ~c_quadRefBit);
+        quadTestCount++;
+        if (c_soaGeometry) {
+            QuadPlane plane = quadPlanes[q];
+            t = intersectQuad(ray, interval, plane.a.xyz, plane.u.xyz, plane.v.xyz, vec3(plane.a.w, plane.u.w, plane.v.w), barycentrics);
+        } else {
+            t = intersectQuad(ray, interval, quads[q].a, quads[q].b - quads[q].a, quads[q].d - quads[q].a, quads[q].w, barycentrics);
+        }
+        if (t == c_superFar) {
+            return false;
+        }
+    } else {
+        uint s = inst.sphereOffset + primitiveRef;
+        sphereTestCount++;
+        vec4 sphere = c_soaGeometry ? sphereGeometry[s] : vec4(spheres[s].center, spheres[s].radius);
+        t = intersectSphere(ray, interval, sphere.xyz, sphere.w);
+        if (t == c_superFar) {
+            return false;
+        }
+    }
+    hit.t = t;
+    hit.primitiveRef = primitiveRef;
+    hit.barycentrics = barycentrics;
+    return true;
+}
+
+// Any-hit test for visibility rays, the hit it records is thrown away
+bool occludesPrimitive(in Ray ray, in Interval interval, in Instance inst, in uint primitiveRef) {
+    HitInfo unused;
+    return hitPrimitive(ray, interval, unused, inst, primitiveRef);
+}
+
+// Traverses one instance's BLAS with a ray already in its object space
+bool traceBLAS(in Ray ray, inout Interval interval, inout HitInfo hit, in Instance inst, in bool anyHit) {
+    bool hitAnything = false;
+    vec3 invDirection = 1.0 / ray.direction;
+    if (intersectAABB(ray, invDirection, bvhNodes[inst.nodeOffset].aabbMin, bvhNodes[inst.nodeOffset].aabbMax, interval.max) == c_superFar) {
+        return false;
+    }
+
+    // Front to back traversal, the nearer child is visited first and the other one pushed on the stack
+    uint stack[c_bvhStackSize];
+    uint stackPtr = 0;
+    uint nodeIndex = 0;
+    while (true) {
+        BVHNode node = bvhNodes[inst.nodeOffset + nodeIndex];
+        if (node.primCount > 0u) {
+            for (uint i = 0; i < node.primCount; ++i) {
+                uint ref = primitiveRefs[inst.refOffset + node.leftFirst + i];
+                if (anyHit) {
+                    if (occludesPrimitive(ray, interval, inst, ref)) {
+                        return true;
+                    }
+                } else if (hitPrimitive(ray, interval, hit, inst, ref)) {
+                    hitAnything = true;
+                    interval.max = hit.t;
+                }
+            }
+            if (stackPtr == 0u) {
+                break;
+            }
+            nodeIndex = stack[--stackPtr];
+            continue;
+        }
+
+        uint child1 = node.leftFirst;
+        uint child2 = node.leftFirst + 1u;
+        float dist1 = intersectAABB(ray, invDirection, bvhNodes[inst.nodeOffset + child1].aabbMin, bvhNodes[inst.nodeOffset + child1].aabbMax, interval.max);
+        float dist2 = intersectAABB(ray, invDirection, bvhNodes[inst.nodeOffset + child2].aabbMin, bvhNodes[inst.nodeOffset + child2].aabbMax, interval.max);
+        if (dist1 > dist2) {
+            float d = dist1; dist1 = dist2; dist2 = d;
+            uint c = child1; child1 = child2; child2 = c;
+        }
+
+        if (dist1 == c_superFar) {
+            if (stackPtr == 0u) {
+                break;
+            }
+            nodeIndex = stack[--stackPtr];
+        } else {
+            nodeIndex = child1;
+            if (dist2 != c_superFar && stackPtr < c_bvhStackSize) {
+                stack[stackPtr++] = child2;
+            }
+        }
+    }
+
+    return hitAnything;
+}
+
+// Traverses one instance's wide BLAS. Hit children, leaves included, go on the stack with the
+// nearest one pushed last so it is popped next, and leaves are intersected when popped.
+bool traceWideBLAS(in Ray ray, inout Interval interval, inout HitInfo hit, in Instance inst, in bool anyHit) {
+    bool hitAnything = false;
+    vec3 invDirection = 1.0 / ray.direction;
+    uint stride = (c_wideNodeHeader + c_bvhWidth + 6u * c_bvhWidth / 4u + 3u) & ~3u;
+    uint planeStride = c_bvhWidth / 4u;
+
+    uint stack[c_wideStackSize];
+    uint stackPtr = 0;
+    uint childRef = 0;
+    while (true) {
+        if ((childRef & c_wideLeafBit) != 0u) {
+            uint first = childRef & 0x00FFFFFFu;
+            uint count = (childRef >> 24) & 0x7Fu;
+            for (uint i = 0; i < count; ++i) {
+                uint ref = primitiveRefs[inst.refOffset + first + i];
+                if (anyHit) {
+                    if (occludesPrimitive(ray, interval, inst, ref)) {
+                        return true;
+                    }
+                } else if (hitPrimitive(ray, interval, hit, inst, ref)) {
+                    hitAnything = true;
+                    interval.max = hit.t;
+                }
+            }
+        } else {
+            uint base = (inst.nodeOffset + childRef) * stride;
+            vec3 origin = uintBitsToFloat(uvec3(wideNodes[base], wideNodes[base + 1u], wideNodes[base + 2u]));
+            uint childCount = wideNodes[base + 3u];
+            vec3 scale = uintBitsToFloat(uvec3(wideNodes[base + 4u], wideNodes[base + 5u], wideNodes[base + 6u]));
+            uint planes = base + c_wideNodeHeader + c_bvhWidth;
+            uvec3 qMinWords = uvec3(0u);
+            uvec3 qMaxWords = uvec3(0u);
+
+            uint nearestRef = 0;
+            float nearestDist = c_superFar;
+            for (uint c = 0; c < childCount; ++c) {
+                // Each plane word holds one byte for four children, fetched once per group of four
+                if (c % 4u == 0u) {
+                    uint word = planes + c / 4u;
+                    qMinWords = uvec3(wideNodes[word], wideNodes[word + planeStride], wideNodes[word + 2u * planeStride]);
+                    qMaxWords = uvec3(wideNodes[word + 3u * planeStride], wideNodes[word + 4u * planeStride], wideNodes[word + 5u * planeStride]);
+                }
+                uint shift = (c % 4u) * 8u;
+                vec3 qMin = vec3((qMinWords >> shift) & 0xFFu);
+                vec3 qMax = vec3((qMaxWords >> shift) & 0xFFu);
+                float dist = intersectAABB(ray, invDirection, origin + qMin * scale, origin + qMax * scale, interval.max);
+                if (dist == c_superFar) {
+                    continue;
+                }
+
+                // Only the nearest child is ordered, a full sort costs more than it saves
+                uint ref = wideNodes[base + c_wideNodeHeader + c];
+                if (dist < nearestDist) {
+                    uint farther = nearestRef;
+                    bool hadNearest = nearestDist != c_superFar;
+                    nearestRef = ref;
+                    nearestDist = dist;
+                    if (!hadNearest) {
+                        continue;
+                    }
+                    ref = farther;
+                }
+                if (stackPtr < c_wideStackSize) {
+                    stack[stackPtr++] = ref;
+                }
+            }
+            if (nearestDist != c_superFar && stackPtr < c_wideStackSize) {
+                stack[stackPtr++] = nearestRef;
+            }
+        }
+
+        if (stackPtr == 0u) {
+            break;
+        }
+        childRef = stack[--stackPtr];
+    }
+
+    return hitAnything;
+}
+
+// 3D-DDA state walking the cells of one grid level along a ray
+struct GridDDA {
+    ivec3 cell;
+    ivec3 step;
+    ivec3 resolution;
+    vec3 tNext;
+    vec3 tDelta;
+    float tExit;
+};
+
+bool initGridDDA(in Ray ray, in vec3 invDirection, in uint gridBase, in float tMin, in float tMax, out GridDDA dda) {
+    vec3 gridMin = uintBitsToFloat(uvec3(gridData[gridBase], gridData[gridBase + 1u], gridData[gridBase + 2u]));
+    vec3 cellSize = uintBitsToFloat(uvec3(gridData[gridBase + 4u], gridData[gridBase + 5u], gridData[gridBase + 6u]));
+    dda.resolution = ivec3(gridData[gridBase + 8u], gridData[gridBase + 9u], gridData[gridBase + 10u]);
+
+    vec3 t0 = (gridMin - ray.origin) * invDirection;
+    vec3 t1 = (gridMin + cellSize * vec3(dda.resolution) - ray.origin) * invDirection;
+    vec3 tSmall = min(t0, t1);
+    vec3 tBig = max(t0, t1);
+    float tEnter = max(max(max(tSmall.x, tSmall.y), tSmall.z), tMin);
+    dda.tExit = min(min(min(tBig.x, tBig.y), tBig.z), tMax);
+    if (tEnter > dda.tExit) {
+        return false;
+    }
+
+    vec3 p = getRayPointAt(ray, tEnter);
+    dda.cell = clamp(ivec3(floor((p - gridMin) / cellSize)), ivec3(0), dda.resolution - 1);
+    dda.step = ivec3(sign(ray.direction));
+    dda.tDelta = cellSize * abs(invDirection);
+    vec3 nextBoundary = gridMin + (vec3(dda.cell) + vec3(greaterThan(dda.step, ivec3(0)))) * cellSize;
+    dda.tNext = mix(vec3(c_superFar), (nextBoundary - ray.origin) * invDirection, notEqual(dda.step, ivec3(0)));
+    return true;
+}
+
+float gridCellExit(in GridDDA dda) {
+    return min(min(dda.tNext.x, dda.tNext.y), dda.tNext.z);
+}
+
+// Steps into the next cell, false once the ray leaves the grid or passes tExit
+bool advanceGridDDA(inout GridDDA dda) {
+    if (gridCellExit(dda) > dda.tExit) {
+        return false;
+    }
+    int axis = dda.tNext.x <= dda.tNext.y ? (dda.tNext.x <= dda.tNext.z ? 0 : 2) : (dda.tNext.y <= dda.tNext.z ? 1 : 2);
+    dda.cell[axis] += dda.step[axis];
+    dda.tNext[axis] += dda.tDelta[axis];
+    return dda.cell[axis] >= 0 && dda.cell[axis] < dda.resolution[axis];
+}
+
+uint gridCellIndex(in uint gridBase, in GridDDA dda) {
+    return gridBase + c_gridHeader + 2u * uint(dda.cell.x + dda.resolution.x * (dda.cell.y + dda.resolution.y * dda.cell.z));
+}
+
+bool hitGridCell(in Ray ray, inout Interval interval, inout HitInfo hit, in Instance inst, in uint first, in uint count, in bool anyHit) {
+    bool hitAnything = false;
+    for (uint i = 0; i < count; ++i) {
+        uint ref = gridData[inst.nodeOffset + first + i];
+        if (anyHit) {
+            if (occludesPrimitive(ray, interval, inst, ref)) {
+                return true;
+            }
+        } else if (hitPrimitive(ray, interval, hit, inst, ref)) {
+            hitAnything = true;
+            interval.max = hit.t;
+        }
+    }
+    return hitAnything;
+}
+
+// Walks one instance's grid front to back. Primitives overlap several cells, so a hit only ends
+// the walk once it lies inside the current cell; crowded cells descend into their second level.
+// Any hit ends an any-hit walk right away.
+bool traceGrid(in Ray ray, inout Interval interval, inout HitInfo hit, in Instance inst, in bool anyHit) {
+    bool hitAnything = false;
+    vec3 invDirection = 1.0 / ray.direction;
+    GridDDA dda;
+    if (!initGridDDA(ray, invDirection, inst.nodeOffset, interval.min, interval.max, dda)) {
+        return false;
+    }
+
+    while (true) {
+        uint cell = gridCellIndex(inst.nodeOffset, dda);
+        uint first = gridData[cell];
+        uint count = gridData[cell + 1u];
+        float tCellExit = gridCellExit(dda);
+        if ((count & c_gridSubgridBit) != 0u) {
+            uint subgridBase = inst.nodeOffset + first;
+            GridDDA subDDA;
+            if (initGridDDA(ray, invDirection, subgridBase, interval.min, min(interval.max, tCellExit), subDDA)) {
+                while (true) {
+                    uint subcell = gridCellIndex(subgridBase, subDDA);
+                    if (hitGridCell(ray, interval, hit, inst, gridData[subcell], gridData[subcell + 1u], anyHit)) {
+                        if (anyHit) {
+                            return true;
+                        }
+                        hitAnything = true;
+                    }
+                    if (interval.max <= gridCellExit(subDDA) || !advanceGridDDA(subDDA)) {
+                        break;
+                    }
+                }
+            }
+        } else if (hitGridCell(ray, interval, hit, inst, first, count, anyHit)) {
+            if (anyHit) {
+                return true;
+            }
+            hitAnything = true;
+        }
+
+        if (interval.max <= tCellExit || !advanceGridDDA(dda)) {
+            break;
+        }
+    }
+
+    return hitAnything;
+}
+
+// Walks the TLAS and the BLAS of every instance the ray reaches. Closest-hit queries leave the nearest hit
+// in hit, any-hit queries return on the first primitive hit.
+bool traceScene(in Ray ray, inout Interval interval, inout HitInfo hit, in bool anyHit) {
+    bool hitAnything = false;
+    raysTraced++;
+
+    if (numOfInstances == 0u) {
+        return false;
+    }
+
+    vec3 invDirection = 1.0 / ray.direction;
+    if (intersectAABB(ray, invDirection, tlasNodes[0].aabbMin, tlasNodes[0].aabbMax, interval.max) == c_superFar) {
+        return false;
+    }
+
+    // Same traversal over the TLAS, each leaf instance transforms the ray and descends into its BLAS
+    uint stack[c_bvhStackSize];
+    uint stackPtr = 0;
+    uint nodeIndex = 0;
+    while (true) {
+        BVHNode node = tlasNodes[nodeIndex];
+        if (node.primCount > 0u) {
+            for (uint i = 0; i < node.primCount; ++i) {
+                Instance inst = instances[node.leftFirst + i];
+                Ray objectRay = toObjectSpace(ray, inst);
+                bool hitBLAS;
+                if (c_accelMode == c_accelGrid) {
+                    hitBLAS = traceGrid(objectRay, interval, hit, inst, anyHit);
+                } else if (c_bvhWidth == 2u) {
+                    hitBLAS = traceBLAS(objectRay, interval, hit, inst, anyHit);
+                } else {
+                    hitBLAS = traceWideBLAS(objectRay, interval, hit, inst, anyHit);
+                }
+                if (hitBLAS && anyHit) {
+                    return true;
+                }
+                if (hitBLAS) {
+                    hitAnything = true;
+                    hit.instance = node.leftFirst + i;
+                    interval.max = hit.t;
+                }
+            }
+            if (stackPtr == 0u) {
+                break;
+            }
+            nodeIndex = stack[--stackPtr];
+            continue;
+        }
+
+        uint child1 = node.leftFirst;
+        uint child2 = node.leftFirst + 1u;
+        float dist1 = intersectAABB(ray, invDirection, tlasNodes[child1].aabbMin, tlasNodes[child1].aabbMax, interval.max);
+        float dist2 = intersectAABB(ray, invDirection, tlasNodes[child2].aabbMin, tlasNodes[child2].aabbMax, interval.max);
+        if (dist1 > dist2) {
+            float d = dist1; dist1 = dist2; dist2 = d;
+            uint c = child1; child1 = child2; child2 = c;
+        }
+
+        if (dist1 == c_superFar) {
+            if (stackPtr == 0u) {
+                break;
+            }
+            nodeIndex = stack[--stackPtr];
+        } else {
+            nodeIndex = child1;
+            if (dist2 != c_superFar && stackPtr < c_bvhStackSize) {
+                stack[stackPtr++] = child2;
+            }
+        }
+    }
+
+    return hitAnything;
+}
+
+bool TestSceneTrace(in Ray ray, inout HitRecord hitRecord) {
+    Interval interval = Interval(c_minimumRayHitTime, c_superFar);
+    HitInfo hit;
+    if (!traceScene(ray, interval, hit, false)) {
+        return false;
+    }
+    hitRecord = resolveHit(ray, hit);
+    return true;
+}
+
+// Visibility query for shadow and ambient occlusion rays: true if anything lies along the ray before tMax,
+// measured in units of the ray direction's length
+bool TestSceneOcclusion(in Ray ray, in float tMax) {
+    Interval interval = Interval(c_minimumRayHitTime, tMax);
+    HitInfo unused;
+    return traceScene(ray, interval, unused, true);
+}
+
+// Occlusion through the any-hit query, or through a closest-hit query when c_anyHitOcclusion is off to compare both
+bool IsOccluded(in Ray ray, in float tMax) {
+    if (c_anyHitOcclusion) {
+        return TestSceneOcclusion(ray, tMax);
+    }
+    HitInfo hit;
+    Interval interval = Interval(c_minimumRayHitTime, tMax);
+    return traceScene(ray, interval, hit, false);
+}
@@ -0,0 +1,44 @@
+// Display transform of the linear radiance: exposure in stops, then the curve mapping the exposed radiance into
+// the displayable range. fragment.glsl finishes it with a square root gamma.
+uniform float c_exposure;
+uniform uint c_tonemap;
+
+const uint c_tonemapReinhard = 1u;
+const uint c_tonemapACES = 2u;
+
+// Narkowicz's fit of the ACES filmic curve
+vec3 tonemapACES(vec3 x) {
+    return clamp((x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14), 0.0, 1.0);
+}
+
+vec3 tonemap(vec3 colour) {
+    colour *= exp2(c_exposure);
+    if (c_tonemap == c_tonemapReinhard) {
+        colour = colour / (1.0 + colour);
+    } else if (c_tonemap == c_tonemapACES) {
+        colour = tonemapACES(colour);
+    }
+    return colour;
+}
+
+// Rate at which the displayed value, square root gamma included, changes with the linear luminance,
+// zero once the luminance is clipped to white
+float displaySlope(float luminance) {
+    float scale = exp2(c_exposure);
+    float x = luminance * scale;
+    float mapped = x;
+    float curveSlope = 1.0;
+    if (c_tonemap == c_tonemapReinhard) {
+        mapped = x / (1.0 + x);
+        curveSlope = 1.0 / ((1.0 + x) * (1.0 + x));
+    } else if (c_tonemap == c_tonemapACES) {
+        float numerator = x * (2.51 * x + 0.03);
+        float denominator = x * (2.43 * x + 0.59) + 0.14;
+        mapped = numerator / denominator;
+        curveSlope = ((5.02 * x + 0.03) * denominator - numerator * (4.86 * x + 0.59)) / (denominator * denominator);
+    }
+    if (mapped >= 1.0) {
+        return 0.0;
+    }
+    return scale * curveSlope / (2.0 * sqrt(mapped));
+}
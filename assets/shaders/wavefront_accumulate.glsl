@@ -0,0 +1,16 @@
+#version 430 core
+layout(local_size_x = 8, local_size_y = 4, local_size_z = 1) in;
+#include "path_common.glsl"
+#include "path_sampler.glsl"
+#include "path_film.glsl"
+#include "wavefront_common.glsl"
+
+// Accumulates the mean of the samples each pixel's path summed, dispatched like compute.glsl
+void main() {
+    ivec2 fragCoord;
+    uint slot;
+    if (!dispatchPixel(fragCoord, slot)) {
+        return;
+    }
+    accumulatePixel(fragCoord, loadPixelStats(fragCoord), paths[slot].radiance / float(c_samplesPerPixel));
+}
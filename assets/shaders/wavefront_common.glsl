@@ -0,0 +1,99 @@
+// Declarations shared by the wavefront kernels, which take the paths of a frame through the bounce loop of
+// GetColorForRay one stage at a time. Each stage runs over the paths listed in its input queue and appends the paths
+// to the queues of the stages they go on to. A queue's length doubles as its indirect dispatch arguments.
+
+// Workgroup size of the kernels dispatched over a queue
+const uint c_wavefrontGroupSize = 64;
+// Rays to extend alternate between the first two queues, one is read while the next bounce's rays fill the other
+const uint c_surfaceQueue = 2u;
+const uint c_dielectricQueue = 3u;
+const uint c_shadowQueue = 4u;
+const uint c_queueCount = 5u;
+const uint c_noQueue = 0xffffffffu;
+
+// Paths the buffers hold, one per pixel, and the queue size
+uniform uint c_pathCapacity;
+uniform uint c_inputQueue;
+uniform uint c_outputQueue;
+
+// One pixel sample on its way through the bounces
+struct PathState {
+    vec3 origin;
+    uint pixel; // x in the low and y in the high 16 bits
+    vec3 direction;
+    uint sampleIndex;
+    vec3 throughput;
+    float bsdfPdf; // of the ray at the hit it was scattered from, as in GetColorForRay
+    vec3 radiance; // summed over the samples of the frame
+    float hitT;
+    vec3 scatterNormal;
+    uint hitInstance;
+    vec3 shadowOrigin;
+    float shadowDistance;
+    vec3 shadowDirection;
+    uint hitPrimitive;
+    vec3 shadowRadiance; // light the shadow ray brings if nothing blocks it
+};
+
+struct WorkQueue {
+    uint numGroupsX;
+    uint numGroupsY;
+    uint numGroupsZ;
+    uint count;
+};
+
+// Queue q lists its paths from q * c_pathCapacity on
+layout(std430, binding = 21) buffer WavefrontQueues {
+    WorkQueue queues[c_queueCount];
+    uint queuedPaths[];
+};
+
+layout(std430, binding = 22) buffer Paths {
+    PathState paths[];
+};
+
+shared uint queueGroupCounts[c_queueCount];
+shared uint queueGroupBases[c_queueCount];
+
+// Path this invocation of a queue kernel works on, false past the end of the input queue
+bool dequeuePath(out uint path) {
+    path = 0u;
+    if (gl_GlobalInvocationID.x >= queues[c_inputQueue].count) {
+        return false;
+    }
+    path = queuedPaths[c_inputQueue * c_pathCapacity + gl_GlobalInvocationID.x];
+    return true;
+}
+
+// Appends path to up to two queues, c_noQueue skipping either. The workgroup gathers its paths in shared memory
+// and reserves room for them with one atomic per queue, so every invocation of it has to make the call.
+void enqueuePath(uint path, uint firstQueue, uint secondQueue) {
+    uint local = gl_LocalInvocationIndex;
+    if (local < c_queueCount) {
+        queueGroupCounts[local] = 0u;
+    }
+    barrier();
+    uint firstSlot = firstQueue != c_noQueue ? atomicAdd(queueGroupCounts[firstQueue], 1u) : 0u;
+    uint secondSlot = secondQueue != c_noQueue ? atomicAdd(queueGroupCounts[secondQueue], 1u) : 0u;
+    barrier();
+    if (local < c_queueCount) {
+        uint count = queueGroupCounts[local];
+        uint base = 0u;
+        if (count > 0u) {
+            base = atomicAdd(queues[local].count, count);
+            // Groups of the queue kernels the reserved range completes, so the ranges of all workgroups add up
+            uint groups = (base + count + c_wavefrontGroupSize - 1u) / c_wavefrontGroupSize - (base + c_wavefrontGroupSize - 1u) / c_wavefrontGroupSize;
+            if (groups > 0u) {
+                atomicAdd(queues[local].numGroupsX, groups);
+            }
+        }
+        queueGroupBases[local] = base;
+    }
+    barrier();
+    if (firstQueue != c_noQueue) {
+        queuedPaths[firstQueue * c_pathCapacity + queueGroupBases[firstQueue] + firstSlot] = path;
+    }
+    if (secondQueue != c_noQueue) {
+        queuedPaths[secondQueue * c_pathCapacity + queueGroupBases[secondQueue] + secondSlot] = path;
+    }
+}
@@ -0,0 +1,23 @@
+#version 430 core
+layout(local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+#include "path_common.glsl"
+#include "path_scene.glsl"
+#include "path_traverse.glsl"
+#include "wavefront_common.glsl"
+
+// Traces the shadow rays of the light samples in the input queue and adds the light of those that arrive
+void main() {
+    uint path;
+    if (dequeuePath(path)) {
+        Ray shadowRay = Ray(paths[path].shadowOrigin, paths[path].shadowDirection);
+        if (!IsOccluded(shadowRay, paths[path].shadowDistance)) {
+            paths[path].radiance += paths[path].shadowRadiance;
+        }
+    }
+
+    if (c_countRays) {
+        atomicAdd(rayCount, raysTraced);
+        atomicAdd(sphereTests, sphereTestCount);
+        atomicAdd(quadTests, quadTestCount);
+    }
+}
@@ -0,0 +1,33 @@
+#version 430 core
+layout(local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+#include "path_common.glsl"
+#include "path_scene.glsl"
+#include "path_traverse.glsl"
+#include "wavefront_common.glsl"
+
+// Traces the rays of the input queue to their closest hit and sorts the hits by material into the surface and
+// dielectric queues, so each shading dispatch runs one material branch. Rays leaving the scene pick up the sky.
+void main() {
+    uint path;
+    uint hitQueue = c_noQueue;
+    if (dequeuePath(path)) {
+        Ray ray = Ray(paths[path].origin, paths[path].direction);
+        Interval interval = Interval(c_minimumRayHitTime, c_superFar);
+        HitInfo hit;
+        if (traceScene(ray, interval, hit, false)) {
+            paths[path].hitT = hit.t;
+            paths[path].hitInstance = hit.instance;
+            paths[path].hitPrimitive = hit.primitiveRef;
+            hitQueue = materials[hitMaterialId(hit)].refractionIndex > 0.0 ? c_dielectricQueue : c_surfaceQueue;
+        } else if (c_sky) {
+            paths[path].radiance += skyColour(ray) * paths[path].throughput;
+        }
+    }
+    enqueuePath(path, hitQueue, c_noQueue);
+
+    if (c_countRays) {
+        atomicAdd(rayCount, raysTraced);
+        atomicAdd(sphereTests, sphereTestCount);
+        atomicAdd(quadTests, quadTestCount);
+    }
+}
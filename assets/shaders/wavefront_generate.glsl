@@ -0,0 +1,35 @@
+#version 430 core
+layout(local_size_x = 8, local_size_y = 4, local_size_z = 1) in;
+#include "path_common.glsl"
+#include "path_sampler.glsl"
+#include "path_film.glsl"
+#include "wavefront_common.glsl"
+
+// Sample of the frame the paths start, the first one clears the radiance the samples sum into
+uniform uint c_wavefrontSample;
+
+// Starts one path per pixel of the dispatch, dispatched like compute.glsl, and queues its camera ray
+void main() {
+    ivec2 fragCoord;
+    uint slot;
+    uint rayQueue = c_noQueue;
+    if (dispatchPixel(fragCoord, slot)) {
+        samplePixel = uvec2(fragCoord);
+        sampleIndex = uint(loadPixelStats(fragCoord).x) * c_samplesPerPixel + c_wavefrontSample;
+        uint rngState = 0u;
+        Ray ray = getRay(fragCoord, setupCamera(), rngState);
+
+        paths[slot].origin = ray.origin;
+        paths[slot].pixel = uint(fragCoord.x) | (uint(fragCoord.y) << 16);
+        paths[slot].direction = ray.direction;
+        paths[slot].sampleIndex = sampleIndex;
+        paths[slot].throughput = vec3(1.0);
+        paths[slot].bsdfPdf = 0.0;
+        paths[slot].scatterNormal = vec3(0.0);
+        if (c_wavefrontSample == 0u) {
+            paths[slot].radiance = vec3(0.0);
+        }
+        rayQueue = c_outputQueue;
+    }
+    enqueuePath(slot, rayQueue, c_noQueue);
+}
@@ -0,0 +1,55 @@
+#version 430 core
+layout(local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+#include "path_common.glsl"
+#include "path_sampler.glsl"
+#include "path_scene.glsl"
+#include "path_lights.glsl"
+#include "path_shading.glsl"
+#include "wavefront_common.glsl"
+
+// Bounce the paths of the input queue are at
+uniform uint c_bounce;
+
+// One bounce of GetColorForRay at the hits of a material queue: the emitted light, a light sample whose shadow ray
+// goes to the shadow queue and the scattered ray, queued in the output queue unless the path ends
+void main() {
+    uint path;
+    uint rayQueue = c_noQueue;
+    uint shadowQueue = c_noQueue;
+    if (dequeuePath(path)) {
+        PathState state = paths[path];
+        samplePixel = uvec2(state.pixel & 0xffffu, state.pixel >> 16);
+        sampleIndex = state.sampleIndex;
+        Ray ray = Ray(state.origin, state.direction);
+        HitRecord rec = resolveHit(ray, HitInfo(state.hitT, state.hitInstance, state.hitPrimitive, vec2(0.0)));
+        bool sampleLights = c_nextEventEstimation && numOfEmitters > 0u;
+        // Each bounce draws from the same dimensions on every path
+        uint bounceDimension = c_cameraDimensions + c_bounce * c_bounceDimensions;
+
+        state.radiance += emittedLight(ray, rec, state.bsdfPdf, state.scatterNormal, sampleLights) * state.throughput;
+
+        ScatterLobes lobes = getScatterLobes(ray, rec);
+        uint rngState;
+        if (sampleLights && takesLightSamples(lobes)) {
+            rngState = bounceDimension + c_bounceDimensions - c_lightDimensions;
+            Ray shadowRay;
+            vec3 light = sampleUnshadowedLight(rec, lobes, rngState, shadowRay, state.shadowDistance);
+            if (light != vec3(0.0)) {
+                state.shadowOrigin = shadowRay.origin;
+                state.shadowDirection = shadowRay.direction;
+                state.shadowRadiance = light * state.throughput;
+                shadowQueue = c_shadowQueue;
+            }
+        }
+        rngState = bounceDimension;
+
+        state.scatterNormal = rec.normal;
+        if (scatterRay(ray, rec, lobes, state.throughput, state.bsdfPdf, rngState) && c_bounce + 1u < c_numBounces) {
+            state.origin = ray.origin;
+            state.direction = ray.direction;
+            rayQueue = c_outputQueue;
+        }
+        paths[path] = state;
+    }
+    enqueuePath(path, rayQueue, shadowQueue);
+}
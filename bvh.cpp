@@ -0,0 +1,485 @@
+#include "bvh.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+
+const int BVH_BINS = 16;
+const float BVH_TRAVERSAL_COST = 1.0f;
+const float BVH_INTERSECTION_COST = 1.0f;
+const float QUAD_BOUNDS_EPSILON = 1e-4f;
+// Wide leaves store their primitive count in 7 bits, larger leaves are split at the object median
+const unsigned int BVH_MAX_LEAF_SIZE = 64;
+
+struct BuildPrimitive {
+    AABB bounds;
+    glm::vec3 centroid;
+};
+
+struct Bin {
+    AABB bounds;
+    unsigned int count = 0;
+};
+
+AABB sphere_bounds(const Sphere& sphere) {
+    AABB b;
+    b.min = sphere.center - glm::vec3(sphere.radius);
+    b.max = sphere.center + glm::vec3(sphere.radius);
+    return b;
+}
+
+AABB AABB::transformed(const glm::mat4& m) const {
+    AABB b;
+    for (int i = 0; i < 8; ++i) {
+        glm::vec3 corner((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z);
+        b.grow(glm::vec3(m * glm::vec4(corner, 1.0f)));
+    }
+    return b;
+}
+
+AABB quad_bounds(const Quad& quad) {
+    AABB b;
+    b.grow(quad.a);
+    b.grow(quad.b);
+    b.grow(quad.c);
+    b.grow(quad.d);
+    // Axis aligned quads have a flat box, pad it so the slab test stays robust
+    b.min -= glm::vec3(QUAD_BOUNDS_EPSILON);
+    b.max += glm::vec3(QUAD_BOUNDS_EPSILON);
+    return b;
+}
+
+static float node_sah_cost(const BVHNode& node) {
+    AABB b;
+    b.min = node.aabbMin;
+    b.max = node.aabbMax;
+    return node.primCount == 0 ? BVH_TRAVERSAL_COST * b.area() : BVH_INTERSECTION_COST * node.primCount * b.area();
+}
+
+static void update_node_bounds(BVH& bvh, unsigned int nodeIndex, const std::vector<BuildPrimitive>& prims) {
+    BVHNode& node = bvh.nodes[nodeIndex];
+    AABB b;
+    for (unsigned int i = 0; i < node.primCount; ++i) {
+        b.grow(prims[node.leftFirst + i].bounds);
+    }
+    node.aabbMin = b.min;
+    node.aabbMax = b.max;
+}
+
+// Finds the cheapest split plane by binning primitive centroids along each axis
+static float find_best_split(const BVHNode& node, const std::vector<BuildPrimitive>& prims, int& bestAxis, float& bestPos) {
+    float bestCost = 1e30f;
+    for (int axis = 0; axis < 3; ++axis) {
+        float boundsMin = 1e30f, boundsMax = -1e30f;
+        for (unsigned int i = 0; i < node.primCount; ++i) {
+            float c = prims[node.leftFirst + i].centroid[axis];
+            boundsMin = glm::min(boundsMin, c);
+            boundsMax = glm::max(boundsMax, c);
+        }
+        if (boundsMin == boundsMax) {
+            continue;
+        }
+
+        Bin bins[BVH_BINS];
+        float scale = BVH_BINS / (boundsMax - boundsMin);
+        for (unsigned int i = 0; i < node.primCount; ++i) {
+            const BuildPrimitive& p = prims[node.leftFirst + i];
+            int binIndex = glm::min(BVH_BINS - 1, (int)((p.centroid[axis] - boundsMin) * scale));
+            bins[binIndex].count++;
+            bins[binIndex].bounds.grow(p.bounds);
+        }
+
+        // Sweep from both sides to get the area and count left and right of every plane
+        float leftArea[BVH_BINS - 1], rightArea[BVH_BINS - 1];
+        unsigned int leftCount[BVH_BINS - 1], rightCount[BVH_BINS - 1];
+        AABB leftBox, rightBox;
+        unsigned int leftSum = 0, rightSum = 0;
+        for (int i = 0; i < BVH_BINS - 1; ++i) {
+            leftSum += bins[i].count;
+            leftCount[i] = leftSum;
+            leftBox.grow(bins[i].bounds);
+            leftArea[i] = leftBox.area();
+            rightSum += bins[BVH_BINS - 1 - i].count;
+            rightCount[BVH_BINS - 2 - i] = rightSum;
+            rightBox.grow(bins[BVH_BINS - 1 - i].bounds);
+            rightArea[BVH_BINS - 2 - i] = rightBox.area();
+        }
+
+        float binWidth = (boundsMax - boundsMin) / BVH_BINS;
+        for (int i = 0; i < BVH_BINS - 1; ++i) {
+            if (leftCount[i] == 0 || rightCount[i] == 0) {
+                continue;
+            }
+            float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestPos = boundsMin + binWidth * (i + 1);
+            }
+        }
+    }
+    return bestCost;
+}
+
+// Reorders the node's primitives and references around the median centroid along the longest centroid
+// extent and returns the first index of the upper half
+static unsigned int median_split(BVH& bvh, const BVHNode& node, std::vector<BuildPrimitive>& prims) {
+    AABB centroidBounds;
+    for (unsigned int i = 0; i < node.primCount; ++i) {
+        centroidBounds.grow(prims[node.leftFirst + i].centroid);
+    }
+    glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+    int axis = extent.x > extent.y && extent.x > extent.z ? 0 : (extent.y > extent.z ? 1 : 2);
+
+    std::vector<unsigned int> order(node.primCount);
+    std::iota(order.begin(), order.end(), node.leftFirst);
+    unsigned int half = node.primCount / 2;
+    std::nth_element(order.begin(), order.begin() + half, order.end(), [&](unsigned int a, unsigned int b) {
+        return prims[a].centroid[axis] < prims[b].centroid[axis];
+    });
+    std::vector<BuildPrimitive> reorderedPrims;
+    std::vector<unsigned int> reorderedRefs;
+    reorderedPrims.reserve(node.primCount);
+    reorderedRefs.reserve(node.primCount);
+    for (unsigned int i : order) {
+        reorderedPrims.push_back(prims[i]);
+        reorderedRefs.push_back(bvh.primitiveRefs[i]);
+    }
+    std::copy(reorderedPrims.begin(), reorderedPrims.end(), prims.begin() + node.leftFirst);
+    std::copy(reorderedRefs.begin(), reorderedRefs.end(), bvh.primitiveRefs.begin() + node.leftFirst);
+    return node.leftFirst + half;
+}
+
+static void subdivide(BVH& bvh, unsigned int nodeIndex, std::vector<BuildPrimitive>& prims) {
+    BVHNode& node = bvh.nodes[nodeIndex];
+    if (node.primCount <= 1) {
+        return;
+    }
+
+    int axis = -1;
+    float splitPos = 0;
+    float splitCost = find_best_split(node, prims, axis, splitPos);
+    AABB nodeBounds;
+    nodeBounds.min = node.aabbMin;
+    nodeBounds.max = node.aabbMax;
+    float parentArea = nodeBounds.area();
+    float leafCost = BVH_INTERSECTION_COST * node.primCount;
+    int i = (int)node.leftFirst;
+    if (axis < 0 || parentArea <= 0.0f || BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * splitCost / parentArea >= leafCost) {
+        if (node.primCount <= BVH_MAX_LEAF_SIZE) {
+            return;
+        }
+        i = (int)median_split(bvh, node, prims);
+    } else {
+        // Partition primitives and their references in place around the split plane
+        int j = i + (int)node.primCount - 1;
+        while (i <= j) {
+            if (prims[i].centroid[axis] < splitPos) {
+                i++;
+            } else {
+                std::swap(prims[i], prims[j]);
+                std::swap(bvh.primitiveRefs[i], bvh.primitiveRefs[j]);
+                j--;
+            }
+        }
+    }
+
+    unsigned int first = node.leftFirst;
+    unsigned int count = node.primCount;
+    unsigned int leftCount = i - first;
+    if (leftCount == 0 || leftCount == count) {
+        return;
+    }
+
+    // push_back may reallocate, so node is re-fetched by index from here on
+    unsigned int leftChild = (unsigned int)bvh.nodes.size();
+    bvh.nodes.push_back({glm::vec3(0), first, glm::vec3(0), leftCount});
+    bvh.nodes.push_back({glm::vec3(0), (unsigned int)i, glm::vec3(0), count - leftCount});
+    bvh.nodes[nodeIndex].leftFirst = leftChild;
+    bvh.nodes[nodeIndex].primCount = 0;
+
+    update_node_bounds(bvh, leftChild, prims);
+    update_node_bounds(bvh, leftChild + 1, prims);
+    subdivide(bvh, leftChild, prims);
+    subdivide(bvh, leftChild + 1, prims);
+}
+
+// Builds the tree over prims, whose references must already be in bvh.primitiveRefs
+static void build_from_primitives(BVH& bvh, std::vector<BuildPrimitive>& prims) {
+    unsigned int primCount = (unsigned int)prims.size();
+    bvh.nodes.clear();
+    bvh.nodes.reserve(primCount > 0 ? 2 * primCount - 1 : 1);
+    bvh.nodes.push_back({glm::vec3(0), 0, glm::vec3(0), primCount});
+    update_node_bounds(bvh, 0, prims);
+    // An empty geometry or scene keeps a single root without primitives and with inverted bounds
+    if (primCount == 0) {
+        bvh.parents.assign(1, BVH_NO_PARENT);
+        return;
+    }
+    subdivide(bvh, 0, prims);
+
+    bvh.parents.assign(bvh.nodes.size(), BVH_NO_PARENT);
+    for (unsigned int n = 0; n < bvh.nodes.size(); ++n) {
+        const BVHNode& node = bvh.nodes[n];
+        if (node.primCount == 0) {
+            bvh.parents[node.leftFirst] = n;
+            bvh.parents[node.leftFirst + 1] = n;
+        }
+    }
+}
+
+void build_bvh(BVH& bvh, const std::vector<Sphere>& spheres, const std::vector<Quad>& quads) {
+    unsigned int primCount = (unsigned int)(spheres.size() + quads.size());
+
+    std::vector<BuildPrimitive> prims;
+    prims.reserve(primCount);
+    bvh.primitiveRefs.clear();
+    bvh.primitiveRefs.reserve(primCount);
+    for (unsigned int i = 0; i < spheres.size(); ++i) {
+        AABB b = sphere_bounds(spheres[i]);
+        prims.push_back({b, (b.min + b.max) * 0.5f});
+        bvh.primitiveRefs.push_back(i);
+    }
+    for (unsigned int i = 0; i < quads.size(); ++i) {
+        AABB b = quad_bounds(quads[i]);
+        prims.push_back({b, (b.min + b.max) * 0.5f});
+        bvh.primitiveRefs.push_back(i | QUAD_REF_BIT);
+    }
+    build_from_primitives(bvh, prims);
+
+    bvh.sphereLeaves.assign(spheres.size(), 0);
+    bvh.quadLeaves.assign(quads.size(), 0);
+    for (unsigned int n = 0; n < bvh.nodes.size(); ++n) {
+        const BVHNode& node = bvh.nodes[n];
+        for (unsigned int i = 0; i < node.primCount; ++i) {
+            unsigned int ref = bvh.primitiveRefs[node.leftFirst + i];
+            if (ref & QUAD_REF_BIT) {
+                bvh.quadLeaves[ref & ~QUAD_REF_BIT] = n;
+            } else {
+                bvh.sphereLeaves[ref] = n;
+            }
+        }
+    }
+    bvh.buildCost = bvh_sah_cost(bvh);
+    bvh.cost = bvh.buildCost;
+}
+
+void build_bvh(BVH& bvh, const std::vector<AABB>& bounds) {
+    std::vector<BuildPrimitive> prims;
+    prims.reserve(bounds.size());
+    bvh.primitiveRefs.clear();
+    bvh.primitiveRefs.reserve(bounds.size());
+    for (unsigned int i = 0; i < bounds.size(); ++i) {
+        prims.push_back({bounds[i], (bounds[i].min + bounds[i].max) * 0.5f});
+        bvh.primitiveRefs.push_back(i);
+    }
+    build_from_primitives(bvh, prims);
+    bvh.sphereLeaves.clear();
+    bvh.quadLeaves.clear();
+    bvh.buildCost = bvh_sah_cost(bvh);
+    bvh.cost = bvh.buildCost;
+}
+
+static unsigned int primitive_leaf(const BVH& bvh, unsigned int primitiveRef) {
+    return (primitiveRef & QUAD_REF_BIT) ? bvh.quadLeaves[primitiveRef & ~QUAD_REF_BIT] : bvh.sphereLeaves[primitiveRef];
+}
+
+void refit_bvh(BVH& bvh, const std::vector<Sphere>& spheres, const std::vector<Quad>& quads, unsigned int primitiveRef,
+               unsigned int& firstChanged, unsigned int& lastChanged) {
+    unsigned int nodeIndex = primitive_leaf(bvh, primitiveRef);
+    while (nodeIndex != BVH_NO_PARENT) {
+        BVHNode& node = bvh.nodes[nodeIndex];
+        AABB b;
+        if (node.primCount > 0) {
+            for (unsigned int i = 0; i < node.primCount; ++i) {
+                unsigned int ref = bvh.primitiveRefs[node.leftFirst + i];
+                b.grow((ref & QUAD_REF_BIT) ? quad_bounds(quads[ref & ~QUAD_REF_BIT]) : sphere_bounds(spheres[ref]));
+            }
+        } else {
+            const BVHNode& left = bvh.nodes[node.leftFirst];
+            const BVHNode& right = bvh.nodes[node.leftFirst + 1];
+            b.min = glm::min(left.aabbMin, right.aabbMin);
+            b.max = glm::max(left.aabbMax, right.aabbMax);
+        }
+
+        // Ancestors of an unchanged node are unchanged as well
+        if (b.min == node.aabbMin && b.max == node.aabbMax) {
+            break;
+        }
+        bvh.cost -= node_sah_cost(node);
+        node.aabbMin = b.min;
+        node.aabbMax = b.max;
+        bvh.cost += node_sah_cost(node);
+        firstChanged = glm::min(firstChanged, nodeIndex);
+        lastChanged = glm::max(lastChanged, nodeIndex);
+        nodeIndex = bvh.parents[nodeIndex];
+    }
+}
+
+static AABB node_bounds(const BVHNode& node) {
+    AABB b;
+    b.min = node.aabbMin;
+    b.max = node.aabbMax;
+    return b;
+}
+
+static unsigned int float_bits(float f) {
+    unsigned int u;
+    std::memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+// Writes the header and quantized child boxes of one wide node into out
+static void encode_wide_node(const BVH& bvh, const WideBVH& wide, unsigned int wideIndex, unsigned int* out) {
+    unsigned int width = wide.width;
+    AABB box = node_bounds(bvh.nodes[wide.sources[wideIndex]]);
+
+    // Power of two scales keep origin + q * scale exact up to a single rounding in the shader
+    glm::vec3 scale;
+    for (int axis = 0; axis < 3; ++axis) {
+        float extent = box.max[axis] - box.min[axis];
+        scale[axis] = extent > 0.0f ? std::exp2(std::ceil(std::log2(extent / 255.0f))) : 1.0f;
+    }
+    out[0] = float_bits(box.min.x);
+    out[1] = float_bits(box.min.y);
+    out[2] = float_bits(box.min.z);
+    out[4] = float_bits(scale.x);
+    out[5] = float_bits(scale.y);
+    out[6] = float_bits(scale.z);
+    out[7] = 0;
+
+    unsigned int* planes = out + WIDE_NODE_HEADER + width;
+    std::fill(planes, planes + 6 * width / 4, 0u);
+    for (unsigned int c = 0; c < width; ++c) {
+        unsigned int child = wide.children[wideIndex * width + c];
+        if (child == BVH_NO_PARENT) {
+            continue;
+        }
+        // Round outwards so the quantized box always contains the child
+        AABB b = node_bounds(bvh.nodes[child]);
+        for (int axis = 0; axis < 3; ++axis) {
+            float qMin = std::floor((b.min[axis] - box.min[axis]) / scale[axis]);
+            float qMax = std::ceil((b.max[axis] - box.min[axis]) / scale[axis]);
+            unsigned int shift = (c % 4) * 8;
+            planes[axis * width / 4 + c / 4] |= (unsigned int)glm::clamp(qMin, 0.0f, 255.0f) << shift;
+            planes[(axis + 3) * width / 4 + c / 4] |= (unsigned int)glm::clamp(qMax, 0.0f, 255.0f) << shift;
+        }
+    }
+}
+
+bool collapse_bvh(const BVH& bvh, unsigned int width, WideBVH& wide) {
+    wide.width = width;
+    wide.data.clear();
+    wide.sources.clear();
+    wide.children.clear();
+    wide.holders.assign(bvh.nodes.size(), BVH_NO_PARENT);
+    wide.depth = 0;
+    if (bvh.nodes.empty()) {
+        return true;
+    }
+
+    unsigned int stride = wide_node_stride(width);
+    std::vector<unsigned int> refs;
+    std::vector<unsigned int> depths = {1};
+    bool encodable = true;
+    wide.sources.push_back(0);
+    for (unsigned int w = 0; w < wide.sources.size(); ++w) {
+        wide.depth = std::max(wide.depth, depths[w]);
+        const BVHNode& node = bvh.nodes[wide.sources[w]];
+        std::vector<unsigned int> slots;
+        if (node.primCount > 0) {
+            // Only a leaf root ends up here, it becomes the single child of the root wide node
+            slots.push_back(wide.sources[w]);
+        } else if (bvh.nodes.size() > 1) {
+            // Inner nodes only, an empty root leaves the root wide node without children
+            slots.push_back(node.leftFirst);
+            slots.push_back(node.leftFirst + 1);
+            while (slots.size() < width) {
+                int largest = -1;
+                float largestArea = -1.0f;
+                for (unsigned int s = 0; s < slots.size(); ++s) {
+                    const BVHNode& slot = bvh.nodes[slots[s]];
+                    float area = node_bounds(slot).area();
+                    if (slot.primCount == 0 && area > largestArea) {
+                        largest = (int)s;
+                        largestArea = area;
+                    }
+                }
+                if (largest < 0) {
+                    break;
+                }
+                unsigned int opened = bvh.nodes[slots[largest]].leftFirst;
+                slots[largest] = opened;
+                slots.push_back(opened + 1);
+            }
+        }
+
+        for (unsigned int c = 0; c < width; ++c) {
+            if (c >= slots.size()) {
+                wide.children.push_back(BVH_NO_PARENT);
+                refs.push_back(0);
+                continue;
+            }
+            const BVHNode& child = bvh.nodes[slots[c]];
+            wide.children.push_back(slots[c]);
+            wide.holders[slots[c]] = w;
+            if (child.primCount > 0) {
+                encodable = encodable && child.leftFirst <= WIDE_LEAF_MAX_FIRST && child.primCount <= WIDE_LEAF_MAX_COUNT;
+                refs.push_back(WIDE_LEAF_BIT | (child.primCount << 24) | (child.leftFirst & WIDE_LEAF_MAX_FIRST));
+            } else {
+                refs.push_back((unsigned int)wide.sources.size());
+                wide.sources.push_back(slots[c]);
+                depths.push_back(depths[w] + 1);
+            }
+        }
+    }
+
+    wide.data.assign(wide.sources.size() * stride, 0);
+    for (unsigned int w = 0; w < wide.sources.size(); ++w) {
+        unsigned int* out = &wide.data[w * stride];
+        unsigned int count = 0;
+        for (unsigned int c = 0; c < width; ++c) {
+            out[WIDE_NODE_HEADER + c] = refs[w * width + c];
+            count += wide.children[w * width + c] != BVH_NO_PARENT;
+        }
+        out[3] = count;
+        encode_wide_node(bvh, wide, w, out);
+    }
+    return encodable && wide_stack_size(wide) <= WIDE_STACK_SIZE;
+}
+
+void refit_wide_bvh(const BVH& bvh, WideBVH& wide, unsigned int primitiveRef, unsigned int firstChanged,
+                    unsigned int& firstWide, unsigned int& lastWide) {
+    unsigned int stride = wide_node_stride(wide.width);
+    std::vector<unsigned int> encoded(stride);
+    auto requantize = [&](unsigned int w) {
+        if (w == BVH_NO_PARENT) {
+            return;
+        }
+        unsigned int* current = &wide.data[w * stride];
+        std::copy(current, current + stride, encoded.begin());
+        encode_wide_node(bvh, wide, w, encoded.data());
+        if (!std::equal(encoded.begin(), encoded.end(), current)) {
+            std::copy(encoded.begin(), encoded.end(), current);
+            firstWide = glm::min(firstWide, w);
+            lastWide = glm::max(lastWide, w);
+        }
+    };
+
+    // Children are stored after their parents, so the walk up from the leaf ends at the first ancestor below
+    // firstChanged, which refit_bvh did not touch. Every wide node whose boxes changed holds a node of that walk,
+    // the one collapsed from a touched node holds the child the walk came up through.
+    unsigned int nodeIndex = primitive_leaf(bvh, primitiveRef);
+    while (nodeIndex != BVH_NO_PARENT && nodeIndex >= firstChanged) {
+        requantize(wide.holders[nodeIndex]);
+        nodeIndex = bvh.parents[nodeIndex];
+    }
+}
+
+float bvh_sah_cost(const BVH& bvh) {
+    float cost = 0;
+    for (const BVHNode& node : bvh.nodes) {
+        cost += node_sah_cost(node);
+    }
+    return cost;
+}
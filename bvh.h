@@ -0,0 +1,107 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include "glm/glm.hpp"
+#include "scene.h"
+
+// Primitive references with this bit set index quadsData, otherwise spheresData
+const unsigned int QUAD_REF_BIT = 0x80000000u;
+
+struct AABB {
+    glm::vec3 min = glm::vec3(1e30f);
+    glm::vec3 max = glm::vec3(-1e30f);
+
+    void grow(const glm::vec3& p) { min = glm::min(min, p); max = glm::max(max, p); }
+    void grow(const AABB& b) { min = glm::min(min, b.min); max = glm::max(max, b.max); }
+    float area() const {
+        glm::vec3 e = max - min;
+        return e.x < 0 ? 0.0f : 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+    // Box around all eight corners after an affine transform
+    AABB transformed(const glm::mat4& m) const;
+};
+
+// BVH node as laid out in the std430 BVHNodes buffer (32 bytes)
+struct BVHNode {
+    glm::vec3 aabbMin;
+    unsigned int leftFirst; // left child for inner nodes (right is leftFirst + 1), first primitive ref for leaves
+    glm::vec3 aabbMax;
+    unsigned int primCount; // 0 for inner nodes
+};
+
+const unsigned int BVH_NO_PARENT = 0xFFFFFFFFu;
+
+// Wide node child references with this bit set are leaves holding (count << 24) | firstRef,
+// otherwise they index the child wide node
+const unsigned int WIDE_LEAF_BIT = 0x80000000u;
+const unsigned int WIDE_LEAF_MAX_FIRST = 0x00FFFFFFu;
+const unsigned int WIDE_LEAF_MAX_COUNT = 0x7Fu;
+// Header of a wide node: origin xyz, child count, quantization scale xyz, unused
+const unsigned int WIDE_NODE_HEADER = 8;
+// Entries of the wide traversal stack, must match c_wideStackSize in path_common.glsl
+const unsigned int WIDE_STACK_SIZE = 128;
+
+struct BVH {
+    std::vector<BVHNode> nodes;
+    std::vector<unsigned int> primitiveRefs;
+    // Links used by refit to walk from an edited primitive up to the root
+    std::vector<unsigned int> parents;
+    std::vector<unsigned int> sphereLeaves;
+    std::vector<unsigned int> quadLeaves;
+    float buildCost = 0;
+    float cost = 0; // current SAH cost, kept up to date by refit_bvh
+};
+
+// Binary BVH collapsed into 4 or 8 wide nodes stored as a uint stream for the std430 WideBVHNodes buffer.
+// Each node holds the header, one reference per child and the child boxes quantized to 8 bits
+// inside the node box, as six planes (min xyz, max xyz) of one byte per child.
+struct WideBVH {
+    unsigned int width = 4;
+    std::vector<unsigned int> data;
+    std::vector<unsigned int> sources;  // binary node each wide node was collapsed from
+    std::vector<unsigned int> children; // binary node of every child slot, BVH_NO_PARENT when unused
+    std::vector<unsigned int> holders;  // wide node holding each binary node in a child slot, BVH_NO_PARENT when opened
+    unsigned int depth = 0;             // wide nodes on the longest path from the root
+};
+
+// Stack entries traceWideBLAS needs: every level below the root leaves up to width - 1 siblings behind,
+// and the deepest node pushes all of its children
+inline unsigned int wide_stack_size(const WideBVH& wide) {
+    return (wide.width - 1) * wide.depth + 1;
+}
+
+// Number of uints per wide node, padded to 16 bytes
+inline unsigned int wide_node_stride(unsigned int width) {
+    return (WIDE_NODE_HEADER + width + 6 * width / 4 + 3) & ~3u;
+}
+
+// Builds a binned SAH BVH over all spheres and quads of a geometry (a BLAS)
+void build_bvh(BVH& bvh, const std::vector<Sphere>& spheres, const std::vector<Quad>& quads);
+
+// Builds a binned SAH BVH over arbitrary boxes, referenced by their index (the TLAS over instances)
+void build_bvh(BVH& bvh, const std::vector<AABB>& bounds);
+
+// Recomputes the bounds of the leaf holding primitiveRef and of its ancestors,
+// widening [firstChanged, lastChanged] to cover every node that was touched
+void refit_bvh(BVH& bvh, const std::vector<Sphere>& spheres, const std::vector<Quad>& quads, unsigned int primitiveRef,
+               unsigned int& firstChanged, unsigned int& lastChanged);
+
+// Collapses bvh into nodes of the given width (4 or 8), always opening the child with the largest area.
+// Returns false when the wide tree is too deep for the shader's traversal stack or a leaf does not fit its
+// child reference, past WIDE_LEAF_MAX_FIRST refs or WIDE_LEAF_MAX_COUNT primitives.
+bool collapse_bvh(const BVH& bvh, unsigned int width, WideBVH& wide);
+
+// Requantizes the wide nodes built from the binary nodes refit_bvh touched for primitiveRef, firstChanged being
+// the lowest binary node it reported, and widens [firstWide, lastWide] to the wide nodes that changed
+void refit_wide_bvh(const BVH& bvh, WideBVH& wide, unsigned int primitiveRef, unsigned int firstChanged,
+                    unsigned int& firstWide, unsigned int& lastWide);
+
+// Unnormalized SAH cost (node areas weighted by traversal and intersection cost), compared
+// against buildCost to judge how much refits have degraded the tree
+float bvh_sah_cost(const BVH& bvh);
+
+AABB sphere_bounds(const Sphere& sphere);
+AABB quad_bounds(const Quad& quad);
+
+#endif
@@ -0,0 +1,180 @@
+#include "grid.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+// Target primitives per cell, cells above GRID_SUBGRID_MIN_COUNT get a second level
+const float GRID_DENSITY = 2.0f;
+const unsigned int GRID_MAX_RESOLUTION = 256;
+const unsigned int GRID_SUBGRID_MIN_COUNT = 8;
+const float GRID_BOUNDS_EPSILON = 1e-4f;
+// Levels get one counting thread per GRID_PARALLEL_MIN_REFS references, capped because every
+// thread adds a histogram over all cells
+const size_t GRID_PARALLEL_MIN_REFS = 16384;
+const size_t GRID_MAX_THREADS = 8;
+
+static unsigned int float_bits(float f) {
+    unsigned int u;
+    std::memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+// Runs body(t, begin, end) over threadCount even chunks of [0, count), the last one on the calling thread
+template <typename Body>
+static void for_each_chunk(unsigned int threadCount, size_t count, const Body& body) {
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t + 1 < threadCount; ++t) {
+        threads.emplace_back(body, t, count * t / threadCount, count * (t + 1) / threadCount);
+    }
+    body(threadCount - 1, count * (threadCount - 1) / threadCount, count);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+// Appends one grid level over refs (indices into bounds) and returns its offset in data
+static unsigned int build_level(std::vector<unsigned int>& data, const std::vector<AABB>& bounds, const std::vector<unsigned int>& primitiveRefs,
+                                const std::vector<unsigned int>& refs, AABB box, bool twoLevel) {
+    box.min -= glm::vec3(GRID_BOUNDS_EPSILON);
+    box.max += glm::vec3(GRID_BOUNDS_EPSILON);
+    glm::vec3 extent = box.max - box.min;
+
+    // Pick cubic cells so that roughly GRID_DENSITY primitives land in each one
+    float maxExtent = glm::max(extent.x, glm::max(extent.y, extent.z));
+    glm::vec3 clampedExtent = glm::max(extent, glm::vec3(maxExtent * 1e-3f));
+    float cellsPerUnit = std::cbrt(GRID_DENSITY * refs.size() / (clampedExtent.x * clampedExtent.y * clampedExtent.z));
+    glm::uvec3 resolution;
+    glm::vec3 cellSize;
+    for (int axis = 0; axis < 3; ++axis) {
+        resolution[axis] = (unsigned int)glm::clamp(std::ceil(extent[axis] * cellsPerUnit), 1.0f, (float)GRID_MAX_RESOLUTION);
+        cellSize[axis] = extent[axis] / resolution[axis];
+    }
+    unsigned int cellCount = resolution.x * resolution.y * resolution.z;
+
+    auto cell_range = [&](const AABB& b, glm::uvec3& lo, glm::uvec3& hi) {
+        for (int axis = 0; axis < 3; ++axis) {
+            float l = std::floor((b.min[axis] - box.min[axis]) / cellSize[axis]);
+            float h = std::floor((b.max[axis] - box.min[axis]) / cellSize[axis]);
+            lo[axis] = (unsigned int)glm::clamp(l, 0.0f, (float)(resolution[axis] - 1));
+            hi[axis] = (unsigned int)glm::clamp(h, 0.0f, (float)(resolution[axis] - 1));
+        }
+    };
+
+    // Counting sort: count the cells every primitive overlaps, prefix sum, then scatter the references.
+    // Each thread counts its chunk of refs into its own histogram and the scan turns those into
+    // per-thread offsets, so every chunk scatters behind the ones before it just like a serial sort
+    unsigned int threadCount = (unsigned int)std::min<size_t>(refs.size() / GRID_PARALLEL_MIN_REFS, GRID_MAX_THREADS);
+    threadCount = std::max(1u, std::min(threadCount, std::thread::hardware_concurrency()));
+    std::vector<unsigned int> counts((size_t)threadCount * cellCount, 0);
+    for_each_chunk(threadCount, refs.size(), [&](unsigned int t, size_t begin, size_t end) {
+        unsigned int* count = &counts[(size_t)t * cellCount];
+        glm::uvec3 lo, hi;
+        for (size_t i = begin; i < end; ++i) {
+            cell_range(bounds[refs[i]], lo, hi);
+            for (unsigned int z = lo.z; z <= hi.z; ++z) {
+                for (unsigned int y = lo.y; y <= hi.y; ++y) {
+                    for (unsigned int x = lo.x; x <= hi.x; ++x) {
+                        count[x + resolution.x * (y + resolution.y * z)]++;
+                    }
+                }
+            }
+        }
+    });
+    std::vector<unsigned int> cellStart(cellCount + 1, 0);
+    for (unsigned int c = 0; c < cellCount; ++c) {
+        unsigned int offset = cellStart[c];
+        for (unsigned int t = 0; t < threadCount; ++t) {
+            unsigned int count = counts[(size_t)t * cellCount + c];
+            counts[(size_t)t * cellCount + c] = offset;
+            offset += count;
+        }
+        cellStart[c + 1] = offset;
+    }
+
+    unsigned int level = (unsigned int)data.size();
+    unsigned int cells = level + GRID_HEADER;
+    unsigned int cellRefs = cells + 2 * cellCount;
+    data.resize(cellRefs + cellStart[cellCount]);
+    data[level + 0] = float_bits(box.min.x);
+    data[level + 1] = float_bits(box.min.y);
+    data[level + 2] = float_bits(box.min.z);
+    data[level + 4] = float_bits(cellSize.x);
+    data[level + 5] = float_bits(cellSize.y);
+    data[level + 6] = float_bits(cellSize.z);
+    data[level + 8] = resolution.x;
+    data[level + 9] = resolution.y;
+    data[level + 10] = resolution.z;
+    for (unsigned int c = 0; c < cellCount; ++c) {
+        data[cells + 2 * c] = cellRefs + cellStart[c];
+        data[cells + 2 * c + 1] = cellStart[c + 1] - cellStart[c];
+    }
+    // The sorted indices into bounds are kept for building the second level
+    std::vector<unsigned int> sorted(twoLevel ? cellStart[cellCount] : 0);
+    for_each_chunk(threadCount, refs.size(), [&](unsigned int t, size_t begin, size_t end) {
+        unsigned int* next = &counts[(size_t)t * cellCount];
+        glm::uvec3 lo, hi;
+        for (size_t i = begin; i < end; ++i) {
+            unsigned int r = refs[i];
+            cell_range(bounds[r], lo, hi);
+            for (unsigned int z = lo.z; z <= hi.z; ++z) {
+                for (unsigned int y = lo.y; y <= hi.y; ++y) {
+                    for (unsigned int x = lo.x; x <= hi.x; ++x) {
+                        unsigned int slot = next[x + resolution.x * (y + resolution.y * z)]++;
+                        data[cellRefs + slot] = primitiveRefs[r];
+                        if (twoLevel) {
+                            sorted[slot] = r;
+                        }
+                    }
+                }
+            }
+        }
+    });
+
+    if (!twoLevel) {
+        return level;
+    }
+
+    // Second level for crowded cells, built over the primitives overlapping the cell
+    for (unsigned int c = 0; c < cellCount; ++c) {
+        unsigned int count = cellStart[c + 1] - cellStart[c];
+        if (count <= GRID_SUBGRID_MIN_COUNT) {
+            continue;
+        }
+        glm::uvec3 cell(c % resolution.x, (c / resolution.x) % resolution.y, c / (resolution.x * resolution.y));
+        AABB cellBox;
+        cellBox.min = box.min + glm::vec3(cell) * cellSize;
+        cellBox.max = cellBox.min + cellSize;
+
+        std::vector<unsigned int> cellPrims(sorted.begin() + cellStart[c], sorted.begin() + cellStart[c + 1]);
+        unsigned int subgrid = build_level(data, bounds, primitiveRefs, cellPrims, cellBox, false);
+        data[cells + 2 * c] = subgrid;
+        data[cells + 2 * c + 1] = count | GRID_SUBGRID_BIT;
+    }
+    return level;
+}
+
+void build_grid(Grid& grid, const std::vector<Sphere>& spheres, const std::vector<Quad>& quads, bool twoLevel) {
+    std::vector<AABB> bounds;
+    std::vector<unsigned int> primitiveRefs;
+    std::vector<unsigned int> refs;
+    bounds.reserve(spheres.size() + quads.size());
+    grid.bounds = AABB();
+    for (unsigned int i = 0; i < spheres.size(); ++i) {
+        bounds.push_back(sphere_bounds(spheres[i]));
+        primitiveRefs.push_back(i);
+    }
+    for (unsigned int i = 0; i < quads.size(); ++i) {
+        bounds.push_back(quad_bounds(quads[i]));
+        primitiveRefs.push_back(i | QUAD_REF_BIT);
+    }
+    for (unsigned int i = 0; i < bounds.size(); ++i) {
+        grid.bounds.grow(bounds[i]);
+        refs.push_back(i);
+    }
+
+    grid.data.clear();
+    if (!bounds.empty()) {
+        build_level(grid.data, bounds, primitiveRefs, refs, grid.bounds, twoLevel);
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include <vector>
+#include "glm/glm.hpp"
+#include "scene.h"
+#include "bvh.h"
+
+// Header of a grid level: min corner xyz, unused, cell size xyz, unused, resolution xyz, unused
+const unsigned int GRID_HEADER = 12;
+// Cells hold (first, count) into the level's primitive references; with this bit set in count,
+// first is the offset of the cell's second level grid instead
+const unsigned int GRID_SUBGRID_BIT = 0x80000000u;
+
+// Uniform grid over a geometry stored as a uint stream for the std430 GridData buffer,
+// all offsets are relative to the start of the stream
+struct Grid {
+    std::vector<unsigned int> data;
+    AABB bounds;
+};
+
+// Bins all spheres and quads into a uniform grid with a single counting sort, counted and scattered
+// on several threads for large geometries; with twoLevel set, crowded cells get a grid of their own
+void build_grid(Grid& grid, const std::vector<Sphere>& spheres, const std::vector<Quad>& quads, bool twoLevel);
+
+#endif
@@ -0,0 +1,169 @@
+#include "lbvh.h"
+#include "shader.h"
+#include <vector>
+
+// Must match the workgroup size and radix of the lbvh_*.glsl passes
+const unsigned int LBVH_GROUP_SIZE = 256;
+const unsigned int LBVH_RADIX_BITS = 4;
+const unsigned int LBVH_RADIX_BUCKETS = 1 << LBVH_RADIX_BITS;
+const unsigned int LBVH_MORTON_BITS = 30;
+// Offset of the tree arrays behind the six geometry bounds in the LBVHTree buffer
+const unsigned int LBVH_TREE_HEADER = 6;
+
+struct ScanLevel {
+    GLuint offset;
+    GLuint count;
+};
+
+static GLuint group_count(unsigned int count) {
+    return (count + LBVH_GROUP_SIZE - 1) / LBVH_GROUP_SIZE;
+}
+
+// Block histograms of the radix sort followed by the block sums of each level of the scan over them,
+// down to a level that fits a single workgroup
+static std::vector<ScanLevel> scan_levels(unsigned int primCount) {
+    std::vector<ScanLevel> levels;
+    GLuint offset = 0;
+    GLuint count = LBVH_RADIX_BUCKETS * group_count(primCount);
+    while (true) {
+        levels.push_back({offset, count});
+        offset += count;
+        if (count <= LBVH_GROUP_SIZE) {
+            return levels;
+        }
+        count = group_count(count);
+    }
+}
+
+static void resize_buffer(GLuint buffer, size_t bytes) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, bytes, nullptr, GL_DYNAMIC_COPY);
+}
+
+static void use_build_program(GLuint program, const GeometryOffsets& offsets, GLuint numSpheres, GLuint primCount) {
+    glUseProgram(program);
+    glUniform1ui(glGetUniformLocation(program, "c_primCount"), primCount);
+    glUniform1ui(glGetUniformLocation(program, "c_numSpheres"), numSpheres);
+    glUniform1ui(glGetUniformLocation(program, "c_sphereOffset"), offsets.sphereOffset);
+    glUniform1ui(glGetUniformLocation(program, "c_quadOffset"), offsets.quadOffset);
+    glUniform1ui(glGetUniformLocation(program, "c_nodeOffset"), offsets.nodeOffset);
+    glUniform1ui(glGetUniformLocation(program, "c_refOffset"), offsets.refOffset);
+}
+
+static void dispatch_pass(GLuint groups) {
+    glDispatchCompute(groups, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void setup_lbvh_builder(LBVHBuilder& builder) {
+    builder.boundsProgram = create_compute_program("assets/shaders/lbvh_bounds.glsl");
+    builder.mortonProgram = create_compute_program("assets/shaders/lbvh_morton.glsl");
+    builder.histogramProgram = create_compute_program("assets/shaders/lbvh_histogram.glsl");
+    builder.scanProgram = create_compute_program("assets/shaders/lbvh_scan.glsl");
+    builder.scanAddProgram = create_compute_program("assets/shaders/lbvh_scan_add.glsl");
+    builder.scatterProgram = create_compute_program("assets/shaders/lbvh_scatter.glsl");
+    builder.hierarchyProgram = create_compute_program("assets/shaders/lbvh_hierarchy.glsl");
+    builder.fitProgram = create_compute_program("assets/shaders/lbvh_fit.glsl");
+    glGenBuffers(1, &builder.keyBuffer);
+    glGenBuffers(1, &builder.valueBuffer);
+    glGenBuffers(1, &builder.scanBuffer);
+    glGenBuffers(1, &builder.treeBuffer);
+    glGenQueries(1, &builder.timerQuery);
+}
+
+AABB build_lbvh(LBVHBuilder& builder, const GeometryOffsets& offsets, unsigned int numSpheres, unsigned int numQuads,
+                GLuint sphereGeometryBuffer, GLuint quadPlaneBuffer, GLuint bvhNodeBuffer, GLuint primitiveRefBuffer) {
+    GLuint primCount = numSpheres + numQuads;
+    if (primCount == 0) {
+        return AABB();
+    }
+
+    // Scratch buffers only grow, a smaller geometry reuses the front of them
+    std::vector<ScanLevel> levels = scan_levels(primCount);
+    if (primCount > builder.capacity) {
+        const ScanLevel& last = levels.back();
+        resize_buffer(builder.keyBuffer, 2 * primCount * sizeof(GLuint));
+        resize_buffer(builder.valueBuffer, 2 * primCount * sizeof(GLuint));
+        resize_buffer(builder.scanBuffer, (last.offset + last.count + 1) * sizeof(GLuint));
+        resize_buffer(builder.treeBuffer, (LBVH_TREE_HEADER + 5 * primCount) * sizeof(GLuint));
+        builder.capacity = primCount;
+    }
+
+    // Empty centroid bounds in the order preserving encoding of lbvh_common.glsl
+    const GLuint emptyBounds[LBVH_TREE_HEADER] = {0xFFFFFFFFu, 0xFFFFFFFFu, 0xFFFFFFFFu, 0, 0, 0};
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, builder.treeBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(emptyBounds), emptyBounds);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, bvhNodeBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, primitiveRefBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, builder.keyBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, builder.valueBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, builder.scanBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, builder.treeBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, sphereGeometryBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, quadPlaneBuffer);
+
+    GLuint groups = group_count(primCount);
+    glBeginQuery(GL_TIME_ELAPSED, builder.timerQuery);
+
+    use_build_program(builder.boundsProgram, offsets, numSpheres, primCount);
+    dispatch_pass(groups);
+    use_build_program(builder.mortonProgram, offsets, numSpheres, primCount);
+    dispatch_pass(groups);
+
+    // Least significant digit first radix sort, ping-ponging between the halves of the key and value buffers.
+    // The pass count is even, so the sorted codes end up back in the first half.
+    for (GLuint shift = 0; shift < LBVH_MORTON_BITS; shift += LBVH_RADIX_BITS) {
+        GLuint src = (shift / LBVH_RADIX_BITS) % 2 == 0 ? 0 : primCount;
+        GLuint dst = primCount - src;
+
+        use_build_program(builder.histogramProgram, offsets, numSpheres, primCount);
+        glUniform1ui(glGetUniformLocation(builder.histogramProgram, "c_radixShift"), shift);
+        glUniform1ui(glGetUniformLocation(builder.histogramProgram, "c_numBlocks"), groups);
+        glUniform1ui(glGetUniformLocation(builder.histogramProgram, "c_sortSrc"), src);
+        dispatch_pass(groups);
+
+        // Exclusive scan of the histograms, block sums are scanned level by level and added back on the way up
+        use_build_program(builder.scanProgram, offsets, numSpheres, primCount);
+        for (const ScanLevel& level : levels) {
+            glUniform1ui(glGetUniformLocation(builder.scanProgram, "c_scanOffset"), level.offset);
+            glUniform1ui(glGetUniformLocation(builder.scanProgram, "c_scanCount"), level.count);
+            glUniform1ui(glGetUniformLocation(builder.scanProgram, "c_sumsOffset"), level.offset + level.count);
+            dispatch_pass(group_count(level.count));
+        }
+        use_build_program(builder.scanAddProgram, offsets, numSpheres, primCount);
+        for (int l = (int)levels.size() - 2; l >= 0; --l) {
+            glUniform1ui(glGetUniformLocation(builder.scanAddProgram, "c_scanOffset"), levels[l].offset);
+            glUniform1ui(glGetUniformLocation(builder.scanAddProgram, "c_scanCount"), levels[l].count);
+            glUniform1ui(glGetUniformLocation(builder.scanAddProgram, "c_sumsOffset"), levels[l + 1].offset);
+            dispatch_pass(group_count(levels[l].count));
+        }
+
+        use_build_program(builder.scatterProgram, offsets, numSpheres, primCount);
+        glUniform1ui(glGetUniformLocation(builder.scatterProgram, "c_radixShift"), shift);
+        glUniform1ui(glGetUniformLocation(builder.scatterProgram, "c_numBlocks"), groups);
+        glUniform1ui(glGetUniformLocation(builder.scatterProgram, "c_sortSrc"), src);
+        glUniform1ui(glGetUniformLocation(builder.scatterProgram, "c_sortDst"), dst);
+        dispatch_pass(groups);
+    }
+
+    use_build_program(builder.hierarchyProgram, offsets, numSpheres, primCount);
+    dispatch_pass(groups);
+    use_build_program(builder.fitProgram, offsets, numSpheres, primCount);
+    dispatch_pass(groups);
+
+    glEndQuery(GL_TIME_ELAPSED);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    BVHNode root;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, bvhNodeBuffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, offsets.nodeOffset * sizeof(BVHNode), sizeof(BVHNode), &root);
+    GLuint64 elapsed = 0;
+    glGetQueryObjectui64v(builder.timerQuery, GL_QUERY_RESULT, &elapsed);
+    builder.buildMs = elapsed / 1e6f;
+
+    AABB bounds;
+    bounds.min = root.aabbMin;
+    bounds.max = root.aabbMax;
+    return bounds;
+}
@@ -0,0 +1,41 @@
+#ifndef LBVH_H
+#define LBVH_H
+
+#include "glad/glad.h"
+#include "scene.h"
+#include "bvh.h"
+
+// Compute programs and scratch buffers of the GPU LBVH builder. The tree is built from the sphere geometry
+// and quad plane buffers as they are on the GPU: Morton codes of the centroids, a radix sort, the Karras hierarchy and a
+// bottom-up bounds pass, written straight into the binary BVHNodes and PrimitiveRefs buffers.
+struct LBVHBuilder {
+    GLuint boundsProgram = 0;
+    GLuint mortonProgram = 0;
+    GLuint histogramProgram = 0;
+    GLuint scanProgram = 0;
+    GLuint scanAddProgram = 0;
+    GLuint scatterProgram = 0;
+    GLuint hierarchyProgram = 0;
+    GLuint fitProgram = 0;
+    GLuint keyBuffer = 0;
+    GLuint valueBuffer = 0;
+    GLuint scanBuffer = 0;
+    GLuint treeBuffer = 0;
+    unsigned int capacity = 0; // primitives the scratch buffers are sized for
+    GLuint timerQuery = 0;
+    float buildMs = 0.0f; // GPU time of the last build
+};
+
+// A geometry of n primitives takes 2n - 1 nodes and n primitive references
+inline unsigned int lbvh_node_count(unsigned int primCount) {
+    return primCount == 0 ? 0 : 2 * primCount - 1;
+}
+
+void setup_lbvh_builder(LBVHBuilder& builder);
+
+// Builds the BLAS of one geometry at its offsets in bvhNodeBuffer and primitiveRefBuffer, which must already
+// hold room for it. Returns the root bounds, the only data read back, for the TLAS built on the host.
+AABB build_lbvh(LBVHBuilder& builder, const GeometryOffsets& offsets, unsigned int numSpheres, unsigned int numQuads,
+                GLuint sphereGeometryBuffer, GLuint quadPlaneBuffer, GLuint bvhNodeBuffer, GLuint primitiveRefBuffer);
+
+#endif
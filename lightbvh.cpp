@@ -0,0 +1,181 @@
+#include "lightbvh.h"
+#include <algorithm>
+#include <cmath>
+
+const int LIGHT_BVH_BINS = 12;
+const float LIGHT_PI = 3.14159265f;
+
+struct LightBuildPrimitive {
+    LightBounds bounds;
+    glm::vec3 centroid;
+    unsigned int emitter;
+};
+
+static float safe_acos(float x) {
+    return std::acos(glm::clamp(x, -1.0f, 1.0f));
+}
+
+LightBounds union_light_bounds(const LightBounds& a, const LightBounds& b) {
+    if (a.power <= 0.0f) {
+        return b;
+    }
+    if (b.power <= 0.0f) {
+        return a;
+    }
+    LightBounds u;
+    u.bounds = a.bounds;
+    u.bounds.grow(b.bounds);
+    u.power = a.power + b.power;
+    u.cosThetaE = glm::min(a.cosThetaE, b.cosThetaE);
+
+    // Smallest cone around both normal cones: widen the larger one until it reaches the far side of the other
+    float thetaA = safe_acos(a.cosThetaO);
+    float thetaB = safe_acos(b.cosThetaO);
+    float thetaD = safe_acos(glm::dot(a.axis, b.axis));
+    if (glm::min(thetaD + thetaB, LIGHT_PI) <= thetaA) {
+        u.axis = a.axis;
+        u.cosThetaO = a.cosThetaO;
+        return u;
+    }
+    if (glm::min(thetaD + thetaA, LIGHT_PI) <= thetaB) {
+        u.axis = b.axis;
+        u.cosThetaO = b.cosThetaO;
+        return u;
+    }
+    float thetaO = (thetaA + thetaD + thetaB) * 0.5f;
+    glm::vec3 rotationAxis = glm::cross(a.axis, b.axis);
+    if (thetaO >= LIGHT_PI || glm::dot(rotationAxis, rotationAxis) == 0.0f) {
+        u.axis = a.axis;
+        u.cosThetaO = -1.0f;
+        return u;
+    }
+    // Rotate a's axis towards b's, it is perpendicular to the rotation axis so Rodrigues' formula loses a term
+    float thetaR = thetaO - thetaA;
+    u.axis = glm::normalize(a.axis * std::cos(thetaR) + glm::cross(glm::normalize(rotationAxis), a.axis) * std::sin(thetaR));
+    u.cosThetaO = std::cos(thetaO);
+    return u;
+}
+
+// Solid angle measure of the directions lit by bounds, weighting each by the cosine to the closest normal
+static float orientation_measure(const LightBounds& b) {
+    float thetaO = safe_acos(b.cosThetaO);
+    float thetaW = glm::min(thetaO + safe_acos(b.cosThetaE), LIGHT_PI);
+    float sinThetaO = std::sin(thetaO);
+    return 2.0f * LIGHT_PI * (1.0f - b.cosThetaO) +
+           LIGHT_PI / 2.0f * (2.0f * thetaW * sinThetaO - std::cos(thetaO - 2.0f * thetaW) - 2.0f * thetaO * sinThetaO + b.cosThetaO);
+}
+
+static float saoh_cost(const LightBounds& b, float regularization) {
+    return b.power <= 0.0f ? 0.0f : b.power * orientation_measure(b) * b.bounds.area() * regularization;
+}
+
+static void store_node(LightBVHNode& node, const LightBounds& b) {
+    node.aabbMin = b.bounds.min;
+    node.aabbMax = b.bounds.max;
+    node.power = b.power;
+    node.axis = b.axis;
+    node.cosThetaO = b.cosThetaO;
+    node.cosThetaE = b.cosThetaE;
+}
+
+// Splits prims[first, first + count) at the cheapest bin plane over the three axes, or at the middle
+// when every centroid is in the same place. Returns the number of primitives on the left.
+static unsigned int partition_lights(std::vector<LightBuildPrimitive>& prims, unsigned int first, unsigned int count,
+                                     const LightBounds& nodeBounds) {
+    AABB centroidBounds;
+    for (unsigned int i = first; i < first + count; ++i) {
+        centroidBounds.grow(prims[i].centroid);
+    }
+    glm::vec3 extent = nodeBounds.bounds.max - nodeBounds.bounds.min;
+    float maxExtent = glm::max(extent.x, glm::max(extent.y, extent.z));
+
+    float bestCost = 1e30f;
+    int bestAxis = -1;
+    float bestPos = 0.0f;
+    for (int axis = 0; axis < 3; ++axis) {
+        float boundsMin = centroidBounds.min[axis];
+        float boundsMax = centroidBounds.max[axis];
+        if (boundsMin == boundsMax) {
+            continue;
+        }
+
+        LightBounds bins[LIGHT_BVH_BINS];
+        float scale = LIGHT_BVH_BINS / (boundsMax - boundsMin);
+        for (unsigned int i = first; i < first + count; ++i) {
+            int binIndex = glm::min(LIGHT_BVH_BINS - 1, (int)((prims[i].centroid[axis] - boundsMin) * scale));
+            bins[binIndex] = union_light_bounds(bins[binIndex], prims[i].bounds);
+        }
+
+        // Long thin nodes split across their short axis are penalized, the cone measure alone would not
+        float regularization = extent[axis] > 0.0f ? maxExtent / extent[axis] : 1.0f;
+        // Sweep from both sides to get the bounds left and right of every plane
+        LightBounds leftBounds[LIGHT_BVH_BINS - 1], rightBounds[LIGHT_BVH_BINS - 1];
+        LightBounds left, right;
+        for (int i = 0; i < LIGHT_BVH_BINS - 1; ++i) {
+            left = union_light_bounds(left, bins[i]);
+            leftBounds[i] = left;
+            right = union_light_bounds(right, bins[LIGHT_BVH_BINS - 1 - i]);
+            rightBounds[LIGHT_BVH_BINS - 2 - i] = right;
+        }
+
+        float binWidth = (boundsMax - boundsMin) / LIGHT_BVH_BINS;
+        for (int i = 0; i < LIGHT_BVH_BINS - 1; ++i) {
+            if (leftBounds[i].power <= 0.0f || rightBounds[i].power <= 0.0f) {
+                continue;
+            }
+            float cost = saoh_cost(leftBounds[i], regularization) + saoh_cost(rightBounds[i], regularization);
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestPos = boundsMin + binWidth * (i + 1);
+            }
+        }
+    }
+
+    if (bestAxis < 0) {
+        return count / 2;
+    }
+    auto middle = std::partition(prims.begin() + first, prims.begin() + first + count,
+                                 [&](const LightBuildPrimitive& p) { return p.centroid[bestAxis] < bestPos; });
+    unsigned int leftCount = (unsigned int)(middle - (prims.begin() + first));
+    return leftCount == 0 || leftCount == count ? count / 2 : leftCount;
+}
+
+static void subdivide(std::vector<LightBVHNode>& nodes, unsigned int nodeIndex, std::vector<LightBuildPrimitive>& prims,
+                      unsigned int first, unsigned int count) {
+    LightBounds b;
+    for (unsigned int i = first; i < first + count; ++i) {
+        b = union_light_bounds(b, prims[i].bounds);
+    }
+    store_node(nodes[nodeIndex], b);
+    if (count == 1) {
+        nodes[nodeIndex].leftFirst = prims[first].emitter;
+        nodes[nodeIndex].emitterCount = 1;
+        return;
+    }
+
+    unsigned int leftCount = partition_lights(prims, first, count, b);
+    // push_back may reallocate, so the node is only written through its index
+    unsigned int leftChild = (unsigned int)nodes.size();
+    nodes.push_back({});
+    nodes.push_back({});
+    nodes[nodeIndex].leftFirst = leftChild;
+    nodes[nodeIndex].emitterCount = 0;
+    subdivide(nodes, leftChild, prims, first, leftCount);
+    subdivide(nodes, leftChild + 1, prims, first + leftCount, count - leftCount);
+}
+
+void build_light_bvh(std::vector<LightBVHNode>& nodes, const std::vector<LightBounds>& lights) {
+    nodes.clear();
+    if (lights.empty()) {
+        return;
+    }
+    std::vector<LightBuildPrimitive> prims;
+    prims.reserve(lights.size());
+    for (unsigned int i = 0; i < lights.size(); ++i) {
+        prims.push_back({lights[i], (lights[i].bounds.min + lights[i].bounds.max) * 0.5f, i});
+    }
+    nodes.reserve(2 * lights.size() - 1);
+    nodes.push_back({});
+    subdivide(nodes, 0, prims, 0, (unsigned int)prims.size());
+}
@@ -0,0 +1,38 @@
+#ifndef LIGHTBVH_H
+#define LIGHTBVH_H
+
+#include <vector>
+#include "glm/glm.hpp"
+#include "bvh.h"
+
+// World space bounds of one emitter or a group of them: the box, the cone the surface normals lie in
+// (axis and cosine of its half angle), the cosine of how far past the normals light is emitted and the power.
+// Bounds without power are empty.
+struct LightBounds {
+    AABB bounds;
+    glm::vec3 axis = glm::vec3(0.0f, 0.0f, 1.0f);
+    float cosThetaO = 1.0f;
+    float cosThetaE = 1.0f;
+    float power = 0.0f;
+};
+
+// Light BVH node as laid out in the std430 LightNodes buffer (64 bytes)
+struct LightBVHNode {
+    glm::vec3 aabbMin;
+    float power;
+    glm::vec3 aabbMax;
+    unsigned int leftFirst; // left child for inner nodes (right is leftFirst + 1), emitter index for leaves
+    glm::vec3 axis;
+    float cosThetaO;
+    float cosThetaE;
+    unsigned int emitterCount; // 0 for inner nodes, 1 for leaves
+    float padding[2];
+};
+
+LightBounds union_light_bounds(const LightBounds& a, const LightBounds& b);
+
+// Builds a binary light BVH with one emitter per leaf, the emitters referenced by their index in lights.
+// Splits are binned by the surface area orientation heuristic, which keeps lights that face different ways apart.
+void build_light_bvh(std::vector<LightBVHNode>& nodes, const std::vector<LightBounds>& lights);
+
+#endif
@@ -2,6 +2,11 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <random>
+#include <future>
+#include <climits>
+#include <cmath>
+#include <algorithm>
 
 #include "glad/glad.h"
 #include <GLFW/glfw3.h>
@@ -10,6 +15,16 @@
 #include "imgui/backends/imgui_impl_glfw.h"
 #include "imgui/backends/imgui_impl_opengl3.h"
 #include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtc/constants.hpp"
+#include "scene.h"
+#include "bvh.h"
+#include "grid.h"
+#include "shader.h"
+#include "lbvh.h"
+#include "lightbvh.h"
+#include "sampler.h"
+#include "wavefront.h"
 
 unsigned int SCREEN_WIDTH = 1024;
 unsigned int SCREEN_HEIGHT = 1024;
@@ -21,46 +36,204 @@ unsigned c_numBounces = 5;
 float c_defocusAngle = 0;
 float c_focusDist = 0.1;
 bool c_sky = true;
+// Samples an emitter at every diffuse hit instead of waiting for bounces to find the lights
+bool c_nextEventEstimation = true;
+// Emitters are picked by their importance at the hit through the light BVH, otherwise by power from the alias table
+bool c_lightBVH = true;
+// Random numbers from the PCG4D hash, Owen scrambled Sobol points or a blue noise rotated rank-1 lattice
+int c_sampler = 1;
+// Path tracing, or ambient occlusion at the first hit out to c_aoDistance
+int c_renderMode = 0;
+// Display only, applied by fragment.glsl to the accumulated linear radiance without restarting the accumulation
+float c_exposure = 0.0f;
+int c_tonemap = 0;
+float c_aoDistance = 0.5f;
+// Visibility rays use the any-hit query, turned off to measure them against closest-hit queries
+bool c_anyHitOcclusion = true;
+// Traversal reads the geometry only sphere and quad buffers, turned off to measure it against the full records
+bool c_soaGeometry = true;
+// Path tracing runs as separate generate, extend, shade and shadow ray kernels over path queues instead of the
+// compute.glsl megakernel, ambient occlusion always uses the megakernel
+bool c_wavefront = false;
+// The megakernel launches c_persistentGroups workgroups that keep taking pixels from an atomic counter until the
+// frame's pixels run out, instead of one invocation per pixel. The group count starts at the device's
+// devicePersistentGroups, enough to fill every SM once, and the slider overrides it.
+bool c_persistentThreads = false;
+int c_persistentGroups = 2048;
+int devicePersistentGroups = 2048;
 GLuint frameCounter = 0;
 GLuint c_samplesPerPixel = 1;
-GLuint numOfSpheres = 1;
-GLuint numOfQuads = 1;
+// Spends the samples of a frame only on pixels whose estimate is still noisier than c_adaptiveThreshold,
+// comparing the standard error of the pixel mean in display units, after exposure, tonemapping and gamma
+bool c_adaptiveSampling = false;
+float c_adaptiveThreshold = 0.01f;
+// Dispatches stop once the accumulation reaches a frame count, a sample count or the noise threshold everywhere,
+// and start again with the next reset
+int c_stopMode = 0;
+int c_stopFrames = 1024;
+int c_stopSamples = 4096;
+// Runs as many accumulation passes per displayed frame as fit into c_renderBudgetMs of GPU time instead of one,
+// so passes faster than the display's refresh are not held back by it
+bool c_renderBudget = false;
+float c_renderBudgetMs = 12.0f;
+GLuint numOfInstances = 1;
+GLuint numOfEmitters = 0;
+// Sum of emission strength times world space area over the emitters, which the alias table picks in proportion to
+float emitterPower = 0.0f;
+// Acceleration structure traversed inside every BLAS, an index into blasStructures
+int blasStructure = 0;
+// Storage of the accumulation image, an index into accumulationFormats
+int accumulationFormat = 0;
 
 const unsigned short OPENGL_MAJOR_VERSION = 4;
 const unsigned short OPENGL_MINOR_VERSION = 3;
-GLuint screenTex;
 GLuint accumulationTex;
+GLuint varianceTex;
 bool settingsChanged = false;
+// Set when spheres or quads are added or removed, which needs a full buffer upload and BLAS rebuild
+bool sceneChanged = false;
+// Set when materials are added, which needs the whole material buffer uploaded again
+bool materialsChanged = false;
+// Set when instances are added, removed or moved, which only needs a TLAS rebuild
+bool instancesChanged = false;
+// Set when the BLAS structure is switched, which needs every BLAS uploaded again
+bool structureChanged = false;
+// Set when the accumulation format is switched, which needs the accumulation image allocated again
+bool formatChanged = false;
+// Degradation of the refitted BVH's SAH cost that triggers a background rebuild
+const float BVH_REBUILD_THRESHOLD = 1.5f;
+// Smallest instance scale the editor accepts per axis, a zero scale leaves no inverse transform
+const float MIN_INSTANCE_SCALE = 1e-3f;
+// Materials added with every sphere field, each field sphere picks one of them at random
+const unsigned int SPHERE_FIELD_MATERIALS = 8;
+// Frames skipped after a structure switch and frames measured per structure by the benchmark
+const unsigned int BENCHMARK_WARMUP_FRAMES = 2;
+const unsigned int BENCHMARK_FRAMES = 16;
+// Frames every pixel gets before its variance is trusted, and frames between rebuilds of the adaptive work list
+const unsigned int ADAPTIVE_MIN_FRAMES = 16;
+const unsigned int ADAPTIVE_INTERVAL = 8;
+// Share of the pixels left above the noise threshold that still counts as converged, so a few fireflies
+// do not keep the render going forever
+const float STOP_ACTIVE_FRACTION = 0.005f;
+// Longest wait for input while stopped, the window is only redrawn when it ends or an event comes in
+const double STOP_WAIT_SECONDS = 0.25;
+// Most passes the render budget runs per displayed frame, so one badly measured pass cannot stall the window
+const unsigned int MAX_BUDGET_PASSES = 256;
+// Invocations per megakernel workgroup, the 8 x 4 local size of compute.glsl
+const int MEGAKERNEL_GROUP_SIZE = 32;
+// Persistent groups used when the driver does not report its SM count, core OpenGL has no such query
+const int PERSISTENT_GROUPS_FALLBACK = 2048;
+// Device limits of NV_shader_thread_group, which the core profile loader does not define
+#ifndef GL_NV_shader_thread_group
+#define GL_WARP_SIZE_NV 0x9339
+#define GL_WARPS_PER_SM_NV 0x933A
+#define GL_SM_COUNT_NV 0x933B
+#endif
+
+const GLuint ACCEL_BVH = 0;
+const GLuint ACCEL_GRID = 1;
+
+const int RENDER_PATH_TRACE = 0;
+const int RENDER_AMBIENT_OCCLUSION = 1;
+const char* renderModeNames[] = {"Path Tracing", "Ambient Occlusion"};
+const char* samplerNames[] = {"Random", "Sobol", "Blue Noise"};
+const char* tonemapNames[] = {"None", "Reinhard", "ACES"};
+const int STOP_NEVER = 0;
+const int STOP_FRAMES = 1;
+const int STOP_SAMPLES = 2;
+const int STOP_NOISE = 3;
+const char* stopModeNames[] = {"Never", "Frame Count", "Samples per Pixel", "Noise Threshold"};
+
+// Mean formats keep the running mean of the samples, a half float sum would stop taking in new samples long before
+// the image converges
+struct AccumulationFormat {
+    const char* name;
+    GLenum internalFormat;
+    bool mean;
+    unsigned int bytesPerPixel;
+};
+
+const AccumulationFormat accumulationFormats[] = {
+        {"RGBA32F Sum", GL_RGBA32F, false, 16},
+        {"RGBA16F Mean", GL_RGBA16F, true, 8},
+};
+const int ACCUMULATION_FORMAT_COUNT = sizeof(accumulationFormats) / sizeof(accumulationFormats[0]);
+// Bytes per pixel of the RGBA32F variance image kept next to the accumulation
+const unsigned int VARIANCE_BYTES_PER_PIXEL = 16;
+
+// BVHs use binary nodes with bvhWidth 2 and collapsed, quantized wide nodes with 4 or 8.
+// With gpuBuild the binary BVH is an LBVH built by compute shaders instead of the host SAH builder.
+struct BlasStructure {
+    const char* name;
+    GLuint accelMode;
+    GLuint bvhWidth;
+    bool twoLevelGrid;
+    bool gpuBuild;
+};
 
-// Quad struct definition
-struct Quad {
-    glm::vec3 a;
-    float reflectivity;
-    glm::vec3 b;
-    float fuzz;
-    glm::vec3 c;
-    float refractionIndex;
-    glm::vec3 d;
-    float padding;
-    glm::vec3 normal;
-    float padding1;
-    glm::vec3 albedo;
-    float padding2;
-    glm::vec3 emission;
-    float emissionStrength;
+const BlasStructure blasStructures[] = {
+        {"Binary BVH", ACCEL_BVH, 2, false, false},
+        {"BVH4", ACCEL_BVH, 4, false, false},
+        {"BVH8", ACCEL_BVH, 8, false, false},
+        {"Uniform Grid", ACCEL_GRID, 2, false, false},
+        {"Two-Level Grid", ACCEL_GRID, 2, true, false},
+        {"LBVH (GPU)", ACCEL_BVH, 2, false, true},
+};
+const int BLAS_STRUCTURE_COUNT = sizeof(blasStructures) / sizeof(blasStructures[0]);
+
+// Averages gathered by the benchmark for one BLAS structure and render mode
+struct StructureBenchmark {
+    int structure;
+    int renderMode = RENDER_PATH_TRACE;
+    bool anyHitOcclusion = true;
+    bool soaGeometry = true;
+    bool wavefront = false;
+    int accumulationFormat = 0;
+    double gpuMs = 0;
+    double rays = 0;
+    double geometryBytes = 0; // sphere and quad bytes loaded by primitive tests
+    unsigned int frames = 0;
+    size_t nodeBytes = 0;
+};
+
+// Locations of the uniforms set_path_uniforms sets, looked up once per program after linking. Programs without
+// one of them, like the wavefront kernels without c_persistentThreads, get -1, which setting ignores.
+struct PathUniforms {
+    GLuint program;
+    GLint resolution;
+    GLint lookFrom;
+    GLint lookAt;
+    GLint lookUp;
+    GLint FOVDegrees;
+    GLint defocusAngle;
+    GLint focusDist;
+    GLint samplesPerPixel;
+    GLint numBounces;
+    GLint frameCounter;
+    GLint numOfInstances;
+    GLint accelMode;
+    GLint bvhWidth;
+    GLint countRays;
+    GLint sky;
+    GLint renderMode;
+    GLint aoDistance;
+    GLint anyHitOcclusion;
+    GLint soaGeometry;
+    GLint nextEventEstimation;
+    GLint lightBVH;
+    GLint numOfEmitters;
+    GLint emitterPower;
+    GLint sampler;
+    GLint adaptiveSampling;
+    GLint accumulateMean;
+    GLint persistentThreads;
 };
 
-// Sphere struct definition
-struct Sphere {
-    glm::vec3 center;
-    float radius;
-    glm::vec3 albedo;
-    float reflectivity;
-    float fuzz;
-    float refractionIndex;
-    float padding[2];
-    glm::vec3 emission;
-    float emissionStrength;
+// Contents of the RayCounter buffer, only counted while benchmarking
+struct RayCounters {
+    GLuint rays;
+    GLuint sphereTests;
+    GLuint quadTests;
 };
 
 GLfloat vertices[] =
@@ -75,13 +248,28 @@ GLuint indices[] = { 0, 2, 1, 0, 3, 2 };
 
 // Function declarations
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
-std::string load_shader_code(const std::string& filepath);
-GLuint compile_shader(const char* source, GLenum shaderType);
-GLuint link_program(GLuint vertexShader, GLuint fragmentShader);
 void setup_vertex_data(GLuint& VAO, GLuint& VBO, GLuint& EBO);
-void setup_textures(GLuint& screenTex, GLuint& accumulationTex);
+void setup_textures(GLuint& accumulationTex, GLuint& varianceTex);
+void setup_accumulation_texture(GLuint& accumulationTex);
 void setup_imgui(GLFWwindow* window);
-void cleanup(GLFWwindow* window, GLuint VAO, GLuint VBO, GLuint EBO, GLuint screenTex, GLuint accumulationTex, GLuint quadProgram, GLuint computeProgram);
+int device_persistent_groups();
+glm::mat4 instance_transform(const Instance& instance);
+bool instance_traceable(const Instance& instance, const std::vector<Geometry>& geometries);
+std::string benchmark_label(const StructureBenchmark& result);
+PathUniforms path_uniform_locations(GLuint program);
+void set_path_uniforms(const PathUniforms& uniforms, bool countRays, bool adaptiveFrame);
+bool material_combo(const std::string& label, unsigned int& materialId, size_t materialCount);
+void upload_geometries(const std::vector<Geometry>& geometries, const std::vector<BVH>& geometryBVHs, std::vector<WideBVH>& geometryWideBVHs,
+                       std::vector<Grid>& geometryGrids, std::vector<GeometryOffsets>& geometryOffsets, std::vector<AABB>& geometryBounds,
+                       LBVHBuilder& lbvhBuilder, GLuint sphereBuffer, GLuint quadBuffer, GLuint sphereGeometryBuffer, GLuint quadPlaneBuffer,
+                       GLuint bvhNodeBuffer, GLuint primitiveRefBuffer, GLuint wideNodeBuffer, GLuint gridBuffer);
+size_t blas_node_bytes(const std::vector<Geometry>& geometries, const std::vector<BVH>& geometryBVHs, const std::vector<WideBVH>& geometryWideBVHs, const std::vector<Grid>& geometryGrids);
+GLuint upload_instances(const std::vector<Instance>& instances, const std::vector<Geometry>& geometries, const std::vector<AABB>& geometryBounds,
+                        const std::vector<GeometryOffsets>& geometryOffsets, BVH& tlas, GLuint instanceBuffer, GLuint tlasNodeBuffer);
+std::vector<EmitterAlias> build_alias_table(const std::vector<float>& weights, float total);
+GLuint upload_emitters(const std::vector<Instance>& instances, const std::vector<Geometry>& geometries, const std::vector<Material>& materials,
+                       const BVH& tlas, GLuint emitterBuffer, GLuint emitterAliasBuffer, GLuint lightNodeBuffer, float& power);
+void cleanup(GLFWwindow* window, GLuint VAO, GLuint VBO, GLuint EBO, GLuint accumulationTex, GLuint quadProgram, GLuint computeProgram);
 
 int main() {
     glfwInit();
@@ -110,94 +298,89 @@ int main() {
     glViewport(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
 
     setup_imgui(window);
+    devicePersistentGroups = device_persistent_groups();
+    c_persistentGroups = devicePersistentGroups;
 
     GLuint VAO, VBO, EBO;
     setup_vertex_data(VAO, VBO, EBO);
-    setup_textures(screenTex, accumulationTex);
+    setup_textures(accumulationTex, varianceTex);
 
     // Box scene to show quad lighting
+    // Create and populate the materials the primitives below refer to
+    std::vector<Material> materialsData = {
+            {glm::vec3(1.0, 1.0, 1.0), 0, glm::vec3(0.0, 0.0, 0.0), 0, 0, 0, {0, 0}}, // white
+            {glm::vec3(0.8, 0.8, 0.8), 0, glm::vec3(0.0, 0.0, 0.0), 0, 0, 0, {0, 0}}, // grey
+            {glm::vec3(1.0, 0.0, 0.0), 0, glm::vec3(0.0, 0.0, 0.0), 0, 0, 0, {0, 0}}, // red
+            {glm::vec3(0.0, 0.0, 1.0), 0, glm::vec3(0.0, 0.0, 0.0), 0, 0, 0, {0, 0}}, // blue
+            {glm::vec3(0.0, 1.0, 0.0), 0, glm::vec3(0.0, 0.0, 0.0), 0, 0, 0, {0, 0}}, // green
+            {glm::vec3(0.0, 0.0, 0.0), 0, glm::vec3(1.0, 1.0, 1.0), 10, 0, 0, {0, 0}}, // light
+    };
+
     // Create and populate spheres
     std::vector<Sphere> spheresData = {
-            {glm::vec3(0.0, -0.499, -3), 0.5f, glm::vec3(1.0, 1.0, 1.0), 0.0f, 0.0f, 0, {0, 0}, glm::vec3(1, 1, 1),
-             0.0},
+            {glm::vec3(0.0, -0.499, -3), 0.5f, 0, {0, 0, 0}},
     };
 
     // Create and populate quads
     std::vector<Quad> quadsData = {
             // back side
             {
-                glm::vec3(-1, -1, -4.0),    0,
-                glm::vec3(-1, 1, -4.0),  0,
+                glm::vec3(-1, -1, -4.0),    1,
+                glm::vec3(1, -1, -4.0),  0,
                 glm::vec3(1, 1, -4.0),   0,
-                glm::vec3(1, -1, -4.0),   0,
-                glm::vec3(0.0, 0.0, 1.0),  0,
-                glm::vec3(0.8, 0.8, 0.8), 0,
-                glm::vec3(0.0, 0.0, 0.0), 0
+                glm::vec3(-1, 1, -4.0),   0
             },
             // left side
             {
-                glm::vec3(-1, -1, -4.0),    0,
+                glm::vec3(-1, -1, -4.0),    2,
                 glm::vec3(-1, 1, -4.0),  0,
                 glm::vec3(-1, 1, -2),    0,
-                glm::vec3(-1, -1, -2),    0,
-                glm::vec3(1.0, 0.0, 0.0),  0,
-                glm::vec3(1.0, 0.0, 0.0), 0,
-                glm::vec3(0.0, 0.0, 0.0), 0
+                glm::vec3(-1, -1, -2),    0
             },
             // right side
             {
-                glm::vec3(1, 1, -4.0),      0,
+                glm::vec3(1, 1, -4.0),      3,
                 glm::vec3(1, -1, -4.0),  0,
                 glm::vec3(1, -1, -2),    0,
-                glm::vec3(1, 1, -2),      0,
-                glm::vec3(-1.0, 0.0, 0.0), 0,
-                glm::vec3(0.0, 0.0, 1.0), 0,
-                glm::vec3(0.0, 0.0, 0.0), 0
+                glm::vec3(1, 1, -2),      0
             },
             // bottom side
             {
-                glm::vec3(-1, -1, -4.0),    0,
-                glm::vec3(1, -1, -4.0),  0,
+                glm::vec3(-1, -1, -4.0),    4,
+                glm::vec3(-1, -1, -2),  0,
                 glm::vec3(1, -1, -2),    0,
-                glm::vec3(-1, -1, -2),    0,
-                glm::vec3(0.0, 1.0, 0.0),  0,
-                glm::vec3(0.0, 1.0, 0.0), 0,
-                glm::vec3(0.0, 0.0, 0.0), 0
+                glm::vec3(1, -1, -4.0),    0
             },
             // top side
             {
                 glm::vec3(-1, 1, -4.0),     0,
                 glm::vec3(1, 1, -4.0),   0,
                 glm::vec3(1, 1, -2),     0,
-                glm::vec3(-1, 1, -2),     0,
-                glm::vec3(0.0, -1.0, 0.0), 0,
-                glm::vec3(1.0, 1.0, 1.0), 0,
-                glm::vec3(0.0, 0.0, 0.0), 0
+                glm::vec3(-1, 1, -2),     0
             },
             // front side
             {
-                glm::vec3(-1, -1, -2.0),    0,
+                glm::vec3(-1, -1, -2.0),    1,
                 glm::vec3(-1, 1, -2.0),  0,
                 glm::vec3(1, 1, -2.0),   0,
-                glm::vec3(1, -1, -2.0),   0,
-                glm::vec3(0.0, 0.0, -1.0), 0,
-                glm::vec3(0.8, 0.8, 0.8), 0,
-                glm::vec3(0.0, 0.0, 0.0), 0
+                glm::vec3(1, -1, -2.0),   0
             },
             // light
             {
-                glm::vec3(-0.5, 0.99, -3.5), 0,
+                glm::vec3(-0.5, 0.99, -3.5), 5,
                 glm::vec3(0.5, 0.99, -3.5), 0,
                 glm::vec3(0.5, 0.99, -2.5), 0,
-                glm::vec3(-0.5, 0.99, -2.5), 0,
-                glm::vec3(0.0, -1.0, 0.0),  0,
-                glm::vec3(0.0, 0.0, 0.0), 0,
-                glm::vec3(1.0, 1.0, 1.0), 10
+                glm::vec3(-0.5, 0.99, -2.5), 0
             }
     };
+    // Normals face the side a to b to d winds counterclockwise around
+    for (Quad& quad : quadsData) {
+        derive_quad_plane(quad);
+    }
 
-    numOfSpheres = spheresData.size();
-    numOfQuads = quadsData.size();
+    // The box scene is the first geometry, placed once at the origin
+    std::vector<Geometry> geometries = {{"Scene", spheresData, quadsData}};
+    std::vector<Instance> instancesData = {{0, glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(1.0f)}};
 
     std::string vertexCode = load_shader_code("assets/shaders/vertex.glsl");
     std::string fragmentCode = load_shader_code("assets/shaders/fragment.glsl");
@@ -214,36 +397,144 @@ int main() {
 
     GLuint sphereBuffer;
     glGenBuffers(1, &sphereBuffer);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sphereBuffer);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, spheresData.size() * sizeof(Sphere), spheresData.data(), GL_STATIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, sphereBuffer); // Bind to binding point 0
-
     GLuint quadBuffer;
     glGenBuffers(1, &quadBuffer);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, quadBuffer);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, quadsData.size() * sizeof(Quad), quadsData.data(), GL_STATIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, quadBuffer); // Bind to binding point 0
+    GLuint sphereGeometryBuffer;
+    glGenBuffers(1, &sphereGeometryBuffer);
+    GLuint quadPlaneBuffer;
+    glGenBuffers(1, &quadPlaneBuffer);
+    GLuint bvhNodeBuffer;
+    glGenBuffers(1, &bvhNodeBuffer);
+    GLuint primitiveRefBuffer;
+    glGenBuffers(1, &primitiveRefBuffer);
+    GLuint instanceBuffer;
+    glGenBuffers(1, &instanceBuffer);
+    GLuint tlasNodeBuffer;
+    glGenBuffers(1, &tlasNodeBuffer);
+    GLuint wideNodeBuffer;
+    glGenBuffers(1, &wideNodeBuffer);
+    GLuint gridBuffer;
+    glGenBuffers(1, &gridBuffer);
+    // Materials live in one table shared by all geometries, primitives only store an index into it
+    GLuint materialBuffer;
+    glGenBuffers(1, &materialBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, materialBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, materialsData.size() * sizeof(Material), materialsData.data(), GL_STATIC_DRAW);
+    GLuint rayCounterBuffer;
+    glGenBuffers(1, &rayCounterBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, rayCounterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(RayCounters), nullptr, GL_DYNAMIC_READ);
+    // Next pixel for the persistent threads to take, reset before every persistent dispatch
+    GLuint workCounterBuffer;
+    glGenBuffers(1, &workCounterBuffer);
+    glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, workCounterBuffer);
+    glBufferData(GL_ATOMIC_COUNTER_BUFFER, sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
+
+    // One BLAS per unique geometry and a TLAS over all instances
+    std::vector<BVH> geometryBVHs(geometries.size());
+    for (unsigned int g = 0; g < geometries.size(); ++g) {
+        build_bvh(geometryBVHs[g], geometries[g].spheres, geometries[g].quads);
+    }
+    std::vector<WideBVH> geometryWideBVHs(geometries.size());
+    std::vector<Grid> geometryGrids(geometries.size());
+    std::vector<GeometryOffsets> geometryOffsets;
+    std::vector<AABB> geometryBounds;
+    BVH tlas;
+    LBVHBuilder lbvhBuilder;
+    setup_lbvh_builder(lbvhBuilder);
+    upload_geometries(geometries, geometryBVHs, geometryWideBVHs, geometryGrids, geometryOffsets, geometryBounds, lbvhBuilder, sphereBuffer, quadBuffer, sphereGeometryBuffer, quadPlaneBuffer, bvhNodeBuffer, primitiveRefBuffer, wideNodeBuffer, gridBuffer);
+    numOfInstances = upload_instances(instancesData, geometries, geometryBounds, geometryOffsets, tlas, instanceBuffer, tlasNodeBuffer);
+    GLuint emitterBuffer, emitterAliasBuffer, lightNodeBuffer;
+    glGenBuffers(1, &emitterBuffer);
+    glGenBuffers(1, &emitterAliasBuffer);
+    glGenBuffers(1, &lightNodeBuffer);
+    numOfEmitters = upload_emitters(instancesData, geometries, materialsData, tlas, emitterBuffer, emitterAliasBuffer, lightNodeBuffer, emitterPower);
+    // Sobol matrices and the blue noise tile of the low discrepancy samplers, built once
+    GLuint samplerTableBuffer;
+    glGenBuffers(1, &samplerTableBuffer);
+    {
+        std::vector<SamplerTables> samplerTables(1);
+        build_sampler_tables(samplerTables[0]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, samplerTableBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(SamplerTables), samplerTables.data(), GL_STATIC_DRAW);
+    }
+    // Unconverged pixels behind the indirect dispatch arguments, rebuilt by the mask pass every ADAPTIVE_INTERVAL frames
+    GLuint adaptiveMaskProgram = create_compute_program("assets/shaders/adaptive_mask.glsl");
+    GLuint adaptiveWorkBuffer;
+    glGenBuffers(1, &adaptiveWorkBuffer);
+    unsigned int adaptiveCapacity = SCREEN_WIDTH * SCREEN_HEIGHT;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, adaptiveWorkBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (4 + adaptiveCapacity) * sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
+    // compute.glsl reads the list through a buffer texture, it has no shader storage block to spare
+    GLuint adaptiveWorkTex;
+    glCreateTextures(GL_TEXTURE_BUFFER, 1, &adaptiveWorkTex);
+    glTextureBuffer(adaptiveWorkTex, GL_R32UI, adaptiveWorkBuffer);
+    bool workListValid = false;
+    GLuint workListFrame = 0;
+    float activeFraction = 1.0f;
+    // The list's pixel count is copied into a persistently mapped buffer and read once its fence has passed, so the
+    // active fraction lags the list by up to an interval instead of stalling on the mask pass
+    GLuint activeCountBuffer;
+    glCreateBuffers(1, &activeCountBuffer);
+    glNamedBufferStorage(activeCountBuffer, sizeof(GLuint), nullptr, GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    const GLuint* mappedActiveCount = static_cast<const GLuint*>(glMapNamedBufferRange(activeCountBuffer, 0, sizeof(GLuint),
+                                                                                          GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT));
+    GLsync activeCountFence = nullptr;
+    GLuint activeCountPixels = 1;
+    // Set while the stop target is reached and the last image is only redisplayed
+    bool renderStopped = false;
+
+    // Geometry shown in the Scene Settings panel, which edits and new objects apply to
+    unsigned int selectedGeometry = 0;
+    // Primitives of the selected geometry edited since the last upload, as references with QUAD_REF_BIT marking quads
+    std::vector<GLuint> editedPrimitives;
+    // Materials edited since the last upload
+    std::vector<GLuint> editedMaterials;
+    // Background BLAS rebuild started when refits degrade the tree, and the edits it has not seen yet
+    std::future<BVH> bvhRebuild;
+    unsigned int rebuildGeometry = 0;
+    std::vector<GLuint> editedSinceRebuild;
+    unsigned int sceneGeneration = 0;
+    unsigned int rebuildGeneration = 0;
+
+    // GPU time of the compute dispatch, read back a frame late so the query does not stall the pipeline
+    GLuint timerQuery;
+    glGenQueries(1, &timerQuery);
+    bool timerQueryPending = false;
+    int timerQueryStructure = blasStructure;
+    float gpuFrameMs = 0.0f;
+    // Passes the timed frame ran and the passes the render budget allows per frame
+    unsigned int timedPasses = 1;
+    unsigned int budgetPasses = 1;
+    // Structure benchmark state, benchmarkStep is the index into benchmarkResults being measured or -1
+    std::vector<StructureBenchmark> benchmarkResults;
+    int benchmarkStep = -1;
+    unsigned int benchmarkWarmup = 0;
+    int structureBeforeBenchmark = blasStructure;
+    int renderModeBeforeBenchmark = c_renderMode;
+    bool anyHitBeforeBenchmark = c_anyHitOcclusion;
+    bool soaBeforeBenchmark = c_soaGeometry;
+    bool wavefrontBeforeBenchmark = c_wavefront;
+    int formatBeforeBenchmark = accumulationFormat;
 
     glLinkProgram(computeProgram);
 
-    // Set uniform variable locations
-    GLint resolutionLocation = glGetUniformLocation(computeProgram, "iResolution");
-    GLint lookFromLocation = glGetUniformLocation(computeProgram, "c_lookFrom");
-    GLint lookAtLocation = glGetUniformLocation(computeProgram, "c_lookAt");
-    GLint lookUpLocation = glGetUniformLocation(computeProgram, "c_lookUp");
-    GLint FOVLocation = glGetUniformLocation(computeProgram, "c_FOVDegrees");
-    GLint numBouncesLocation = glGetUniformLocation(computeProgram, "c_numBounces");
-    GLint samplesPerPixelLocation = glGetUniformLocation(computeProgram, "c_samplesPerPixel");
-    GLint defocusAngleLocation = glGetUniformLocation(computeProgram, "c_defocusAngle");
-    GLint focalDistLocation = glGetUniformLocation(computeProgram, "c_focusDist");
-    GLint skyLocation = glGetUniformLocation(computeProgram, "c_sky");
-    GLint frameCounterLocation = glGetUniformLocation(computeProgram, "frameCounter");
-    GLint numOfSpheresLocation = glGetUniformLocation(computeProgram, "numOfSpheres");
-    GLint numOfQuadsLocation = glGetUniformLocation(computeProgram, "numOfQuads");
+    WavefrontTracer wavefrontTracer;
+    setup_wavefront_tracer(wavefrontTracer);
+    PathUniforms computeUniforms = path_uniform_locations(computeProgram);
+    std::vector<PathUniforms> wavefrontUniforms;
+    for (GLuint program : {wavefrontTracer.generateProgram, wavefrontTracer.extendProgram, wavefrontTracer.shadeProgram,
+                           wavefrontTracer.connectProgram, wavefrontTracer.accumulateProgram}) {
+        wavefrontUniforms.push_back(path_uniform_locations(program));
+    }
 
     while (!glfwWindowShouldClose(window))
     {
-        glfwPollEvents();
+        if (renderStopped) {
+            glfwWaitEventsTimeout(STOP_WAIT_SECONDS);
+        } else {
+            glfwPollEvents();
+        }
 
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
@@ -261,6 +552,12 @@ int main() {
         static unsigned prevNumBounces = c_numBounces;
         static unsigned prevSamplesPerPixel = c_samplesPerPixel;
         static bool preSky = c_sky;
+        static bool prevNextEventEstimation = c_nextEventEstimation;
+        static bool prevLightBVH = c_lightBVH;
+        static int prevSampler = c_sampler;
+        static int prevRenderMode = c_renderMode;
+        static float prevAODistance = c_aoDistance;
+        static bool prevAnyHitOcclusion = c_anyHitOcclusion;
 
         ImGui::InputFloat3("Position", reinterpret_cast<float *>(&c_lookFrom));
         ImGui::InputFloat3("Orientation", reinterpret_cast<float *>(&c_lookAt));
@@ -270,9 +567,41 @@ int main() {
         ImGui::SliderFloat("Focus Distance", &c_focusDist, 0.1f, 50.0f);
         ImGui::SliderInt("Number of Bounces", (int*)&c_numBounces, 1, 30);
         ImGui::SliderInt("Samples per Pixel", (int*)&c_samplesPerPixel, 1, 20);
+        // None of these restart the accumulation, the next work list and stop check pick them up
+        ImGui::Checkbox("Adaptive Sampling", &c_adaptiveSampling);
+        ImGui::Checkbox("Render Budget", &c_renderBudget);
+        if (c_renderBudget) {
+            ImGui::SliderFloat("Budget", &c_renderBudgetMs, 1.0f, 100.0f, "%.0f ms");
+        }
+        ImGui::Combo("Stop At", &c_stopMode, stopModeNames, IM_ARRAYSIZE(stopModeNames));
+        if (c_stopMode == STOP_FRAMES) {
+            ImGui::InputInt("Frames", &c_stopFrames);
+        } else if (c_stopMode == STOP_SAMPLES) {
+            ImGui::InputInt("Samples", &c_stopSamples);
+        }
+        if (c_adaptiveSampling || c_stopMode == STOP_NOISE) {
+            ImGui::SliderFloat("Noise Threshold", &c_adaptiveThreshold, 0.001f, 0.1f, "%.4f", ImGuiSliderFlags_Logarithmic);
+            ImGui::Text("Active pixels: %.1f%%", activeFraction * 100.0f);
+        }
+        if (renderStopped) {
+            ImGui::Text("Stopped after %u frames", frameCounter);
+        }
         ImGui::Checkbox("Sky", &c_sky);
+        ImGui::Checkbox("Next Event Estimation", &c_nextEventEstimation);
+        if (c_nextEventEstimation) {
+            ImGui::Checkbox("Light BVH", &c_lightBVH);
+        }
+        ImGui::Combo("Sampler", &c_sampler, samplerNames, IM_ARRAYSIZE(samplerNames));
+        ImGui::Combo("Render Mode", &c_renderMode, renderModeNames, IM_ARRAYSIZE(renderModeNames));
+        ImGui::SliderFloat("Exposure", &c_exposure, -5.0f, 5.0f, "%.1f EV");
+        ImGui::Combo("Tonemap", &c_tonemap, tonemapNames, IM_ARRAYSIZE(tonemapNames));
+        if (c_renderMode == RENDER_AMBIENT_OCCLUSION) {
+            ImGui::SliderFloat("AO Distance", &c_aoDistance, 0.01f, 5.0f);
+            ImGui::Checkbox("Any-hit Occlusion", &c_anyHitOcclusion);
+        }
 
-        if (prevLookFrom != c_lookFrom || prevLookAt != c_lookAt || prevLookUp != c_lookUp || c_FOVDegrees != prevFOV || c_numBounces != prevNumBounces || prevDefocusAngle != c_defocusAngle || prevFocusDist != c_focusDist || prevSamplesPerPixel != c_samplesPerPixel || preSky != c_sky) {
+        if (prevLookFrom != c_lookFrom || prevLookAt != c_lookAt || prevLookUp != c_lookUp || c_FOVDegrees != prevFOV || c_numBounces != prevNumBounces || prevDefocusAngle != c_defocusAngle || prevFocusDist != c_focusDist || prevSamplesPerPixel != c_samplesPerPixel || preSky != c_sky ||
+            prevNextEventEstimation != c_nextEventEstimation || prevLightBVH != c_lightBVH || prevSampler != c_sampler || prevRenderMode != c_renderMode || prevAODistance != c_aoDistance || prevAnyHitOcclusion != c_anyHitOcclusion) {
             settingsChanged = true;
             prevLookFrom = c_lookFrom;
             prevLookAt = c_lookAt;
@@ -283,6 +612,12 @@ int main() {
             prevNumBounces = c_numBounces;
             prevSamplesPerPixel = c_samplesPerPixel;
             preSky = c_sky;
+            prevNextEventEstimation = c_nextEventEstimation;
+            prevLightBVH = c_lightBVH;
+            prevSampler = c_sampler;
+            prevRenderMode = c_renderMode;
+            prevAODistance = c_aoDistance;
+            prevAnyHitOcclusion = c_anyHitOcclusion;
         }
 
         ImGui::End();
@@ -290,19 +625,91 @@ int main() {
         // Scene Settings Window
         ImGui::Begin("Scene Settings");
 
+        if (ImGui::BeginCombo("Geometry", geometries[selectedGeometry].name.c_str())) {
+            for (unsigned int g = 0; g < geometries.size(); ++g) {
+                if (ImGui::Selectable((geometries[g].name + "##" + std::to_string(g)).c_str(), g == selectedGeometry)) {
+                    selectedGeometry = g;
+                }
+            }
+            ImGui::EndCombo();
+        }
+        if (ImGui::Button("Add Geometry")) {
+            geometries.push_back({"Geometry " + std::to_string(geometries.size()), {}, {}});
+            geometryBVHs.emplace_back();
+            geometryWideBVHs.emplace_back();
+            geometryGrids.emplace_back();
+            build_bvh(geometryBVHs.back(), geometries.back().spheres, geometries.back().quads);
+            selectedGeometry = geometries.size() - 1;
+            sceneChanged = true;
+            settingsChanged = true;
+        }
+
+        std::vector<Sphere>& spheresData = geometries[selectedGeometry].spheres;
+        std::vector<Quad>& quadsData = geometries[selectedGeometry].quads;
+        BVH& geometryBVH = geometryBVHs[selectedGeometry];
+
+        if (ImGui::Button("Add Material")) {
+            materialsData.push_back({glm::vec3(1.0f), 0, glm::vec3(0.0f), 0, 0, 0, {0, 0}});
+            materialsChanged = true;
+        }
+
+        if (ImGui::TreeNode("Materials")) {
+            for (unsigned int i = 0; i < materialsData.size(); ++i) {
+                std::string materialLabel = "Material " + std::to_string(i);
+                if (ImGui::TreeNode(materialLabel.c_str())) {
+                    bool edited = false;
+                    edited |= ImGui::ColorEdit3(("Albedo##material" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&materialsData[i].albedo));
+                    edited |= ImGui::SliderFloat(("Reflectivity##material" + std::to_string(i)).c_str(), &materialsData[i].reflectivity, 0.0f, 1.0f);
+                    edited |= ImGui::SliderFloat(("Fuzz##material" + std::to_string(i)).c_str(), &materialsData[i].fuzz, 0.0f, 1.0f);
+                    edited |= ImGui::InputFloat(("Refraction Index##material" + std::to_string(i)).c_str(), &materialsData[i].refractionIndex);
+                    edited |= ImGui::ColorEdit3(("Emission##material" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&materialsData[i].emission));
+                    edited |= ImGui::InputFloat(("Emission Strength##material" + std::to_string(i)).c_str(), &materialsData[i].emissionStrength);
+                    if (edited) {
+                        editedMaterials.push_back(i);
+                        settingsChanged = true;
+                    }
+                    ImGui::TreePop();
+                }
+            }
+            ImGui::TreePop();
+        }
+
         if (ImGui::Button("Add Sphere")) {
             Sphere s;
             s.center = glm::vec3(0.0f);
             s.radius = 1.0f; // radius
-            s.albedo = glm::vec3(1.0f);
-            s.reflectivity = 0;
-            s.fuzz = 0;
-            s.refractionIndex = 0;
-            s.emission = glm::vec3(0.0f);
+            s.materialId = 0;
 
             spheresData.push_back(s);
 
-            numOfSpheres++;
+            sceneChanged = true;
+            settingsChanged = true;
+        }
+
+        // Random field of small spheres inside the box, for stress testing the acceleration structure
+        static int sphereFieldCount = 1000;
+        static float sphereFieldRadius = 0.01f;
+        ImGui::InputInt("Field Count", &sphereFieldCount);
+        ImGui::InputFloat("Field Radius", &sphereFieldRadius);
+        if (ImGui::Button("Add Sphere Field")) {
+            std::mt19937 rng(static_cast<unsigned>(spheresData.size()));
+            std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+            std::uniform_int_distribution<unsigned int> pickMaterial(0, SPHERE_FIELD_MATERIALS - 1);
+            unsigned int firstMaterial = (unsigned int)materialsData.size();
+            for (unsigned int m = 0; m < SPHERE_FIELD_MATERIALS; ++m) {
+                materialsData.push_back({glm::vec3(unit(rng), unit(rng), unit(rng)), 0, glm::vec3(0.0f), 0, 0, 0, {0, 0}});
+            }
+            materialsChanged = true;
+            for (int i = 0; i < sphereFieldCount; ++i) {
+                Sphere s;
+                s.center = glm::vec3(-0.9f + 1.8f * unit(rng), -0.9f + 1.8f * unit(rng), -3.9f + 1.8f * unit(rng));
+                s.radius = sphereFieldRadius;
+                s.materialId = firstMaterial + pickMaterial(rng);
+
+                spheresData.push_back(s);
+            }
+
+            sceneChanged = true;
             settingsChanged = true;
         }
 
@@ -312,123 +719,581 @@ int main() {
             q.b = glm::vec3(0.0f);
             q.c = glm::vec3(0.0f);
             q.d = glm::vec3(0.0f);
-            q.normal = glm::vec3(0.0f);
-            q.albedo = glm::vec3(1.0f);
-            q.reflectivity = 0;
-            q.fuzz = 0;
-            q.refractionIndex = 0;
-            q.emission = glm::vec3(0.0f);
+            q.materialId = 0;
+            derive_quad_plane(q);
 
             quadsData.push_back(q);
 
-            numOfQuads++;
+            sceneChanged = true;
             settingsChanged = true;
         }
 
-        for (unsigned int i = 0; i < numOfSpheres; ++i) {
-            std::string sphereLabel = "Sphere " + std::to_string(i);
-            if (ImGui::TreeNode(sphereLabel.c_str())) {
-                ImGui::InputFloat3(("Position##" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&spheresData[i].center));
-                ImGui::InputFloat(("Radius##" + std::to_string(i)).c_str(), &spheresData[i].radius);
-                ImGui::ColorEdit3(("Albedo##" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&spheresData[i].albedo));
-                ImGui::SliderFloat(("Reflectivity##" + std::to_string(i)).c_str(), &spheresData[i].reflectivity, 0.0f, 1.0f);
-                ImGui::SliderFloat(("Fuzz##" + std::to_string(i)).c_str(), &spheresData[i].fuzz, 0.0f, 1.0f);
-                ImGui::InputFloat(("Refraction Index##" + std::to_string(i)).c_str(), &spheresData[i].refractionIndex);
-                ImGui::ColorEdit3(("Emission##" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&spheresData[i].emission)); // New emission input
-                ImGui::InputFloat(("Emission Strength##" + std::to_string(i)).c_str(), &spheresData[i].emissionStrength);
-
-                if (ImGui::Button(("Remove##" + std::to_string(i)).c_str())) {
-                    for (unsigned int j = i; j < numOfSpheres - 1; ++j) {
-                        spheresData[j] = spheresData[j + 1];
+        if (ImGui::TreeNode("Spheres")) {
+            for (unsigned int i = 0; i < spheresData.size(); ++i) {
+                std::string sphereLabel = "Sphere " + std::to_string(i);
+                if (ImGui::TreeNode(sphereLabel.c_str())) {
+                    bool edited = false;
+                    edited |= ImGui::InputFloat3(("Position##" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&spheresData[i].center));
+                    edited |= ImGui::InputFloat(("Radius##" + std::to_string(i)).c_str(), &spheresData[i].radius);
+                    edited |= material_combo("Material##sphere" + std::to_string(i), spheresData[i].materialId, materialsData.size());
+                    if (edited) {
+                        editedPrimitives.push_back(i);
+                        settingsChanged = true;
                     }
-                    spheresData.pop_back();
-                    numOfSpheres--;
-                    settingsChanged = true;
+
+                    if (ImGui::Button(("Remove##" + std::to_string(i)).c_str())) {
+                        for (unsigned int j = i; j < spheresData.size() - 1; ++j) {
+                            spheresData[j] = spheresData[j + 1];
+                        }
+                        spheresData.pop_back();
+                        sceneChanged = true;
+                        settingsChanged = true;
+                    }
+                    if (ImGui::Button(("Apply"))) {
+                        settingsChanged = true;
+                    }
+                    ImGui::TreePop();
                 }
-                if (ImGui::Button(("Apply"))) {
-                    settingsChanged = true;
+            }
+            ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNode("Quads")) {
+            for (unsigned int i = 0; i < quadsData.size(); ++i) {
+                std::string quadLabel = "Quad " + std::to_string(i);
+                if (ImGui::TreeNode(quadLabel.c_str())) {
+                    bool edited = false;
+                    edited |= ImGui::InputFloat3(("A##" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&quadsData[i].a));
+                    edited |= ImGui::InputFloat3(("B##" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&quadsData[i].b));
+                    edited |= ImGui::InputFloat3(("D##" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&quadsData[i].d));
+                    edited |= material_combo("Material##quad" + std::to_string(i), quadsData[i].materialId, materialsData.size());
+                    if (edited) {
+                        derive_quad_plane(quadsData[i]);
+                        editedPrimitives.push_back(i | QUAD_REF_BIT);
+                        settingsChanged = true;
+                    }
+
+                    if (ImGui::Button(("Remove##" + std::to_string(i)).c_str())) {
+                        for (unsigned int j = i; j < quadsData.size() - 1; ++j) {
+                            quadsData[j] = quadsData[j + 1];
+                        }
+                        quadsData.pop_back();
+                        sceneChanged = true;
+                        settingsChanged = true;
+                    }
+                    if (ImGui::Button(("Apply"))) {
+                        settingsChanged = true;
+                    }
+                    ImGui::TreePop();
                 }
-                ImGui::TreePop();
-            }
-        }
-
-        for (unsigned int i = 0; i < numOfQuads; ++i) {
-            std::string quadLabel = "Quad " + std::to_string(i);
-            if (ImGui::TreeNode(quadLabel.c_str())) {
-                ImGui::InputFloat3(("A##" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&quadsData[i].a));
-                ImGui::InputFloat3(("B##" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&quadsData[i].b));
-                ImGui::InputFloat3(("C##" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&quadsData[i].c));
-                ImGui::InputFloat3(("D##" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&quadsData[i].d));
-                ImGui::InputFloat3(("Normal##" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&quadsData[i].normal));
-                ImGui::ColorEdit3(("Albedo##" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&quadsData[i].albedo));
-                ImGui::SliderFloat(("Reflectivity##" + std::to_string(i)).c_str(), &quadsData[i].reflectivity, 0.0f, 1.0f);
-                ImGui::SliderFloat(("Fuzz##" + std::to_string(i)).c_str(), &quadsData[i].fuzz, 0.0f, 1.0f);
-                ImGui::InputFloat(("Refraction Index##" + std::to_string(i)).c_str(), &quadsData[i].refractionIndex);
-                ImGui::ColorEdit3(("Emission Color##" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&quadsData[i].emission)); // New emission input
-                ImGui::InputFloat(("Emission Strength##" + std::to_string(i)).c_str(), &quadsData[i].emissionStrength);
-
-                if (ImGui::Button(("Remove##" + std::to_string(i)).c_str())) {
-                    for (unsigned int j = i; j < numOfQuads - 1; ++j) {
-                        quadsData[j] = quadsData[j + 1];
+            }
+            ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNode("Instances")) {
+            for (unsigned int i = 0; i < instancesData.size(); ++i) {
+                std::string instanceLabel = "Instance " + std::to_string(i) + " (" + geometries[instancesData[i].geometry].name + ")";
+                if (ImGui::TreeNode((instanceLabel + "##instance").c_str())) {
+                    bool edited = false;
+                    int geometry = static_cast<int>(instancesData[i].geometry);
+                    if (ImGui::InputInt(("Geometry##instance" + std::to_string(i)).c_str(), &geometry)) {
+                        instancesData[i].geometry = static_cast<unsigned int>(glm::clamp(geometry, 0, static_cast<int>(geometries.size()) - 1));
+                        edited = true;
+                    }
+                    edited |= ImGui::InputFloat3(("Position##instance" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&instancesData[i].position));
+                    edited |= ImGui::InputFloat3(("Rotation##instance" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&instancesData[i].rotation));
+                    if (ImGui::InputFloat3(("Scale##instance" + std::to_string(i)).c_str(), reinterpret_cast<float *>(&instancesData[i].scale))) {
+                        glm::vec3& scale = instancesData[i].scale;
+                        for (int axis = 0; axis < 3; ++axis) {
+                            if (std::abs(scale[axis]) < MIN_INSTANCE_SCALE) {
+                                scale[axis] = std::signbit(scale[axis]) ? -MIN_INSTANCE_SCALE : MIN_INSTANCE_SCALE;
+                            }
+                        }
+                        edited = true;
+                    }
+
+                    if (ImGui::Button(("Remove##instance" + std::to_string(i)).c_str())) {
+                        instancesData.erase(instancesData.begin() + i);
+                        edited = true;
                     }
-                    quadsData.pop_back();
-                    numOfQuads--;
+                    if (edited) {
+                        instancesChanged = true;
+                        settingsChanged = true;
+                    }
+                    ImGui::TreePop();
+                }
+            }
+            if (ImGui::Button("Add Instance")) {
+                instancesData.push_back({selectedGeometry, glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(1.0f)});
+                instancesChanged = true;
+                settingsChanged = true;
+            }
+            ImGui::TreePop();
+        }
+
+        ImGui::Text("BLAS SAH cost: %.2f (built %.2f)%s", geometryBVH.cost, geometryBVH.buildCost, bvhRebuild.valid() ? ", rebuilding" : "");
+        ImGui::Text("Emitters: %u", numOfEmitters);
+        ImGui::End();
+
+        // Stats Window
+        ImGui::Begin("Stats");
+
+        ImGui::Text("GPU frame: %.2f ms, %u passes (%.1f Msamples/s)", gpuFrameMs, timedPasses,
+                    gpuFrameMs > 0.0f ? SCREEN_WIDTH * SCREEN_HEIGHT * activeFraction * c_samplesPerPixel * timedPasses / (gpuFrameMs * 1e3f) : 0.0f);
+        const BlasStructure& selectedStructure = blasStructures[blasStructure];
+        if (ImGui::BeginCombo("BLAS Structure", selectedStructure.name)) {
+            for (int i = 0; i < BLAS_STRUCTURE_COUNT; ++i) {
+                if (ImGui::Selectable(blasStructures[i].name, i == blasStructure) && benchmarkStep < 0 && i != blasStructure) {
+                    blasStructure = i;
+                    structureChanged = true;
                     settingsChanged = true;
                 }
-                if (ImGui::Button(("Apply"))) {
+            }
+            ImGui::EndCombo();
+        }
+        if (selectedStructure.accelMode == ACCEL_BVH) {
+            ImGui::Text("BLAS nodes: %u bytes per node, %.1f KB", selectedStructure.bvhWidth == 2 ? (unsigned int)sizeof(BVHNode) : wide_node_stride(selectedStructure.bvhWidth) * 4,
+                        blas_node_bytes(geometries, geometryBVHs, geometryWideBVHs, geometryGrids) / 1024.0f);
+            if (selectedStructure.gpuBuild) {
+                ImGui::Text("Last LBVH build: %.2f ms", lbvhBuilder.buildMs);
+            }
+        } else {
+            ImGui::Text("BLAS grids: %.1f KB", blas_node_bytes(geometries, geometryBVHs, geometryWideBVHs, geometryGrids) / 1024.0f);
+        }
+
+        ImGui::Checkbox("SoA Geometry", &c_soaGeometry);
+        ImGui::SameLine();
+        ImGui::Checkbox("Wavefront", &c_wavefront);
+        ImGui::SameLine();
+        ImGui::Checkbox("Persistent Threads", &c_persistentThreads);
+        if (c_persistentThreads) {
+            ImGui::SliderInt("Persistent Groups", &c_persistentGroups, 64, 16384);
+            ImGui::SameLine();
+            if (ImGui::Button("Device")) {
+                c_persistentGroups = devicePersistentGroups;
+            }
+        }
+        if (ImGui::BeginCombo("Accumulation Format", accumulationFormats[accumulationFormat].name)) {
+            for (int i = 0; i < ACCUMULATION_FORMAT_COUNT; ++i) {
+                if (ImGui::Selectable(accumulationFormats[i].name, i == accumulationFormat) && benchmarkStep < 0 && i != accumulationFormat) {
+                    accumulationFormat = i;
+                    formatChanged = true;
                     settingsChanged = true;
                 }
-                ImGui::TreePop();
             }
+            ImGui::EndCombo();
+        }
+        ImGui::Text("Accumulation: %.1f MB", (double)SCREEN_WIDTH * SCREEN_HEIGHT *
+                    (accumulationFormats[accumulationFormat].bytesPerPixel + VARIANCE_BYTES_PER_PIXEL) / (1024.0 * 1024.0));
+        bool benchmarkStructures = ImGui::Button("Benchmark Structures");
+        ImGui::SameLine();
+        bool benchmarkOcclusion = ImGui::Button("Benchmark Occlusion");
+        ImGui::SameLine();
+        bool benchmarkGeometryLayout = ImGui::Button("Benchmark Geometry Layout");
+        ImGui::SameLine();
+        bool benchmarkWavefront = ImGui::Button("Benchmark Wavefront");
+        ImGui::SameLine();
+        bool benchmarkFormats = ImGui::Button("Benchmark Formats");
+        if ((benchmarkStructures || benchmarkOcclusion || benchmarkGeometryLayout || benchmarkWavefront || benchmarkFormats) && benchmarkStep < 0) {
+            benchmarkResults.clear();
+            if (benchmarkStructures) {
+                for (int i = 0; i < BLAS_STRUCTURE_COUNT; ++i) {
+                    benchmarkResults.push_back({i, c_renderMode, c_anyHitOcclusion, c_soaGeometry, c_wavefront, accumulationFormat});
+                }
+            } else if (benchmarkOcclusion) {
+                // Ambient occlusion rays on the current structure, through closest-hit queries and then the any-hit query
+                benchmarkResults.push_back({blasStructure, RENDER_AMBIENT_OCCLUSION, false, c_soaGeometry, false, accumulationFormat});
+                benchmarkResults.push_back({blasStructure, RENDER_AMBIENT_OCCLUSION, true, c_soaGeometry, false, accumulationFormat});
+            } else if (benchmarkGeometryLayout) {
+                // Primitive tests on the current structure reading the full records and then the geometry only buffers
+                benchmarkResults.push_back({blasStructure, c_renderMode, c_anyHitOcclusion, false, c_wavefront, accumulationFormat});
+                benchmarkResults.push_back({blasStructure, c_renderMode, c_anyHitOcclusion, true, c_wavefront, accumulationFormat});
+            } else if (benchmarkWavefront) {
+                // Path tracing on the current structure in the megakernel and then in the wavefront kernels
+                benchmarkResults.push_back({blasStructure, RENDER_PATH_TRACE, c_anyHitOcclusion, c_soaGeometry, false, accumulationFormat});
+                benchmarkResults.push_back({blasStructure, RENDER_PATH_TRACE, c_anyHitOcclusion, c_soaGeometry, true, accumulationFormat});
+            } else {
+                // The current settings with every accumulation format
+                for (int i = 0; i < ACCUMULATION_FORMAT_COUNT; ++i) {
+                    benchmarkResults.push_back({blasStructure, c_renderMode, c_anyHitOcclusion, c_soaGeometry, c_wavefront, i});
+                }
+            }
+            structureBeforeBenchmark = blasStructure;
+            renderModeBeforeBenchmark = c_renderMode;
+            anyHitBeforeBenchmark = c_anyHitOcclusion;
+            soaBeforeBenchmark = c_soaGeometry;
+            wavefrontBeforeBenchmark = c_wavefront;
+            formatBeforeBenchmark = accumulationFormat;
+            benchmarkStep = 0;
+            benchmarkWarmup = BENCHMARK_WARMUP_FRAMES;
+            blasStructure = benchmarkResults[0].structure;
+            c_renderMode = benchmarkResults[0].renderMode;
+            c_anyHitOcclusion = benchmarkResults[0].anyHitOcclusion;
+            c_soaGeometry = benchmarkResults[0].soaGeometry;
+            c_wavefront = benchmarkResults[0].wavefront;
+            accumulationFormat = benchmarkResults[0].accumulationFormat;
+            structureChanged = true;
+            formatChanged = true;
+            settingsChanged = true;
         }
+        for (unsigned int i = 0; i < benchmarkResults.size(); ++i) {
+            const StructureBenchmark& result = benchmarkResults[i];
+            std::string label = benchmark_label(result);
+            const char* name = label.c_str();
+            if (result.frames == 0) {
+                ImGui::Text("%s: %s", name, benchmarkStep == (int)i ? "running" : "pending");
+                continue;
+            }
+            ImGui::Text("%s: %.2f ms, %.1f Mrays/s, %.1f KB, %.0f geometry B/ray", name, result.gpuMs / result.frames,
+                        result.rays / (result.gpuMs * 1e3), result.nodeBytes / 1024.0f, result.geometryBytes / result.rays);
+        }
+
         ImGui::End();
 
         ImGui::Render();
 
+        // Read back the previous dispatch's GPU time and feed the structure benchmark
+        if (timerQueryPending) {
+            GLuint64 elapsed = 0;
+            glGetQueryObjectui64v(timerQuery, GL_QUERY_RESULT, &elapsed);
+            gpuFrameMs = elapsed / 1e6f;
+            timerQueryPending = false;
+            if (gpuFrameMs > 0.0f) {
+                budgetPasses = std::clamp((unsigned int)(c_renderBudgetMs * timedPasses / gpuFrameMs), 1u, MAX_BUDGET_PASSES);
+            }
+
+            if (benchmarkStep >= 0 && timerQueryStructure == benchmarkResults[benchmarkStep].structure) {
+                StructureBenchmark& result = benchmarkResults[benchmarkStep];
+                if (benchmarkWarmup > 0) {
+                    benchmarkWarmup--;
+                } else {
+                    RayCounters counters = {};
+                    glBindBuffer(GL_SHADER_STORAGE_BUFFER, rayCounterBuffer);
+                    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(RayCounters), &counters);
+                    result.gpuMs += gpuFrameMs;
+                    result.rays += counters.rays;
+                    result.geometryBytes += result.soaGeometry
+                            ? (double)counters.sphereTests * sizeof(glm::vec4) + (double)counters.quadTests * sizeof(QuadPlane)
+                            : (double)counters.sphereTests * sizeof(Sphere) + (double)counters.quadTests * sizeof(Quad);
+                    result.frames++;
+                    result.nodeBytes = blas_node_bytes(geometries, geometryBVHs, geometryWideBVHs, geometryGrids);
+                }
+
+                if (result.frames == BENCHMARK_FRAMES) {
+                    std::cout << benchmark_label(result) << ": " << result.gpuMs / result.frames << " ms, "
+                              << result.rays / (result.gpuMs * 1e3) << " Mrays/s, " << result.nodeBytes << " bytes, "
+                              << result.geometryBytes / result.rays << " geometry bytes/ray" << std::endl;
+                    benchmarkStep++;
+                    if (benchmarkStep == (int)benchmarkResults.size()) {
+                        benchmarkStep = -1;
+                        blasStructure = structureBeforeBenchmark;
+                        c_renderMode = renderModeBeforeBenchmark;
+                        c_anyHitOcclusion = anyHitBeforeBenchmark;
+                        c_soaGeometry = soaBeforeBenchmark;
+                        c_wavefront = wavefrontBeforeBenchmark;
+                        accumulationFormat = formatBeforeBenchmark;
+                    } else {
+                        benchmarkWarmup = BENCHMARK_WARMUP_FRAMES;
+                        blasStructure = benchmarkResults[benchmarkStep].structure;
+                        c_renderMode = benchmarkResults[benchmarkStep].renderMode;
+                        c_anyHitOcclusion = benchmarkResults[benchmarkStep].anyHitOcclusion;
+                        c_soaGeometry = benchmarkResults[benchmarkStep].soaGeometry;
+                        c_wavefront = benchmarkResults[benchmarkStep].wavefront;
+                        accumulationFormat = benchmarkResults[benchmarkStep].accumulationFormat;
+                    }
+                    structureChanged = true;
+                    formatChanged = true;
+                    settingsChanged = true;
+                }
+            }
+        }
+
+        // Swap in a finished background rebuild unless spheres or quads were added or removed meanwhile
+        if (bvhRebuild.valid() && bvhRebuild.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            BVH rebuilt = bvhRebuild.get();
+            if (rebuildGeneration == sceneGeneration) {
+                Geometry& geometry = geometries[rebuildGeometry];
+                geometryBVHs[rebuildGeometry] = std::move(rebuilt);
+                unsigned int firstChanged = UINT_MAX, lastChanged = 0;
+                for (GLuint ref : editedSinceRebuild) {
+                    refit_bvh(geometryBVHs[rebuildGeometry], geometry.spheres, geometry.quads, ref, firstChanged, lastChanged);
+                }
+                // The node count may have changed, so every BLAS after this one moves
+                upload_geometries(geometries, geometryBVHs, geometryWideBVHs, geometryGrids, geometryOffsets, geometryBounds, lbvhBuilder, sphereBuffer, quadBuffer, sphereGeometryBuffer, quadPlaneBuffer, bvhNodeBuffer, primitiveRefBuffer, wideNodeBuffer, gridBuffer);
+                numOfInstances = upload_instances(instancesData, geometries, geometryBounds, geometryOffsets, tlas, instanceBuffer, tlasNodeBuffer);
+            }
+            editedSinceRebuild.clear();
+        }
+
+        // Materials are uploaded apart from the geometry, editing one only uploads its own record
+        if (materialsChanged) {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, materialBuffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, materialsData.size() * sizeof(Material), materialsData.data(), GL_STATIC_DRAW);
+            materialsChanged = false;
+            editedMaterials.clear();
+        }
+        for (GLuint m : editedMaterials) {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, materialBuffer);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, m * sizeof(Material), sizeof(Material), &materialsData[m]);
+        }
+        editedMaterials.clear();
+
         if (settingsChanged) {
+            if (formatChanged) {
+                glDeleteTextures(1, &accumulationTex);
+                setup_accumulation_texture(accumulationTex);
+                formatChanged = false;
+            }
             glUseProgram(computeProgram);
-            // Update sphere buffer
-            glBindBuffer(GL_SHADER_STORAGE_BUFFER, sphereBuffer);
-            glBufferData(GL_SHADER_STORAGE_BUFFER, spheresData.size() * sizeof(Sphere), spheresData.data(), GL_STATIC_DRAW);
-            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, sphereBuffer); // Bind to binding point 0
-            // Update quad buffer
-            glBindBuffer(GL_SHADER_STORAGE_BUFFER, quadBuffer);
-            glBufferData(GL_SHADER_STORAGE_BUFFER, quadsData.size() * sizeof(Quad), quadsData.data(), GL_STATIC_DRAW);
-            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, quadBuffer); // Bind to binding point 0
+            const BlasStructure& structure = blasStructures[blasStructure];
+            if (structureChanged) {
+                // Host BVHs are not kept up to date while grids or GPU built trees are traversed, build the ones that went stale
+                if (structure.accelMode == ACCEL_BVH && !structure.gpuBuild) {
+                    for (unsigned int g = 0; g < geometries.size(); ++g) {
+                        if (geometryBVHs[g].nodes.empty()) {
+                            build_bvh(geometryBVHs[g], geometries[g].spheres, geometries[g].quads);
+                        }
+                    }
+                }
+                // Node offsets differ between structures, so all geometry buffers and the instances are uploaded again
+                upload_geometries(geometries, geometryBVHs, geometryWideBVHs, geometryGrids, geometryOffsets, geometryBounds, lbvhBuilder, sphereBuffer, quadBuffer, sphereGeometryBuffer, quadPlaneBuffer, bvhNodeBuffer, primitiveRefBuffer, wideNodeBuffer, gridBuffer);
+                structureChanged = false;
+                instancesChanged = true;
+            }
+            // Grids are cheap enough to rebuild from scratch, so edits take the same path as added or removed objects
+            if (sceneChanged || (structure.accelMode == ACCEL_GRID && !editedPrimitives.empty())) {
+                // Rebuild the selected geometry's BLAS and update all geometry buffers
+                if (structure.accelMode == ACCEL_BVH && !structure.gpuBuild) {
+                    build_bvh(geometryBVH, spheresData, quadsData);
+                } else {
+                    geometryBVH = BVH();
+                }
+                upload_geometries(geometries, geometryBVHs, geometryWideBVHs, geometryGrids, geometryOffsets, geometryBounds, lbvhBuilder, sphereBuffer, quadBuffer, sphereGeometryBuffer, quadPlaneBuffer, bvhNodeBuffer, primitiveRefBuffer, wideNodeBuffer, gridBuffer);
+
+                sceneGeneration++;
+                sceneChanged = false;
+                instancesChanged = true;
+            } else if (!editedPrimitives.empty()) {
+                // Upload only the edited records and refit the BLAS along their ancestors, or rebuild it on the GPU
+                const GeometryOffsets& offsets = geometryOffsets[selectedGeometry];
+                unsigned int firstChanged = UINT_MAX, lastChanged = 0;
+                for (GLuint ref : editedPrimitives) {
+                    if (ref & QUAD_REF_BIT) {
+                        GLuint index = ref & ~QUAD_REF_BIT;
+                        glBindBuffer(GL_SHADER_STORAGE_BUFFER, quadBuffer);
+                        glBufferSubData(GL_SHADER_STORAGE_BUFFER, (offsets.quadOffset + index) * sizeof(Quad), sizeof(Quad), &quadsData[index]);
+                        QuadPlane plane = quad_plane(quadsData[index]);
+                        glBindBuffer(GL_SHADER_STORAGE_BUFFER, quadPlaneBuffer);
+                        glBufferSubData(GL_SHADER_STORAGE_BUFFER, (offsets.quadOffset + index) * sizeof(QuadPlane), sizeof(QuadPlane), &plane);
+                    } else {
+                        glBindBuffer(GL_SHADER_STORAGE_BUFFER, sphereBuffer);
+                        glBufferSubData(GL_SHADER_STORAGE_BUFFER, (offsets.sphereOffset + ref) * sizeof(Sphere), sizeof(Sphere), &spheresData[ref]);
+                        glm::vec4 geometry = sphere_geometry(spheresData[ref]);
+                        glBindBuffer(GL_SHADER_STORAGE_BUFFER, sphereGeometryBuffer);
+                        glBufferSubData(GL_SHADER_STORAGE_BUFFER, (offsets.sphereOffset + ref) * sizeof(glm::vec4), sizeof(glm::vec4), &geometry);
+                    }
+                    if (structure.gpuBuild) {
+                        continue;
+                    }
+                    refit_bvh(geometryBVH, spheresData, quadsData, ref, firstChanged, lastChanged);
+                    if (bvhRebuild.valid() && rebuildGeometry == selectedGeometry) {
+                        editedSinceRebuild.push_back(ref);
+                    }
+                }
+                if (structure.gpuBuild) {
+                    // The host BVH goes stale like it does while grids are traversed
+                    geometryBVH = BVH();
+                    AABB bounds = build_lbvh(lbvhBuilder, offsets, (GLuint)spheresData.size(), (GLuint)quadsData.size(),
+                                             sphereGeometryBuffer, quadPlaneBuffer, bvhNodeBuffer, primitiveRefBuffer);
+                    if (bounds.min != geometryBounds[selectedGeometry].min || bounds.max != geometryBounds[selectedGeometry].max) {
+                        geometryBounds[selectedGeometry] = bounds;
+                        instancesChanged = true;
+                    }
+                }
+                if (firstChanged <= lastChanged) {
+                    if (structure.bvhWidth == 2) {
+                        glBindBuffer(GL_SHADER_STORAGE_BUFFER, bvhNodeBuffer);
+                        glBufferSubData(GL_SHADER_STORAGE_BUFFER, (offsets.nodeOffset + firstChanged) * sizeof(BVHNode), (lastChanged - firstChanged + 1) * sizeof(BVHNode), &geometryBVH.nodes[firstChanged]);
+                    } else {
+                        // Requantize the wide nodes along the edited primitives and upload the ones whose encoding changed
+                        WideBVH& wide = geometryWideBVHs[selectedGeometry];
+                        unsigned int stride = wide_node_stride(structure.bvhWidth);
+                        unsigned int firstWide = UINT_MAX, lastWide = 0;
+                        for (GLuint ref : editedPrimitives) {
+                            refit_wide_bvh(geometryBVH, wide, ref, firstChanged, firstWide, lastWide);
+                        }
+                        if (firstWide <= lastWide) {
+                            glBindBuffer(GL_SHADER_STORAGE_BUFFER, wideNodeBuffer);
+                            glBufferSubData(GL_SHADER_STORAGE_BUFFER, (offsets.nodeOffset + firstWide) * stride * sizeof(GLuint), (lastWide - firstWide + 1) * stride * sizeof(GLuint), &wide.data[firstWide * stride]);
+                        }
+                    }
+                    // A changed root moves the instance bounds the TLAS is built over
+                    if (firstChanged == 0) {
+                        geometryBounds[selectedGeometry].min = geometryBVH.nodes[0].aabbMin;
+                        geometryBounds[selectedGeometry].max = geometryBVH.nodes[0].aabbMax;
+                        instancesChanged = true;
+                    }
+                }
+
+                if (!bvhRebuild.valid() && geometryBVH.cost > geometryBVH.buildCost * BVH_REBUILD_THRESHOLD) {
+                    rebuildGeneration = sceneGeneration;
+                    rebuildGeometry = selectedGeometry;
+                    bvhRebuild = std::async(std::launch::async, [spheres = spheresData, quads = quadsData]() {
+                        BVH bvh;
+                        build_bvh(bvh, spheres, quads);
+                        return bvh;
+                    });
+                }
+            }
+            if (instancesChanged) {
+                numOfInstances = upload_instances(instancesData, geometries, geometryBounds, geometryOffsets, tlas, instanceBuffer, tlasNodeBuffer);
+                instancesChanged = false;
+            }
+            // Any edit may have turned a primitive or material emissive or moved an emitter's instance
+            numOfEmitters = upload_emitters(instancesData, geometries, materialsData, tlas, emitterBuffer, emitterAliasBuffer, lightNodeBuffer, emitterPower);
+            editedPrimitives.clear();
 
             frameCounter = 0;
             settingsChanged = false;
             // Clear the accumulation buffer
-            float clearColor[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+            float clearColor[4] = {0.0f, 0.0f, 0.0f, 0.0f};
             glClearTexImage(accumulationTex, 0, GL_RGBA, GL_FLOAT, clearColor);
             // Rebind accumulation texture
-            glBindImageTexture(1, accumulationTex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
-        }
-        glUseProgram(computeProgram);
-        glUniform2i(resolutionLocation, SCREEN_WIDTH, SCREEN_HEIGHT);
-        glUniform3f(lookFromLocation, c_lookFrom.x, c_lookFrom.y, c_lookFrom.z);
-        glUniform3f(lookAtLocation, c_lookAt.x, c_lookAt.y, c_lookAt.z);
-        glUniform3f(lookUpLocation, c_lookUp.x, c_lookUp.y, c_lookUp.z);
-        glUniform1f(FOVLocation, static_cast<GLfloat>(c_FOVDegrees));
-        glUniform1f(defocusAngleLocation, static_cast<GLfloat>(c_defocusAngle));
-        glUniform1f(focalDistLocation, static_cast<GLfloat>(c_focusDist));
-        glUniform1ui(samplesPerPixelLocation, c_samplesPerPixel);
-        glUniform1ui(numBouncesLocation, c_numBounces);
-        glUniform1ui(frameCounterLocation, frameCounter);
-        glUniform1ui(numOfSpheresLocation, numOfSpheres);
-        glUniform1ui(numOfQuadsLocation, numOfQuads);
-        glUniform1i(skyLocation, static_cast<int>(c_sky));
+            glBindImageTexture(1, accumulationTex, 0, GL_FALSE, 0, GL_WRITE_ONLY, accumulationFormats[accumulationFormat].internalFormat);
+        }
 
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, sphereBuffer);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, quadBuffer);
-        glDispatchCompute((int)(SCREEN_WIDTH / 8), (int)(SCREEN_HEIGHT / 4), 1);
-        glMemoryBarrier(GL_ALL_BARRIER_BITS);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, bvhNodeBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, primitiveRefBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, instanceBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, tlasNodeBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, wideNodeBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, rayCounterBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, gridBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, sphereGeometryBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, quadPlaneBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, materialBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, emitterBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, emitterAliasBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, lightNodeBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 19, samplerTableBuffer);
+        glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, 0, workCounterBuffer);
+        glBindTextureUnit(1, adaptiveWorkTex);
+        glBindTextureUnit(2, accumulationTex);
+
+        // Accumulation passes before this frame is shown, as many as fit into the render budget at the last measured
+        // time per pass. Benchmarks time single passes.
+        unsigned int framePasses = c_renderBudget && benchmarkStep < 0 ? budgetPasses : 1;
+        unsigned int passesRun = 0;
+        if (benchmarkStep >= 0) {
+            RayCounters zero = {};
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, rayCounterBuffer);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(RayCounters), &zero);
+        }
+        glBeginQuery(GL_TIME_ELAPSED, timerQuery);
+        for (unsigned int pass = 0; pass < framePasses; ++pass) {
+            glUseProgram(computeProgram);
+            // The work list is kept once every pixel has enough frames for its variance, for adaptive frames to run over
+            // and for the noise stop to count. Benchmarks always trace the full screen.
+            bool trackConvergence = (c_adaptiveSampling || c_stopMode == STOP_NOISE) && benchmarkStep < 0 && frameCounter >= ADAPTIVE_MIN_FRAMES;
+            bool adaptiveFrame = trackConvergence && c_adaptiveSampling;
+            bool useWavefront = c_wavefront && c_renderMode == RENDER_PATH_TRACE;
+            set_path_uniforms(computeUniforms, benchmarkStep >= 0, adaptiveFrame);
+            glUniform1i(computeUniforms.persistentThreads, static_cast<int>(c_persistentThreads));
+            if (useWavefront) {
+                for (const PathUniforms& uniforms : wavefrontUniforms) {
+                    set_path_uniforms(uniforms, benchmarkStep >= 0, adaptiveFrame);
+                }
+            }
+
+            // A count still in flight from before a reset belongs to an image that is gone
+            if (!trackConvergence && activeCountFence) {
+                glDeleteSync(activeCountFence);
+                activeCountFence = nullptr;
+            }
+            if (activeCountFence && glClientWaitSync(activeCountFence, 0, 0) != GL_TIMEOUT_EXPIRED) {
+                activeFraction = (float)*mappedActiveCount / activeCountPixels;
+                glDeleteSync(activeCountFence);
+                activeCountFence = nullptr;
+            }
+
+            if (!trackConvergence) {
+                workListValid = false;
+                activeFraction = 1.0f;
+            } else if (!workListValid || frameCounter >= workListFrame + ADAPTIVE_INTERVAL) {
+                unsigned int pixelCount = SCREEN_WIDTH * SCREEN_HEIGHT;
+                if (pixelCount > adaptiveCapacity) {
+                    glBindBuffer(GL_SHADER_STORAGE_BUFFER, adaptiveWorkBuffer);
+                    glBufferData(GL_SHADER_STORAGE_BUFFER, (4 + pixelCount) * sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
+                    glTextureBuffer(adaptiveWorkTex, GL_R32UI, adaptiveWorkBuffer);
+                    adaptiveCapacity = pixelCount;
+                }
+                // An empty list dispatches no groups along x but keeps y and z at one
+                const GLuint emptyList[4] = {0, 1, 1, 0};
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, adaptiveWorkBuffer);
+                glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(emptyList), emptyList);
+                glUseProgram(adaptiveMaskProgram);
+                glUniform1f(glGetUniformLocation(adaptiveMaskProgram, "c_adaptiveThreshold"), c_adaptiveThreshold);
+                glUniform1f(glGetUniformLocation(adaptiveMaskProgram, "c_exposure"), c_exposure);
+                glUniform1ui(glGetUniformLocation(adaptiveMaskProgram, "c_tonemap"), static_cast<GLuint>(c_tonemap));
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 20, adaptiveWorkBuffer);
+                glDispatchCompute((int)(SCREEN_WIDTH / 8), (int)(SCREEN_HEIGHT / 4), 1);
+                glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+                // A count not read by now is replaced by this list's
+                if (activeCountFence) {
+                    glDeleteSync(activeCountFence);
+                }
+                glCopyNamedBufferSubData(adaptiveWorkBuffer, activeCountBuffer, 3 * sizeof(GLuint), 0, sizeof(GLuint));
+                activeCountFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                activeCountPixels = pixelCount;
+                workListValid = true;
+                workListFrame = frameCounter;
+                glUseProgram(computeProgram);
+            }
 
-        frameCounter++;
+            renderStopped = benchmarkStep < 0 &&
+                            ((c_stopMode == STOP_FRAMES && frameCounter >= (GLuint)c_stopFrames) ||
+                             (c_stopMode == STOP_SAMPLES && frameCounter * c_samplesPerPixel >= (GLuint)c_stopSamples) ||
+                             (c_stopMode == STOP_NOISE && workListValid && activeFraction <= STOP_ACTIVE_FRACTION));
+            // Once stopped the accumulation is only displayed again
+            if (renderStopped) {
+                break;
+            }
+            if (useWavefront) {
+                trace_wavefront(wavefrontTracer, SCREEN_WIDTH, SCREEN_HEIGHT, c_samplesPerPixel, c_numBounces, adaptiveFrame, adaptiveWorkBuffer);
+            } else if (c_persistentThreads) {
+                const GLuint firstWorkItem = 0;
+                glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, workCounterBuffer);
+                glBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(firstWorkItem), &firstWorkItem);
+                // Groups past one per 32 pixels would find the counter already exhausted
+                GLuint pixelGroups = (SCREEN_WIDTH * SCREEN_HEIGHT + MEGAKERNEL_GROUP_SIZE - 1) / MEGAKERNEL_GROUP_SIZE;
+                glDispatchCompute(std::min((GLuint)c_persistentGroups, pixelGroups), 1, 1);
+            } else if (adaptiveFrame) {
+                glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, adaptiveWorkBuffer);
+                glDispatchComputeIndirect(0);
+            } else {
+                glDispatchCompute((int)(SCREEN_WIDTH / 8), (int)(SCREEN_HEIGHT / 4), 1);
+            }
+            glMemoryBarrier(GL_ALL_BARRIER_BITS);
+
+            frameCounter++;
+            passesRun++;
+        }
+        glEndQuery(GL_TIME_ELAPSED);
+        // A frame without passes has nothing to time
+        if (passesRun > 0) {
+            timerQueryPending = true;
+            timerQueryStructure = blasStructure;
+            timedPasses = passesRun;
+        }
 
         glUseProgram(screenShaderProgram);
-        glBindTextureUnit(0, screenTex);
-        glUniform1i(glGetUniformLocation(screenShaderProgram, "screen"), 0);
+        glBindTextureUnit(0, accumulationTex);
+        glUniform1i(glGetUniformLocation(screenShaderProgram, "accumulation"), 0);
+        glUniform1f(glGetUniformLocation(screenShaderProgram, "c_exposure"), c_exposure);
+        glUniform1ui(glGetUniformLocation(screenShaderProgram, "c_tonemap"), static_cast<GLuint>(c_tonemap));
+        glUniform1i(glGetUniformLocation(screenShaderProgram, "c_accumulateMean"), static_cast<int>(accumulationFormats[accumulationFormat].mean));
         glBindVertexArray(VAO);
         glDrawElements(GL_TRIANGLES, sizeof(indices) / sizeof(indices[0]), GL_UNSIGNED_INT, 0);
 
@@ -437,7 +1302,7 @@ int main() {
         glfwSwapBuffers(window);
     }
 
-    cleanup(window, VAO, VBO, EBO, screenTex, accumulationTex, screenShaderProgram, computeProgram);
+    cleanup(window, VAO, VBO, EBO, accumulationTex, screenShaderProgram, computeProgram);
     return 0;
 }
 
@@ -448,24 +1313,19 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
     SCREEN_HEIGHT = height;
     frameCounter = 0;
 
-    // Recreate screen and accumulation textures with new dimensions
-    glDeleteTextures(1, &screenTex);
-    glCreateTextures(GL_TEXTURE_2D, 1, &screenTex);
-    glTextureParameteri(screenTex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTextureParameteri(screenTex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTextureParameteri(screenTex, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTextureParameteri(screenTex, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTextureStorage2D(screenTex, 1, GL_RGBA32F, width, height);
-    glBindImageTexture(0, screenTex, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
-
+    // Recreate accumulation textures with new dimensions
     glDeleteTextures(1, &accumulationTex);
-    glCreateTextures(GL_TEXTURE_2D, 1, &accumulationTex);
-    glTextureParameteri(accumulationTex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTextureParameteri(accumulationTex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTextureParameteri(accumulationTex, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTextureParameteri(accumulationTex, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTextureStorage2D(accumulationTex, 1, GL_RGBA32F, width, height);
-    glBindImageTexture(1, accumulationTex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+    setup_accumulation_texture(accumulationTex);
+
+    // The first frame after the reset ignores the variance texture, so it is left uninitialized like the others
+    glDeleteTextures(1, &varianceTex);
+    glCreateTextures(GL_TEXTURE_2D, 1, &varianceTex);
+    glTextureParameteri(varianceTex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTextureParameteri(varianceTex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTextureParameteri(varianceTex, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(varianceTex, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTextureStorage2D(varianceTex, 1, GL_RGBA32F, width, height);
+    glBindImageTexture(2, varianceTex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
 }
 
 void setup_imgui(GLFWwindow* window) {
@@ -479,6 +1339,412 @@ void setup_imgui(GLFWwindow* window) {
     ImGui_ImplOpenGL3_Init("#version 430");
 }
 
+// Workgroups that fill the GPU once: every SM holding as many megakernel groups as it has resident warps for.
+// That is the occupancy bound before register pressure, which OpenGL cannot report for a compiled program.
+int device_persistent_groups() {
+    GLint extensionCount = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+    for (GLint i = 0; i < extensionCount; ++i) {
+        if (std::string((const char*)glGetStringi(GL_EXTENSIONS, i)) != "GL_NV_shader_thread_group") {
+            continue;
+        }
+        GLint warpSize = 0, warpsPerSM = 0, smCount = 0;
+        glGetIntegerv(GL_WARP_SIZE_NV, &warpSize);
+        glGetIntegerv(GL_WARPS_PER_SM_NV, &warpsPerSM);
+        glGetIntegerv(GL_SM_COUNT_NV, &smCount);
+        if (warpSize > 0 && warpsPerSM > 0 && smCount > 0) {
+            int warpsPerGroup = (MEGAKERNEL_GROUP_SIZE + warpSize - 1) / warpSize;
+            return std::max(1, warpsPerSM / warpsPerGroup) * smCount;
+        }
+    }
+    return PERSISTENT_GROUPS_FALLBACK;
+}
+
+// Picks the material a primitive refers to, returns true when the choice changed
+bool material_combo(const std::string& label, unsigned int& materialId, size_t materialCount) {
+    bool changed = false;
+    if (ImGui::BeginCombo(label.c_str(), ("Material " + std::to_string(materialId)).c_str())) {
+        for (unsigned int m = 0; m < materialCount; ++m) {
+            if (ImGui::Selectable(("Material " + std::to_string(m)).c_str(), m == materialId) && m != materialId) {
+                materialId = m;
+                changed = true;
+            }
+        }
+        ImGui::EndCombo();
+    }
+    return changed;
+}
+
+std::string benchmark_label(const StructureBenchmark& result) {
+    std::string label = blasStructures[result.structure].name;
+    if (result.renderMode == RENDER_AMBIENT_OCCLUSION) {
+        label += result.anyHitOcclusion ? " AO any-hit" : " AO closest-hit";
+    }
+    if (!result.soaGeometry) {
+        label += " AoS geometry";
+    }
+    if (result.wavefront && result.renderMode == RENDER_PATH_TRACE) {
+        label += " wavefront";
+    }
+    if (result.accumulationFormat != 0) {
+        label += std::string(" ") + accumulationFormats[result.accumulationFormat].name;
+    }
+    return label;
+}
+
+PathUniforms path_uniform_locations(GLuint program) {
+    PathUniforms uniforms;
+    uniforms.program = program;
+    uniforms.resolution = glGetUniformLocation(program, "iResolution");
+    uniforms.lookFrom = glGetUniformLocation(program, "c_lookFrom");
+    uniforms.lookAt = glGetUniformLocation(program, "c_lookAt");
+    uniforms.lookUp = glGetUniformLocation(program, "c_lookUp");
+    uniforms.FOVDegrees = glGetUniformLocation(program, "c_FOVDegrees");
+    uniforms.defocusAngle = glGetUniformLocation(program, "c_defocusAngle");
+    uniforms.focusDist = glGetUniformLocation(program, "c_focusDist");
+    uniforms.samplesPerPixel = glGetUniformLocation(program, "c_samplesPerPixel");
+    uniforms.numBounces = glGetUniformLocation(program, "c_numBounces");
+    uniforms.frameCounter = glGetUniformLocation(program, "frameCounter");
+    uniforms.numOfInstances = glGetUniformLocation(program, "numOfInstances");
+    uniforms.accelMode = glGetUniformLocation(program, "c_accelMode");
+    uniforms.bvhWidth = glGetUniformLocation(program, "c_bvhWidth");
+    uniforms.countRays = glGetUniformLocation(program, "c_countRays");
+    uniforms.sky = glGetUniformLocation(program, "c_sky");
+    uniforms.renderMode = glGetUniformLocation(program, "c_renderMode");
+    uniforms.aoDistance = glGetUniformLocation(program, "c_aoDistance");
+    uniforms.anyHitOcclusion = glGetUniformLocation(program, "c_anyHitOcclusion");
+    uniforms.soaGeometry = glGetUniformLocation(program, "c_soaGeometry");
+    uniforms.nextEventEstimation = glGetUniformLocation(program, "c_nextEventEstimation");
+    uniforms.lightBVH = glGetUniformLocation(program, "c_lightBVH");
+    uniforms.numOfEmitters = glGetUniformLocation(program, "numOfEmitters");
+    uniforms.emitterPower = glGetUniformLocation(program, "emitterPower");
+    uniforms.sampler = glGetUniformLocation(program, "c_sampler");
+    uniforms.adaptiveSampling = glGetUniformLocation(program, "c_adaptiveSampling");
+    uniforms.accumulateMean = glGetUniformLocation(program, "c_accumulateMean");
+    uniforms.persistentThreads = glGetUniformLocation(program, "c_persistentThreads");
+    return uniforms;
+}
+
+// Sets the render settings shared by compute.glsl and the wavefront kernels, uniforms a program does not use are skipped
+void set_path_uniforms(const PathUniforms& uniforms, bool countRays, bool adaptiveFrame) {
+    GLuint program = uniforms.program;
+    glProgramUniform2i(program, uniforms.resolution, SCREEN_WIDTH, SCREEN_HEIGHT);
+    glProgramUniform3f(program, uniforms.lookFrom, c_lookFrom.x, c_lookFrom.y, c_lookFrom.z);
+    glProgramUniform3f(program, uniforms.lookAt, c_lookAt.x, c_lookAt.y, c_lookAt.z);
+    glProgramUniform3f(program, uniforms.lookUp, c_lookUp.x, c_lookUp.y, c_lookUp.z);
+    glProgramUniform1f(program, uniforms.FOVDegrees, static_cast<GLfloat>(c_FOVDegrees));
+    glProgramUniform1f(program, uniforms.defocusAngle, static_cast<GLfloat>(c_defocusAngle));
+    glProgramUniform1f(program, uniforms.focusDist, static_cast<GLfloat>(c_focusDist));
+    glProgramUniform1ui(program, uniforms.samplesPerPixel, c_samplesPerPixel);
+    glProgramUniform1ui(program, uniforms.numBounces, c_numBounces);
+    glProgramUniform1ui(program, uniforms.frameCounter, frameCounter);
+    glProgramUniform1ui(program, uniforms.numOfInstances, numOfInstances);
+    glProgramUniform1ui(program, uniforms.accelMode, blasStructures[blasStructure].accelMode);
+    glProgramUniform1ui(program, uniforms.bvhWidth, blasStructures[blasStructure].bvhWidth);
+    glProgramUniform1i(program, uniforms.countRays, static_cast<int>(countRays));
+    glProgramUniform1i(program, uniforms.sky, static_cast<int>(c_sky));
+    glProgramUniform1ui(program, uniforms.renderMode, static_cast<GLuint>(c_renderMode));
+    glProgramUniform1f(program, uniforms.aoDistance, c_aoDistance);
+    glProgramUniform1i(program, uniforms.anyHitOcclusion, static_cast<int>(c_anyHitOcclusion));
+    glProgramUniform1i(program, uniforms.soaGeometry, static_cast<int>(c_soaGeometry));
+    glProgramUniform1i(program, uniforms.nextEventEstimation, static_cast<int>(c_nextEventEstimation));
+    glProgramUniform1i(program, uniforms.lightBVH, static_cast<int>(c_lightBVH));
+    glProgramUniform1ui(program, uniforms.numOfEmitters, numOfEmitters);
+    glProgramUniform1f(program, uniforms.emitterPower, emitterPower);
+    glProgramUniform1ui(program, uniforms.sampler, static_cast<GLuint>(c_sampler));
+    glProgramUniform1i(program, uniforms.adaptiveSampling, static_cast<int>(adaptiveFrame));
+    glProgramUniform1i(program, uniforms.accumulateMean, static_cast<int>(accumulationFormats[accumulationFormat].mean));
+}
+
+glm::mat4 instance_transform(const Instance& instance) {
+    glm::mat4 transform = glm::translate(glm::mat4(1.0f), instance.position);
+    transform = glm::rotate(transform, glm::radians(instance.rotation.z), glm::vec3(0, 0, 1));
+    transform = glm::rotate(transform, glm::radians(instance.rotation.y), glm::vec3(0, 1, 0));
+    transform = glm::rotate(transform, glm::radians(instance.rotation.x), glm::vec3(1, 0, 0));
+    return glm::scale(transform, instance.scale);
+}
+
+// Instances of empty geometries have no BLAS root to traverse and singular transforms no inverse to enter it with,
+// neither is uploaded
+bool instance_traceable(const Instance& instance, const std::vector<Geometry>& geometries) {
+    const Geometry& geometry = geometries[instance.geometry];
+    if (geometry.spheres.empty() && geometry.quads.empty()) {
+        return false;
+    }
+    return glm::determinant(glm::mat3(instance_transform(instance))) != 0.0f;
+}
+
+void upload_geometries(const std::vector<Geometry>& geometries, const std::vector<BVH>& geometryBVHs, std::vector<WideBVH>& geometryWideBVHs,
+                       std::vector<Grid>& geometryGrids, std::vector<GeometryOffsets>& geometryOffsets, std::vector<AABB>& geometryBounds,
+                       LBVHBuilder& lbvhBuilder, GLuint sphereBuffer, GLuint quadBuffer, GLuint sphereGeometryBuffer, GLuint quadPlaneBuffer,
+                       GLuint bvhNodeBuffer, GLuint primitiveRefBuffer, GLuint wideNodeBuffer, GLuint gridBuffer) {
+    // Wide trees are collapsed first, one too deep for the shader's traversal stack or with leaves their child
+    // references cannot hold sends every BLAS back to the binary BVH
+    for (unsigned int g = 0; g < geometries.size(); ++g) {
+        geometryWideBVHs[g] = WideBVH();
+    }
+    if (blasStructures[blasStructure].bvhWidth != 2) {
+        for (unsigned int g = 0; g < geometries.size(); ++g) {
+            if (!collapse_bvh(geometryBVHs[g], blasStructures[blasStructure].bvhWidth, geometryWideBVHs[g])) {
+                std::cerr << "Geometry " << g << " does not fit a " << blasStructures[blasStructure].name << " (" << wide_stack_size(geometryWideBVHs[g])
+                          << " of " << WIDE_STACK_SIZE << " stack entries or leaves past the reference limits), using the binary BVH" << std::endl;
+                geometryWideBVHs.assign(geometries.size(), WideBVH());
+                blasStructure = 0;
+                break;
+            }
+        }
+    }
+    const BlasStructure& structure = blasStructures[blasStructure];
+    // Every geometry is stored once; BLAS indices stay local and instances carry the offsets
+    std::vector<Sphere> spheres;
+    std::vector<Quad> quads;
+    std::vector<glm::vec4> sphereGeometry;
+    std::vector<QuadPlane> quadPlanes;
+    std::vector<BVHNode> nodes;
+    std::vector<GLuint> primitiveRefs;
+    std::vector<GLuint> wideNodes;
+    std::vector<GLuint> gridData;
+    geometryOffsets.clear();
+    geometryBounds.assign(geometries.size(), AABB());
+    for (unsigned int g = 0; g < geometries.size(); ++g) {
+        // Instances find their BLAS root in whichever buffer the current structure traverses,
+        // counted in nodes for BVHs and in uints for grids
+        GLuint nodeOffset = (GLuint)nodes.size();
+        geometryGrids[g] = Grid();
+        if (structure.accelMode == ACCEL_GRID) {
+            build_grid(geometryGrids[g], geometries[g].spheres, geometries[g].quads, structure.twoLevelGrid);
+            nodeOffset = (GLuint)gridData.size();
+            gridData.insert(gridData.end(), geometryGrids[g].data.begin(), geometryGrids[g].data.end());
+            geometryBounds[g] = geometryGrids[g].bounds;
+        } else if (!structure.gpuBuild) {
+            if (structure.bvhWidth != 2) {
+                nodeOffset = (GLuint)(wideNodes.size() / wide_node_stride(structure.bvhWidth));
+                wideNodes.insert(wideNodes.end(), geometryWideBVHs[g].data.begin(), geometryWideBVHs[g].data.end());
+            }
+            geometryBounds[g].min = geometryBVHs[g].nodes[0].aabbMin;
+            geometryBounds[g].max = geometryBVHs[g].nodes[0].aabbMax;
+        }
+        geometryOffsets.push_back({(GLuint)spheres.size(), (GLuint)quads.size(), nodeOffset, (GLuint)primitiveRefs.size()});
+        spheres.insert(spheres.end(), geometries[g].spheres.begin(), geometries[g].spheres.end());
+        quads.insert(quads.end(), geometries[g].quads.begin(), geometries[g].quads.end());
+        if (structure.gpuBuild) {
+            // Room for the tree built on the GPU once the primitives are uploaded
+            GLuint primCount = (GLuint)(geometries[g].spheres.size() + geometries[g].quads.size());
+            nodes.resize(nodes.size() + lbvh_node_count(primCount));
+            primitiveRefs.resize(primitiveRefs.size() + primCount);
+        } else {
+            nodes.insert(nodes.end(), geometryBVHs[g].nodes.begin(), geometryBVHs[g].nodes.end());
+            primitiveRefs.insert(primitiveRefs.end(), geometryBVHs[g].primitiveRefs.begin(), geometryBVHs[g].primitiveRefs.end());
+        }
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sphereBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, spheres.size() * sizeof(Sphere), spheres.data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, sphereBuffer); // Bind to binding point 0
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, quadBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, quads.size() * sizeof(Quad), quads.data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, quadBuffer); // Bind to binding point 1
+    sphereGeometry.reserve(spheres.size());
+    for (const Sphere& sphere : spheres) {
+        sphereGeometry.push_back(sphere_geometry(sphere));
+    }
+    quadPlanes.reserve(quads.size());
+    for (const Quad& quad : quads) {
+        quadPlanes.push_back(quad_plane(quad));
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sphereGeometryBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sphereGeometry.size() * sizeof(glm::vec4), sphereGeometry.data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, sphereGeometryBuffer); // Bind to binding point 13
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, quadPlaneBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, quadPlanes.size() * sizeof(QuadPlane), quadPlanes.data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, quadPlaneBuffer); // Bind to binding point 14
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, bvhNodeBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, nodes.size() * sizeof(BVHNode), nodes.data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, bvhNodeBuffer); // Bind to binding point 2
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, primitiveRefBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, primitiveRefs.size() * sizeof(GLuint), primitiveRefs.data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, primitiveRefBuffer); // Bind to binding point 3
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, wideNodeBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, wideNodes.size() * sizeof(GLuint), wideNodes.data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, wideNodeBuffer); // Bind to binding point 6
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gridBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gridData.size() * sizeof(GLuint), gridData.data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, gridBuffer); // Bind to binding point 8
+
+    if (structure.gpuBuild) {
+        for (unsigned int g = 0; g < geometries.size(); ++g) {
+            geometryBounds[g] = build_lbvh(lbvhBuilder, geometryOffsets[g], (GLuint)geometries[g].spheres.size(), (GLuint)geometries[g].quads.size(),
+                                           sphereGeometryBuffer, quadPlaneBuffer, bvhNodeBuffer, primitiveRefBuffer);
+        }
+    }
+}
+
+size_t blas_node_bytes(const std::vector<Geometry>& geometries, const std::vector<BVH>& geometryBVHs, const std::vector<WideBVH>& geometryWideBVHs, const std::vector<Grid>& geometryGrids) {
+    const BlasStructure& structure = blasStructures[blasStructure];
+    size_t bytes = 0;
+    for (unsigned int g = 0; g < geometryBVHs.size(); ++g) {
+        if (structure.gpuBuild) {
+            bytes += lbvh_node_count((unsigned int)(geometries[g].spheres.size() + geometries[g].quads.size())) * sizeof(BVHNode);
+        } else if (structure.accelMode == ACCEL_GRID) {
+            bytes += geometryGrids[g].data.size() * sizeof(GLuint);
+        } else if (structure.bvhWidth == 2) {
+            bytes += geometryBVHs[g].nodes.size() * sizeof(BVHNode);
+        } else {
+            bytes += geometryWideBVHs[g].data.size() * sizeof(GLuint);
+        }
+    }
+    return bytes;
+}
+
+GLuint upload_instances(const std::vector<Instance>& instances, const std::vector<Geometry>& geometries, const std::vector<AABB>& geometryBounds,
+                        const std::vector<GeometryOffsets>& geometryOffsets, BVH& tlas, GLuint instanceBuffer, GLuint tlasNodeBuffer) {
+    std::vector<InstanceData> instanceData;
+    std::vector<AABB> instanceBounds;
+    for (const Instance& instance : instances) {
+        if (!instance_traceable(instance, geometries)) {
+            continue;
+        }
+
+        glm::mat4 objectToWorld = instance_transform(instance);
+        glm::mat4 worldToObject = glm::inverse(objectToWorld);
+        InstanceData data;
+        for (int row = 0; row < 3; ++row) {
+            data.worldToObject[row] = glm::vec4(worldToObject[0][row], worldToObject[1][row], worldToObject[2][row], worldToObject[3][row]);
+        }
+        data.offsets = geometryOffsets[instance.geometry];
+        instanceData.push_back(data);
+
+        instanceBounds.push_back(geometryBounds[instance.geometry].transformed(objectToWorld));
+    }
+    build_bvh(tlas, instanceBounds);
+
+    // Instances are stored in TLAS leaf order so leaves index them directly
+    std::vector<InstanceData> orderedInstances;
+    orderedInstances.reserve(instanceData.size());
+    for (GLuint ref : tlas.primitiveRefs) {
+        orderedInstances.push_back(instanceData[ref]);
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, instanceBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, orderedInstances.size() * sizeof(InstanceData), orderedInstances.data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, instanceBuffer); // Bind to binding point 4
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, tlasNodeBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, tlas.nodes.size() * sizeof(BVHNode), tlas.nodes.data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, tlasNodeBuffer); // Bind to binding point 5
+    return (GLuint)orderedInstances.size();
+}
+
+// Walker alias table over the weights by Vose's method: slots under the mean weight are topped up by one slot over it,
+// so every slot holds at most two emitters and a pick costs one lookup however many emitters there are
+std::vector<EmitterAlias> build_alias_table(const std::vector<float>& weights, float total) {
+    std::vector<EmitterAlias> table(weights.size());
+    std::vector<float> scaled(weights.size());
+    std::vector<unsigned int> small, large;
+    for (unsigned int i = 0; i < weights.size(); ++i) {
+        scaled[i] = weights[i] * weights.size() / total;
+        (scaled[i] < 1.0f ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        unsigned int s = small.back();
+        unsigned int l = large.back();
+        small.pop_back();
+        table[s] = {scaled[s], l};
+        scaled[l] -= 1.0f - scaled[s];
+        if (scaled[l] < 1.0f) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Whatever is left is one up to rounding
+    for (unsigned int i : small) {
+        table[i] = {1.0f, i};
+    }
+    for (unsigned int i : large) {
+        table[i] = {1.0f, i};
+    }
+    return table;
+}
+
+GLuint upload_emitters(const std::vector<Instance>& instances, const std::vector<Geometry>& geometries, const std::vector<Material>& materials,
+                       const BVH& tlas, GLuint emitterBuffer, GLuint emitterAliasBuffer, GLuint lightNodeBuffer, float& power) {
+    auto emissive = [&](unsigned int materialId) {
+        const Material& material = materials[materialId];
+        return material.emissionStrength > 0.0f && material.emission != glm::vec3(0.0f);
+    };
+
+    // Same instance skipping as upload_instances, so TLAS references map back to the instance they were built from
+    std::vector<unsigned int> uploadedInstances;
+    for (unsigned int i = 0; i < instances.size(); ++i) {
+        if (instance_traceable(instances[i], geometries)) {
+            uploadedInstances.push_back(i);
+        }
+    }
+
+    // Emitters are weighted by emission strength times world space area, spheres taking the area at the mean scale
+    // of their instance as the shader does. Emitters without area could never be picked and are left out.
+    std::vector<Emitter> emitters;
+    std::vector<float> weights;
+    std::vector<LightBounds> lightBounds;
+    power = 0.0f;
+    auto add_emitter = [&](GLuint leaf, GLuint primitiveRef, LightBounds light) {
+        if (light.power > 0.0f) {
+            emitters.push_back({leaf, primitiveRef});
+            weights.push_back(light.power);
+            lightBounds.push_back(light);
+            power += light.power;
+        }
+    };
+    for (GLuint leaf = 0; leaf < tlas.primitiveRefs.size(); ++leaf) {
+        const Instance& instance = instances[uploadedInstances[tlas.primitiveRefs[leaf]]];
+        const Geometry& geometry = geometries[instance.geometry];
+        glm::mat4 objectToWorld = instance_transform(instance);
+        glm::mat3 linear = glm::mat3(objectToWorld);
+        glm::mat3 normalToWorld = glm::transpose(glm::inverse(linear));
+        float sphereAreaScale = std::pow(std::abs(glm::determinant(linear)), 2.0f / 3.0f);
+        for (GLuint s = 0; s < geometry.spheres.size(); ++s) {
+            const Sphere& sphere = geometry.spheres[s];
+            if (emissive(sphere.materialId)) {
+                // Spheres emit in every direction
+                LightBounds light;
+                light.bounds = sphere_bounds(sphere).transformed(objectToWorld);
+                light.cosThetaO = -1.0f;
+                light.cosThetaE = 0.0f;
+                float area = 4.0f * glm::pi<float>() * sphere.radius * sphere.radius * sphereAreaScale;
+                light.power = materials[sphere.materialId].emissionStrength * area;
+                add_emitter(leaf, s, light);
+            }
+        }
+        for (GLuint q = 0; q < geometry.quads.size(); ++q) {
+            const Quad& quad = geometry.quads[q];
+            if (emissive(quad.materialId)) {
+                // Quads are only sampled from their front, over the hemisphere around the normal
+                LightBounds light;
+                light.bounds = quad_bounds(quad).transformed(objectToWorld);
+                light.axis = glm::normalize(normalToWorld * quad.normal);
+                light.cosThetaO = 1.0f;
+                light.cosThetaE = 0.0f;
+                float area = glm::length(glm::cross(linear * (quad.b - quad.a), linear * (quad.d - quad.a)));
+                light.power = materials[quad.materialId].emissionStrength * area;
+                add_emitter(leaf, q | QUAD_REF_BIT, light);
+            }
+        }
+    }
+    std::vector<EmitterAlias> aliases = build_alias_table(weights, power);
+    std::vector<LightBVHNode> lightNodes;
+    build_light_bvh(lightNodes, lightBounds);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, emitterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, emitters.size() * sizeof(Emitter), emitters.data(), GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, emitterBuffer); // Bind to binding point 16
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, emitterAliasBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, aliases.size() * sizeof(EmitterAlias), aliases.data(), GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, emitterAliasBuffer); // Bind to binding point 17
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightNodeBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, lightNodes.size() * sizeof(LightBVHNode), lightNodes.data(), GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, lightNodeBuffer); // Bind to binding point 18
+    return (GLuint)emitters.size();
+}
+
 void setup_vertex_data(GLuint& VAO, GLuint& VBO, GLuint& EBO) {
     glCreateVertexArrays(1, &VAO);
     glCreateBuffers(1, &VBO);
@@ -499,29 +1765,45 @@ void setup_vertex_data(GLuint& VAO, GLuint& VBO, GLuint& EBO) {
     glVertexArrayElementBuffer(VAO, EBO);
 }
 
-void setup_textures(GLuint& screenTex, GLuint& accumulationTex) {
-    glCreateTextures(GL_TEXTURE_2D, 1, &screenTex);
-    glTextureParameteri(screenTex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTextureParameteri(screenTex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTextureParameteri(screenTex, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTextureParameteri(screenTex, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTextureStorage2D(screenTex, 1, GL_RGBA32F, SCREEN_WIDTH, SCREEN_HEIGHT);
-    glBindImageTexture(0, screenTex, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
-
+// Allocates the accumulation image in the selected format, the shaders only write it as an image and read it
+// through a texture
+void setup_accumulation_texture(GLuint& accumulationTex) {
+    GLenum internalFormat = accumulationFormats[accumulationFormat].internalFormat;
     glCreateTextures(GL_TEXTURE_2D, 1, &accumulationTex);
     glTextureParameteri(accumulationTex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTextureParameteri(accumulationTex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTextureParameteri(accumulationTex, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTextureParameteri(accumulationTex, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTextureStorage2D(accumulationTex, 1, GL_RGBA32F, SCREEN_WIDTH, SCREEN_HEIGHT);
-    glBindImageTexture(1, accumulationTex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+    glTextureStorage2D(accumulationTex, 1, internalFormat, SCREEN_WIDTH, SCREEN_HEIGHT);
+    glBindImageTexture(1, accumulationTex, 0, GL_FALSE, 0, GL_WRITE_ONLY, internalFormat);
+}
+
+void setup_textures(GLuint& accumulationTex, GLuint& varianceTex) {
+    setup_accumulation_texture(accumulationTex);
+
+    glCreateTextures(GL_TEXTURE_2D, 1, &varianceTex);
+    glTextureParameteri(varianceTex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTextureParameteri(varianceTex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTextureParameteri(varianceTex, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(varianceTex, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTextureStorage2D(varianceTex, 1, GL_RGBA32F, SCREEN_WIDTH, SCREEN_HEIGHT);
+    glBindImageTexture(2, varianceTex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
 
 }
 
 std::string load_shader_code(const std::string& filepath) {
     std::ifstream shaderFile(filepath);
     std::stringstream shaderStream;
-    shaderStream << shaderFile.rdbuf();
+    std::string directory = filepath.substr(0, filepath.find_last_of('/') + 1);
+    std::string line;
+    while (std::getline(shaderFile, line)) {
+        if (line.rfind("#include \"", 0) == 0) {
+            std::string included = line.substr(10, line.find('"', 10) - 10);
+            shaderStream << load_shader_code(directory + included) << '\n';
+        } else {
+            shaderStream << line << '\n';
+        }
+    }
     shaderFile.close();
     return shaderStream.str();
 }
@@ -562,12 +1844,32 @@ GLuint link_program(GLuint vertexShader, GLuint fragmentShader) {
     return program;
 }
 
-void cleanup(GLFWwindow* window, GLuint VAO, GLuint VBO, GLuint EBO, GLuint screenTex, GLuint accumulationTex, GLuint quadProgram, GLuint computeProgram) {
+GLuint create_compute_program(const std::string& filepath) {
+    std::string code = load_shader_code(filepath);
+    GLuint shader = compile_shader(code.c_str(), GL_COMPUTE_SHADER);
+    GLuint program = glCreateProgram();
+    glAttachShader(program, shader);
+    glLinkProgram(program);
+    glDeleteShader(shader);
+
+    GLint success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        GLint logLength;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLength);
+        std::vector<char> log(logLength);
+        glGetProgramInfoLog(program, logLength, &logLength, log.data());
+        std::cerr << "Error linking " << filepath << ": " << log.data() << std::endl;
+    }
+    return program;
+}
+
+void cleanup(GLFWwindow* window, GLuint VAO, GLuint VBO, GLuint EBO, GLuint accumulationTex, GLuint quadProgram, GLuint computeProgram) {
     glDeleteVertexArrays(1, &VAO);
     glDeleteBuffers(1, &VBO);
     glDeleteBuffers(1, &EBO);
-    glDeleteTextures(1, &screenTex);
     glDeleteTextures(1, &accumulationTex);
+    glDeleteTextures(1, &varianceTex);
     glDeleteProgram(quadProgram);
     glDeleteProgram(computeProgram);
 
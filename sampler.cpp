@@ -0,0 +1,170 @@
+#include "sampler.h"
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+const unsigned int BLUE_NOISE_PIXELS = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+const float BLUE_NOISE_SIGMA = 1.5f;
+// Share of the pixels set in the initial binary pattern, the first ranks are removed from it
+const unsigned int BLUE_NOISE_INITIAL_DIVISOR = 10;
+const unsigned int BLUE_NOISE_SEED = 7;
+
+// Primitive polynomial degree, coefficients and initial direction numbers of Sobol dimensions 1 to 3
+// (Joe and Kuo 2008), dimension 0 is the van der Corput sequence
+struct SobolPolynomial {
+    unsigned int degree;
+    unsigned int coefficients;
+    unsigned int initial[3];
+};
+
+const SobolPolynomial sobolPolynomials[SOBOL_DIMENSIONS - 1] = {
+    {1, 0, {1, 0, 0}},
+    {2, 1, {1, 3, 0}},
+    {3, 1, {1, 3, 1}},
+};
+
+static void build_sobol_matrices(unsigned int* matrices) {
+    for (unsigned int k = 0; k < SOBOL_BITS; ++k) {
+        matrices[k] = 1u << (SOBOL_BITS - 1 - k);
+    }
+    for (unsigned int d = 1; d < SOBOL_DIMENSIONS; ++d) {
+        const SobolPolynomial& p = sobolPolynomials[d - 1];
+        unsigned int* v = matrices + d * SOBOL_BITS;
+        for (unsigned int k = 0; k < SOBOL_BITS; ++k) {
+            if (k < p.degree) {
+                v[k] = p.initial[k] << (SOBOL_BITS - 1 - k);
+                continue;
+            }
+            v[k] = v[k - p.degree] ^ (v[k - p.degree] >> p.degree);
+            for (unsigned int j = 1; j < p.degree; ++j) {
+                if ((p.coefficients >> (p.degree - 1 - j)) & 1u) {
+                    v[k] ^= v[k - j];
+                }
+            }
+        }
+    }
+}
+
+// Square roots of distinct primes are linearly independent over the rationals, so no dimension of the Kronecker
+// lattice repeats another one shifted
+static void build_rank1_generators(unsigned int* generators) {
+    unsigned int count = 0;
+    for (unsigned int n = 2; count < RANK1_DIMENSIONS; ++n) {
+        bool prime = true;
+        for (unsigned int d = 2; d * d <= n; ++d) {
+            if (n % d == 0) {
+                prime = false;
+                break;
+            }
+        }
+        if (prime) {
+            double root = std::sqrt((double)n);
+            generators[count++] = (unsigned int)((root - std::floor(root)) * 4294967296.0);
+        }
+    }
+}
+
+// Adds or removes the Gaussian energy a set pixel spreads over the tile, wrapping around its edges
+static void splat_energy(std::vector<float>& energy, const std::vector<float>& kernel, unsigned int pixel, float sign) {
+    unsigned int px = pixel % BLUE_NOISE_SIZE;
+    unsigned int py = pixel / BLUE_NOISE_SIZE;
+    for (unsigned int y = 0; y < BLUE_NOISE_SIZE; ++y) {
+        const float* row = kernel.data() + ((y - py) & (BLUE_NOISE_SIZE - 1)) * BLUE_NOISE_SIZE;
+        for (unsigned int x = 0; x < BLUE_NOISE_SIZE; ++x) {
+            energy[y * BLUE_NOISE_SIZE + x] += sign * row[(x - px) & (BLUE_NOISE_SIZE - 1)];
+        }
+    }
+}
+
+// Set pixel with the most energy around it
+static unsigned int tightest_cluster(const std::vector<bool>& pattern, const std::vector<float>& energy) {
+    unsigned int best = 0;
+    float bestEnergy = -1e30f;
+    for (unsigned int i = 0; i < BLUE_NOISE_PIXELS; ++i) {
+        if (pattern[i] && energy[i] > bestEnergy) {
+            bestEnergy = energy[i];
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Empty pixel with the least energy around it
+static unsigned int largest_void(const std::vector<bool>& pattern, const std::vector<float>& energy) {
+    unsigned int best = 0;
+    float bestEnergy = 1e30f;
+    for (unsigned int i = 0; i < BLUE_NOISE_PIXELS; ++i) {
+        if (!pattern[i] && energy[i] < bestEnergy) {
+            bestEnergy = energy[i];
+            best = i;
+        }
+    }
+    return best;
+}
+
+static void build_blue_noise(unsigned int* values) {
+    std::vector<float> kernel(BLUE_NOISE_PIXELS);
+    for (unsigned int y = 0; y < BLUE_NOISE_SIZE; ++y) {
+        for (unsigned int x = 0; x < BLUE_NOISE_SIZE; ++x) {
+            float dx = (float)std::min(x, BLUE_NOISE_SIZE - x);
+            float dy = (float)std::min(y, BLUE_NOISE_SIZE - y);
+            kernel[y * BLUE_NOISE_SIZE + x] = std::exp(-(dx * dx + dy * dy) / (2.0f * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+        }
+    }
+
+    // Random initial pattern, relaxed by moving its tightest cluster into its largest void until that is the same pixel
+    std::vector<bool> pattern(BLUE_NOISE_PIXELS, false);
+    std::vector<float> energy(BLUE_NOISE_PIXELS, 0.0f);
+    std::mt19937 rng(BLUE_NOISE_SEED);
+    std::uniform_int_distribution<unsigned int> pixelDistribution(0, BLUE_NOISE_PIXELS - 1);
+    unsigned int initialCount = 0;
+    while (initialCount < BLUE_NOISE_PIXELS / BLUE_NOISE_INITIAL_DIVISOR) {
+        unsigned int pixel = pixelDistribution(rng);
+        if (!pattern[pixel]) {
+            pattern[pixel] = true;
+            splat_energy(energy, kernel, pixel, 1.0f);
+            ++initialCount;
+        }
+    }
+    while (true) {
+        unsigned int cluster = tightest_cluster(pattern, energy);
+        pattern[cluster] = false;
+        splat_energy(energy, kernel, cluster, -1.0f);
+        unsigned int gap = largest_void(pattern, energy);
+        pattern[gap] = true;
+        splat_energy(energy, kernel, gap, 1.0f);
+        if (gap == cluster) {
+            break;
+        }
+    }
+
+    std::vector<unsigned int> ranks(BLUE_NOISE_PIXELS);
+    // The initial pattern's pixels get the lowest ranks, its tightest cluster removed first getting the highest of them
+    std::vector<bool> removed = pattern;
+    std::vector<float> removedEnergy = energy;
+    for (unsigned int rank = initialCount; rank-- > 0;) {
+        unsigned int cluster = tightest_cluster(removed, removedEnergy);
+        removed[cluster] = false;
+        splat_energy(removedEnergy, kernel, cluster, -1.0f);
+        ranks[cluster] = rank;
+    }
+    // The rest fill the largest void in turn. Past half full that is the tightest cluster of the empty pixels,
+    // the energies of set and empty pixels summing to the same constant everywhere, so one loop covers both phases.
+    for (unsigned int rank = initialCount; rank < BLUE_NOISE_PIXELS; ++rank) {
+        unsigned int gap = largest_void(pattern, energy);
+        pattern[gap] = true;
+        splat_energy(energy, kernel, gap, 1.0f);
+        ranks[gap] = rank;
+    }
+
+    for (unsigned int i = 0; i < BLUE_NOISE_PIXELS; ++i) {
+        values[i] = (unsigned int)((ranks[i] + 0.5) / BLUE_NOISE_PIXELS * 4294967296.0);
+    }
+}
+
+void build_sampler_tables(SamplerTables& tables) {
+    build_sobol_matrices(tables.sobolMatrices);
+    build_rank1_generators(tables.rank1Generators);
+    build_blue_noise(tables.blueNoise);
+}
@@ -0,0 +1,28 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+// The low discrepancy samplers of compute.glsl pad their dimensions with 4D Sobol points, so only the generator
+// matrices of the first four Sobol dimensions are needed
+const unsigned int SOBOL_DIMENSIONS = 4;
+const unsigned int SOBOL_BITS = 32;
+// Side of the tiled blue noise texture the rank-1 lattice is rotated by
+const unsigned int BLUE_NOISE_SIZE = 64;
+// Dimensions with their own rank-1 generator, enough for the camera and 30 bounces of compute.glsl
+const unsigned int RANK1_DIMENSIONS = 256;
+
+// Tables of the sampler modes as laid out in the std430 SamplerTables buffer
+struct SamplerTables {
+    // Column k of dimension d at d * SOBOL_BITS + k, most significant bit first
+    unsigned int sobolMatrices[SOBOL_DIMENSIONS * SOBOL_BITS];
+    // Ranks of the blue noise pixels as 32 bit fixed point values in [0, 1), at the pixel centres of the rank range
+    unsigned int blueNoise[BLUE_NOISE_SIZE * BLUE_NOISE_SIZE];
+    // Generator of the rank-1 lattice in every dimension as 32 bit fixed point values in [0, 1)
+    unsigned int rank1Generators[RANK1_DIMENSIONS];
+};
+
+// Fills the Sobol matrices from Joe and Kuo's direction numbers, the rank-1 generators with the fractional parts of
+// the square roots of the primes and builds the blue noise tile with Ulichney's void-and-cluster method.
+// The tile comes from a fixed seed, so every run gets the same one.
+void build_sampler_tables(SamplerTables& tables);
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <string>
+#include <vector>
+#include "glm/glm.hpp"
+
+// Surface shared by every primitive whose materialId points at it, as laid out in the std430 Materials buffer
+struct Material {
+    glm::vec3 albedo;
+    float reflectivity;
+    glm::vec3 emission;
+    float emissionStrength;
+    float fuzz;
+    float refractionIndex;
+    float padding[2];
+};
+
+// Quad struct definition. Quads are parallelograms spanned by the edges a to b and a to d,
+// c, normal and w are derived from the other corners by derive_quad_plane.
+struct Quad {
+    glm::vec3 a;
+    unsigned int materialId;
+    glm::vec3 b;
+    float padding;
+    glm::vec3 c;
+    float padding1;
+    glm::vec3 d;
+    float padding2;
+    // Derived fields, initialized so the scene can list quads by their corners alone
+    glm::vec3 normal = glm::vec3(0.0f);
+    float padding3 = 0.0f;
+    glm::vec3 w = glm::vec3(0.0f); // cross(b - a, d - a) / |cross(b - a, d - a)|^2, projects plane points onto the edges
+    float padding4 = 0.0f;
+};
+
+// Completes c as the fourth corner of the parallelogram and precomputes the plane the shader tests against.
+// The winding of a, b, d gives the front face, a degenerate quad gets a zero normal and is never hit.
+inline void derive_quad_plane(Quad& quad) {
+    glm::vec3 u = quad.b - quad.a;
+    glm::vec3 v = quad.d - quad.a;
+    glm::vec3 n = glm::cross(u, v);
+    float lengthSquared = glm::dot(n, n);
+    quad.c = quad.b + v;
+    quad.normal = lengthSquared > 0.0f ? glm::normalize(n) : glm::vec3(0.0f);
+    quad.w = lengthSquared > 0.0f ? n / lengthSquared : glm::vec3(0.0f);
+}
+
+// Sphere struct definition
+struct Sphere {
+    glm::vec3 center;
+    float radius;
+    unsigned int materialId;
+    float padding[3];
+};
+
+// Geometry only copies traversal reads instead of the full records, laid out as the std430
+// SphereGeometry and QuadPlanes buffers. Quad planes hold the origin a and the edges u = b - a
+// and v = d - a, with w split over the fourth components.
+struct QuadPlane {
+    glm::vec4 a;
+    glm::vec4 u;
+    glm::vec4 v;
+};
+
+inline glm::vec4 sphere_geometry(const Sphere& sphere) {
+    return glm::vec4(sphere.center, sphere.radius);
+}
+
+inline QuadPlane quad_plane(const Quad& quad) {
+    return {glm::vec4(quad.a, quad.w.x), glm::vec4(quad.b - quad.a, quad.w.y), glm::vec4(quad.d - quad.a, quad.w.z)};
+}
+
+// Unique geometry in object space, built into its own BLAS and shared by every instance referencing it
+struct Geometry {
+    std::string name;
+    std::vector<Sphere> spheres;
+    std::vector<Quad> quads;
+};
+
+// Placement of a geometry in the scene as edited in the UI
+struct Instance {
+    unsigned int geometry;
+    glm::vec3 position;
+    glm::vec3 rotation; // Euler angles in degrees
+    glm::vec3 scale;
+};
+
+// Where a geometry's primitives and BLAS start inside the shared buffers
+struct GeometryOffsets {
+    unsigned int sphereOffset;
+    unsigned int quadOffset;
+    unsigned int nodeOffset;
+    unsigned int refOffset;
+};
+
+// Instance as laid out in the std430 Instances buffer
+struct InstanceData {
+    glm::vec4 worldToObject[3]; // rows of the 3x4 world to object transform
+    GeometryOffsets offsets;
+};
+
+// Emissive primitive of one instance as laid out in the std430 Emitters buffer, the instance indexed in TLAS leaf order
+struct Emitter {
+    unsigned int instance;
+    unsigned int primitiveRef;
+};
+
+// Slot of the Walker alias table in the std430 EmitterAliases buffer. A uniform pick of the slot keeps its own
+// emitter, of the same index in the Emitters buffer, with probability threshold and takes alias otherwise.
+struct EmitterAlias {
+    float threshold;
+    unsigned int alias;
+};
+
+#endif
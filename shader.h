@@ -0,0 +1,14 @@
+#ifndef SHADER_H
+#define SHADER_H
+
+#include <string>
+#include "glad/glad.h"
+
+// Reads a shader source, replacing every #include "file" line with that file relative to the including one
+std::string load_shader_code(const std::string& filepath);
+GLuint compile_shader(const char* source, GLenum shaderType);
+GLuint link_program(GLuint vertexShader, GLuint fragmentShader);
+// Loads, compiles and links a compute shader into its own program
+GLuint create_compute_program(const std::string& filepath);
+
+#endif
@@ -0,0 +1,237 @@
+#include <algorithm>
+#include <cstdio>
+#include "../bvh.h"
+
+static int failures = 0;
+
+#define CHECK(condition)                                                      \
+    do {                                                                      \
+        if (!(condition)) {                                                   \
+            std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            ++failures;                                                       \
+        }                                                                     \
+    } while (0)
+
+// An empty build keeps one root without primitives and with inverted bounds
+static void check_empty_root(const BVH& bvh) {
+    CHECK(bvh.nodes.size() == 1);
+    CHECK(bvh.nodes[0].primCount == 0);
+    CHECK(bvh.nodes[0].aabbMin.x > bvh.nodes[0].aabbMax.x);
+    CHECK(bvh.parents.size() == 1 && bvh.parents[0] == BVH_NO_PARENT);
+    CHECK(bvh_sah_cost(bvh) == 0.0f);
+}
+
+static void check_empty_wide(const BVH& bvh, unsigned int width) {
+    WideBVH wide;
+    CHECK(collapse_bvh(bvh, width, wide));
+    CHECK(wide.sources.size() == 1);
+    CHECK(wide.data.size() == wide_node_stride(width));
+    CHECK(wide.data[3] == 0);
+    CHECK(wide.holders.size() == 1 && wide.holders[0] == BVH_NO_PARENT);
+}
+
+static void test_empty_blas() {
+    BVH bvh;
+    build_bvh(bvh, std::vector<Sphere>(), std::vector<Quad>());
+    check_empty_root(bvh);
+    check_empty_wide(bvh, 4);
+    check_empty_wide(bvh, 8);
+
+    // Rebuilding a geometry whose last primitive was deleted
+    std::vector<Sphere> spheres = {{glm::vec3(0.0f), 1.0f, 0, {0, 0, 0}}, {glm::vec3(3.0f), 1.0f, 0, {0, 0, 0}}};
+    build_bvh(bvh, spheres, std::vector<Quad>());
+    CHECK(bvh.nodes.size() == 3);
+    build_bvh(bvh, std::vector<Sphere>(), std::vector<Quad>());
+    check_empty_root(bvh);
+}
+
+static void test_empty_tlas() {
+    BVH tlas;
+    build_bvh(tlas, std::vector<AABB>());
+    check_empty_root(tlas);
+
+    // Deleting every instance rebuilds the TLAS over no boxes, and a later instance brings it back
+    build_bvh(tlas, std::vector<AABB>(1, sphere_bounds({glm::vec3(0.0f), 1.0f, 0, {0, 0, 0}})));
+    CHECK(tlas.nodes.size() == 1 && tlas.nodes[0].primCount == 1);
+    build_bvh(tlas, std::vector<AABB>());
+    check_empty_root(tlas);
+}
+
+static void test_refit_after_empty() {
+    // Moving a sphere refits its leaf and the root, the empty build before must not leave stale links
+    BVH bvh;
+    build_bvh(bvh, std::vector<Sphere>(), std::vector<Quad>());
+    std::vector<Sphere> spheres = {{glm::vec3(0.0f), 1.0f, 0, {0, 0, 0}}, {glm::vec3(3.0f), 1.0f, 0, {0, 0, 0}}};
+    build_bvh(bvh, spheres, std::vector<Quad>());
+    spheres[1].center = glm::vec3(5.0f);
+    unsigned int firstChanged = ~0u;
+    unsigned int lastChanged = 0;
+    refit_bvh(bvh, spheres, std::vector<Quad>(), 1, firstChanged, lastChanged);
+    CHECK(firstChanged == 0);
+    CHECK(bvh.nodes[0].aabbMax.x == 6.0f);
+}
+
+static void test_median_fallback() {
+    // Heavily overlapping spheres make every SAH split cost more than a leaf, so the oversized
+    // leaf is split at the median centroid instead; the spheres are listed far from sorted
+    std::vector<Sphere> spheres;
+    for (int i = 0; i < 200; ++i) {
+        spheres.push_back({glm::vec3((float)((i * 37) % 200), 0.0f, 0.0f), 100000.0f, 0, {0, 0, 0}});
+    }
+    BVH bvh;
+    build_bvh(bvh, spheres, std::vector<Quad>());
+    CHECK(bvh.nodes[0].primCount == 0);
+
+    // The halves keep their reference ranges while they are split further
+    float lowerMax = -1e30f;
+    float upperMin = 1e30f;
+    for (unsigned int i = 0; i < 200; ++i) {
+        float x = spheres[bvh.primitiveRefs[i]].center.x;
+        if (i < 100) {
+            lowerMax = glm::max(lowerMax, x);
+        } else {
+            upperMin = glm::min(upperMin, x);
+        }
+    }
+    CHECK(lowerMax < upperMin);
+
+    // Every leaf still bounds the spheres it references
+    for (const BVHNode& node : bvh.nodes) {
+        for (unsigned int i = 0; i < node.primCount; ++i) {
+            AABB b = sphere_bounds(spheres[bvh.primitiveRefs[node.leftFirst + i]]);
+            CHECK(glm::min(node.aabbMin, b.min) == node.aabbMin && glm::max(node.aabbMax, b.max) == node.aabbMax);
+        }
+    }
+}
+
+static void test_incremental_wide_refit(unsigned int width) {
+    std::vector<Sphere> spheres;
+    std::vector<Quad> quads;
+    for (unsigned int i = 0; i < 500; ++i) {
+        glm::vec3 center((float)((i * 37) % 101), (float)((i * 53) % 89), (float)((i * 71) % 97));
+        spheres.push_back({center * 0.1f, 0.05f + 0.001f * (float)(i % 7), 0, {0, 0, 0}});
+    }
+    BVH bvh;
+    build_bvh(bvh, spheres, quads);
+    WideBVH wide;
+    CHECK(collapse_bvh(bvh, width, wide));
+
+    // Move a few spheres and refit only along their leaves
+    std::vector<unsigned int> edited = {3, 250, 499};
+    unsigned int firstChanged = ~0u;
+    unsigned int lastChanged = 0;
+    for (unsigned int ref : edited) {
+        spheres[ref].center += glm::vec3(0.7f, -0.3f, 0.2f);
+        refit_bvh(bvh, spheres, quads, ref, firstChanged, lastChanged);
+    }
+    WideBVH full = wide;
+    unsigned int firstWide = ~0u;
+    unsigned int lastWide = 0;
+    for (unsigned int ref : edited) {
+        refit_wide_bvh(bvh, wide, ref, firstChanged, firstWide, lastWide);
+    }
+    CHECK(firstWide <= lastWide);
+
+    // Requantizing along every leaf from the root down touches every wide node
+    unsigned int firstFull = ~0u;
+    unsigned int lastFull = 0;
+    for (unsigned int ref = 0; ref < spheres.size(); ++ref) {
+        refit_wide_bvh(bvh, full, ref, 0, firstFull, lastFull);
+    }
+    CHECK(full.data == wide.data);
+    CHECK(firstWide >= firstFull && lastWide <= lastFull);
+}
+
+// Deepest stack a traversal reaches when every child is hit, pushing all of them like traceWideBLAS does
+static unsigned int max_wide_stack(const WideBVH& wide) {
+    unsigned int stride = wide_node_stride(wide.width);
+    std::vector<unsigned int> stack;
+    unsigned int deepest = 0;
+    unsigned int ref = 0;
+    while (true) {
+        if (!(ref & WIDE_LEAF_BIT)) {
+            const unsigned int* node = &wide.data[ref * stride];
+            for (unsigned int c = 0; c < node[3]; ++c) {
+                stack.push_back(node[WIDE_NODE_HEADER + c]);
+            }
+            deepest = std::max(deepest, (unsigned int)stack.size());
+        }
+        if (stack.empty()) {
+            return deepest;
+        }
+        ref = stack.back();
+        stack.pop_back();
+    }
+}
+
+// A chain of inner nodes, each holding one leaf and the next inner node
+static BVH chain_bvh(unsigned int levels) {
+    BVH bvh;
+    bvh.nodes.push_back({glm::vec3(0.0f), 0, glm::vec3((float)levels + 1.0f), 0});
+    for (unsigned int i = 0; i < levels; ++i) {
+        float x = (float)i;
+        bvh.nodes[bvh.nodes.size() - 1].leftFirst = (unsigned int)bvh.nodes.size();
+        bvh.nodes.push_back({glm::vec3(x), i, glm::vec3(x + 1.0f), 1});
+        bvh.nodes.push_back({glm::vec3(x + 1.0f), 0, glm::vec3((float)levels + 1.0f), 0});
+    }
+    bvh.nodes.back().leftFirst = levels;
+    bvh.nodes.back().primCount = 1;
+    return bvh;
+}
+
+static void test_wide_stack_size(unsigned int width) {
+    // The stack size collapse_bvh reports bounds what traversal pushes
+    std::vector<Sphere> spheres;
+    for (unsigned int i = 0; i < 2000; ++i) {
+        spheres.push_back({glm::vec3((float)(i % 13), (float)(i % 17), (float)(i % 19)) * 0.5f, 0.1f, 0, {0, 0, 0}});
+    }
+    BVH bvh;
+    build_bvh(bvh, spheres, std::vector<Quad>());
+    WideBVH wide;
+    CHECK(collapse_bvh(bvh, width, wide));
+    CHECK(max_wide_stack(wide) <= wide_stack_size(wide));
+
+    BVH shallow = chain_bvh(40);
+    CHECK(collapse_bvh(shallow, width, wide));
+    CHECK(max_wide_stack(wide) <= wide_stack_size(wide));
+
+    // A tree too deep for the shader's stack is rejected instead of losing children during traversal
+    BVH deep = chain_bvh(400);
+    CHECK(!collapse_bvh(deep, width, wide));
+    CHECK(wide_stack_size(wide) > WIDE_STACK_SIZE);
+}
+
+static void test_wide_leaf_limits(unsigned int width) {
+    // Leaves whose first ref or count do not fit a child reference are rejected instead of truncated
+    WideBVH wide;
+    BVH bvh = chain_bvh(4);
+    bvh.nodes.back().leftFirst = WIDE_LEAF_MAX_FIRST;
+    CHECK(collapse_bvh(bvh, width, wide));
+    bvh.nodes.back().leftFirst = WIDE_LEAF_MAX_FIRST + 1;
+    CHECK(!collapse_bvh(bvh, width, wide));
+
+    bvh = chain_bvh(4);
+    bvh.nodes.back().primCount = WIDE_LEAF_MAX_COUNT;
+    CHECK(collapse_bvh(bvh, width, wide));
+    bvh.nodes.back().primCount = WIDE_LEAF_MAX_COUNT + 1;
+    CHECK(!collapse_bvh(bvh, width, wide));
+}
+
+int main() {
+    test_empty_blas();
+    test_empty_tlas();
+    test_refit_after_empty();
+    test_median_fallback();
+    test_incremental_wide_refit(4);
+    test_incremental_wide_refit(8);
+    test_wide_stack_size(4);
+    test_wide_stack_size(8);
+    test_wide_leaf_limits(4);
+    test_wide_leaf_limits(8);
+    if (failures > 0) {
+        std::printf("%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("All checks passed\n");
+    return 0;
+}
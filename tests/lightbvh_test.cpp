@@ -0,0 +1,240 @@
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include "../lightbvh.h"
+
+static int failures = 0;
+
+#define CHECK(condition)                                                      \
+    do {                                                                      \
+        if (!(condition)) {                                                   \
+            std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            ++failures;                                                       \
+        }                                                                     \
+    } while (0)
+
+// Host copies of lightNodeImportance, sampleLightBVH and lightBVHPmf in assets/shaders/path_lights.glsl,
+// keep them in step with the shader
+const float RAY_POS_NORMAL_NUDGE = 0.001f;
+const float ONE_MINUS_EPSILON = 0.99999994f;
+
+static float cos_sub_clamped(float sinA, float cosA, float sinB, float cosB) {
+    return cosA > cosB ? 1.0f : cosA * cosB + sinA * sinB;
+}
+
+static float sin_sub_clamped(float sinA, float cosA, float sinB, float cosB) {
+    return cosA > cosB ? 0.0f : sinA * cosB - cosA * sinB;
+}
+
+static float light_node_importance(const LightBVHNode& node, const glm::vec3& origin, const glm::vec3& normal) {
+    glm::vec3 center = (node.aabbMin + node.aabbMax) * 0.5f;
+    glm::vec3 toOrigin = origin - center;
+    float distanceSquared = glm::dot(toOrigin, toOrigin);
+    float radiusSquared = glm::dot(node.aabbMax - center, node.aabbMax - center);
+    float clampedDistanceSquared = std::max(distanceSquared, radiusSquared);
+    if (distanceSquared <= radiusSquared) {
+        return node.power / clampedDistanceSquared;
+    }
+    glm::vec3 direction = toOrigin / std::sqrt(distanceSquared);
+    float cosThetaB = std::sqrt(1.0f - radiusSquared / distanceSquared);
+    float sinThetaB = std::sqrt(radiusSquared / distanceSquared);
+
+    float cosThetaW = glm::dot(node.axis, direction);
+    float sinThetaW = std::sqrt(std::max(0.0f, 1.0f - cosThetaW * cosThetaW));
+    float sinThetaO = std::sqrt(std::max(0.0f, 1.0f - node.cosThetaO * node.cosThetaO));
+    float cosThetaX = cos_sub_clamped(sinThetaW, cosThetaW, sinThetaO, node.cosThetaO);
+    float sinThetaX = sin_sub_clamped(sinThetaW, cosThetaW, sinThetaO, node.cosThetaO);
+    float cosThetaP = cos_sub_clamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+    if (cosThetaP <= node.cosThetaE) {
+        return 0.0f;
+    }
+
+    float cosThetaI = glm::dot(normal, -direction);
+    float sinThetaI = std::sqrt(std::max(0.0f, 1.0f - cosThetaI * cosThetaI));
+    float cosThetaIP = cos_sub_clamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+    if (cosThetaIP <= 0.0f) {
+        return 0.0f;
+    }
+    return node.power * cosThetaP * cosThetaIP / clampedDistanceSquared;
+}
+
+static bool light_node_holds(const LightBVHNode& node, const glm::vec3& p) {
+    glm::vec3 lo = node.aabbMin - glm::vec3(RAY_POS_NORMAL_NUDGE);
+    glm::vec3 hi = node.aabbMax + glm::vec3(RAY_POS_NORMAL_NUDGE);
+    return p.x >= lo.x && p.y >= lo.y && p.z >= lo.z && p.x <= hi.x && p.y <= hi.y && p.z <= hi.z;
+}
+
+static float sample_light_bvh(const std::vector<LightBVHNode>& nodes, const glm::vec3& origin, const glm::vec3& normal,
+                              float u, unsigned int& emitterIndex) {
+    LightBVHNode node = nodes[0];
+    if (light_node_importance(node, origin, normal) <= 0.0f) {
+        return 0.0f;
+    }
+    float pmf = 1.0f;
+    while (node.emitterCount == 0) {
+        const LightBVHNode& left = nodes[node.leftFirst];
+        const LightBVHNode& right = nodes[node.leftFirst + 1];
+        float leftImportance = light_node_importance(left, origin, normal);
+        float rightImportance = light_node_importance(right, origin, normal);
+        float total = leftImportance + rightImportance;
+        if (total <= 0.0f) {
+            return 0.0f;
+        }
+        float leftProbability = leftImportance / total;
+        if (u < leftProbability) {
+            node = left;
+            pmf *= leftProbability;
+            u = std::min(u / leftProbability, ONE_MINUS_EPSILON);
+        } else {
+            node = right;
+            pmf *= rightImportance / total;
+            u = std::min((u - leftProbability) / (1.0f - leftProbability), ONE_MINUS_EPSILON);
+        }
+    }
+    emitterIndex = node.leftFirst;
+    return pmf;
+}
+
+static float light_bvh_pmf(const std::vector<LightBVHNode>& nodes, const glm::vec3& origin, const glm::vec3& normal,
+                           const glm::vec3& point, unsigned int emitterIndex) {
+    if (light_node_importance(nodes[0], origin, normal) <= 0.0f) {
+        return 0.0f;
+    }
+    std::vector<std::pair<unsigned int, float>> stack = {{0, 1.0f}};
+    while (!stack.empty()) {
+        unsigned int nodeIndex = stack.back().first;
+        float pmf = stack.back().second;
+        stack.pop_back();
+        const LightBVHNode& node = nodes[nodeIndex];
+        if (node.emitterCount > 0) {
+            if (node.leftFirst == emitterIndex) {
+                return pmf;
+            }
+            continue;
+        }
+        const LightBVHNode& left = nodes[node.leftFirst];
+        const LightBVHNode& right = nodes[node.leftFirst + 1];
+        float leftImportance = light_node_importance(left, origin, normal);
+        float rightImportance = light_node_importance(right, origin, normal);
+        float total = leftImportance + rightImportance;
+        if (rightImportance > 0.0f && light_node_holds(right, point)) {
+            stack.push_back({node.leftFirst + 1, pmf * rightImportance / total});
+        }
+        if (leftImportance > 0.0f && light_node_holds(left, point)) {
+            stack.push_back({node.leftFirst, pmf * leftImportance / total});
+        }
+    }
+    return 0.0f;
+}
+
+static LightBounds quad_light(const glm::vec3& corner, const glm::vec3& u, const glm::vec3& v, float strength) {
+    LightBounds light;
+    light.bounds.grow(corner);
+    light.bounds.grow(corner + u);
+    light.bounds.grow(corner + v);
+    light.bounds.grow(corner + u + v);
+    glm::vec3 n = glm::cross(u, v);
+    light.axis = glm::normalize(n);
+    light.cosThetaO = 1.0f;
+    light.cosThetaE = 0.0f;
+    light.power = strength * glm::length(n);
+    return light;
+}
+
+static LightBounds sphere_light(const glm::vec3& center, float radius, float strength) {
+    LightBounds light;
+    light.bounds.grow(center - glm::vec3(radius));
+    light.bounds.grow(center + glm::vec3(radius));
+    light.cosThetaO = -1.0f;
+    light.cosThetaE = 0.0f;
+    light.power = strength * 4.0f * 3.14159265f * radius * radius;
+    return light;
+}
+
+static std::vector<LightBounds> test_lights() {
+    return {
+        quad_light(glm::vec3(-1.0f, 4.0f, -1.0f), glm::vec3(0.0f, 0.0f, 2.0f), glm::vec3(2.0f, 0.0f, 0.0f), 10.0f),
+        quad_light(glm::vec3(5.0f, 0.0f, -0.5f), glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), 4.0f),
+        quad_light(glm::vec3(-6.0f, 1.0f, 2.0f), glm::vec3(0.0f, 0.0f, 3.0f), glm::vec3(0.0f, 3.0f, 0.0f), 1.0f),
+        sphere_light(glm::vec3(0.0f, 1.0f, 6.0f), 0.5f, 20.0f),
+        sphere_light(glm::vec3(2.0f, 0.2f, 2.0f), 0.05f, 200.0f),
+        sphere_light(glm::vec3(-20.0f, 10.0f, -20.0f), 3.0f, 5.0f),
+    };
+}
+
+// Shading points inside and outside the emitters' bounding spheres, facing several ways
+struct ShadingPoint {
+    glm::vec3 origin;
+    glm::vec3 normal;
+};
+
+static const ShadingPoint SHADING_POINTS[] = {
+    {glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f)},
+    {glm::vec3(2.0f, 0.0f, 2.0f), glm::vec3(0.0f, 1.0f, 0.0f)},
+    {glm::vec3(-3.0f, 2.0f, 1.0f), glm::vec3(1.0f, 0.0f, 0.0f)},
+    {glm::vec3(4.0f, 0.5f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f)},
+};
+
+// Inside a node's bounding sphere the distance is clamped to its radius, the same for every origin there
+static void test_importance_clamp() {
+    LightBVHNode node = {};
+    node.aabbMin = glm::vec3(-2.0f, -1.0f, -4.0f);
+    node.aabbMax = glm::vec3(2.0f, 1.0f, 4.0f);
+    node.power = 6.0f;
+    node.axis = glm::vec3(0.0f, 0.0f, 1.0f);
+    node.cosThetaO = -1.0f;
+    node.cosThetaE = 0.0f;
+    float radiusSquared = 0.25f * (16.0f + 4.0f + 64.0f);
+    glm::vec3 normal(0.0f, 1.0f, 0.0f);
+    CHECK(light_node_importance(node, glm::vec3(0.0f), normal) == node.power / radiusSquared);
+    CHECK(light_node_importance(node, glm::vec3(1.5f, 0.5f, 3.0f), normal) == node.power / radiusSquared);
+}
+
+// Sampling picks every emitter as often as lightBVHPmf says, and the pmf over all emitters sums to one
+static void test_sampling_matches_pmf() {
+    std::vector<LightBounds> lights = test_lights();
+    std::vector<LightBVHNode> nodes;
+    build_light_bvh(nodes, lights);
+    CHECK(nodes.size() == 2 * lights.size() - 1);
+
+    const int samples = 200000;
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    for (const ShadingPoint& shading : SHADING_POINTS) {
+        std::vector<float> pmfs(lights.size());
+        float sum = 0.0f;
+        for (unsigned int i = 0; i < lights.size(); ++i) {
+            glm::vec3 point = (lights[i].bounds.min + lights[i].bounds.max) * 0.5f;
+            pmfs[i] = light_bvh_pmf(nodes, shading.origin, shading.normal, point, i);
+            sum += pmfs[i];
+        }
+        CHECK(std::abs(sum - 1.0f) < 1e-4f);
+
+        std::vector<int> counts(lights.size(), 0);
+        for (int s = 0; s < samples; ++s) {
+            unsigned int emitter = ~0u;
+            float pmf = sample_light_bvh(nodes, shading.origin, shading.normal, std::min(uniform(rng), ONE_MINUS_EPSILON), emitter);
+            CHECK(pmf > 0.0f && emitter < lights.size());
+            if (emitter < lights.size()) {
+                CHECK(std::abs(pmf - pmfs[emitter]) <= 1e-5f * pmfs[emitter]);
+                ++counts[emitter];
+            }
+        }
+        for (unsigned int i = 0; i < lights.size(); ++i) {
+            float frequency = (float)counts[i] / samples;
+            float sigma = std::sqrt(pmfs[i] * (1.0f - pmfs[i]) / samples);
+            CHECK(std::abs(frequency - pmfs[i]) <= 5.0f * sigma + 1e-4f);
+        }
+    }
+}
+
+int main() {
+    test_importance_clamp();
+    test_sampling_matches_pmf();
+    if (failures > 0) {
+        std::printf("%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include "wavefront.h"
+#include "shader.h"
+
+// Must match wavefront_common.glsl: the queues, the size of a PathState and the bindings of both buffers
+const GLuint SURFACE_QUEUE = 2;
+const GLuint DIELECTRIC_QUEUE = 3;
+const GLuint SHADOW_QUEUE = 4;
+const GLuint QUEUE_COUNT = 5;
+const size_t PATH_STATE_BYTES = 128;
+const GLuint QUEUE_BINDING = 21;
+const GLuint PATH_BINDING = 22;
+// Indirect dispatch arguments and length of an empty queue
+const GLuint EMPTY_QUEUE[4] = {0, 1, 1, 0};
+const GLuint QUEUE_HEADER_BYTES = sizeof(EMPTY_QUEUE);
+// Barrier between the kernels, which read the paths, the queues and the dispatch arguments the last one wrote
+const GLbitfield WAVEFRONT_BARRIER_BITS = GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT;
+
+static void reset_queues(GLuint queueBuffer, GLuint first, GLuint count) {
+    GLuint headers[QUEUE_COUNT * 4];
+    for (GLuint i = 0; i < count * 4; ++i) {
+        headers[i] = EMPTY_QUEUE[i % 4];
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, queueBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, first * QUEUE_HEADER_BYTES, count * QUEUE_HEADER_BYTES, headers);
+}
+
+// Runs a queue kernel over the paths in queue, the dispatch arguments are read from the queue's header
+static void dispatch_queue(GLuint program, GLuint queue) {
+    glUseProgram(program);
+    glUniform1ui(glGetUniformLocation(program, "c_inputQueue"), queue);
+    glDispatchComputeIndirect(queue * QUEUE_HEADER_BYTES);
+    glMemoryBarrier(WAVEFRONT_BARRIER_BITS);
+}
+
+// Runs a kernel once per pixel like compute.glsl, over the whole screen or the adaptive work list
+static void dispatch_pixels(GLuint program, unsigned int width, unsigned int height, bool adaptive, GLuint adaptiveWorkBuffer, GLuint queueBuffer) {
+    glUseProgram(program);
+    if (adaptive) {
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, adaptiveWorkBuffer);
+        glDispatchComputeIndirect(0);
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, queueBuffer);
+    } else {
+        glDispatchCompute(width / 8, height / 4, 1);
+    }
+    glMemoryBarrier(WAVEFRONT_BARRIER_BITS);
+}
+
+void setup_wavefront_tracer(WavefrontTracer& tracer) {
+    tracer.generateProgram = create_compute_program("assets/shaders/wavefront_generate.glsl");
+    tracer.extendProgram = create_compute_program("assets/shaders/wavefront_extend.glsl");
+    tracer.shadeProgram = create_compute_program("assets/shaders/wavefront_shade.glsl");
+    tracer.connectProgram = create_compute_program("assets/shaders/wavefront_connect.glsl");
+    tracer.accumulateProgram = create_compute_program("assets/shaders/wavefront_accumulate.glsl");
+    glGenBuffers(1, &tracer.queueBuffer);
+    glGenBuffers(1, &tracer.pathBuffer);
+}
+
+void trace_wavefront(WavefrontTracer& tracer, unsigned int width, unsigned int height, unsigned int samplesPerPixel,
+                     unsigned int numBounces, bool adaptive, GLuint adaptiveWorkBuffer) {
+    // Buffers are only allocated once the wavefront tracer runs, and grow with the window
+    if (width * height > tracer.capacity) {
+        tracer.capacity = width * height;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, tracer.pathBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, tracer.capacity * PATH_STATE_BYTES, nullptr, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, tracer.queueBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, QUEUE_COUNT * (QUEUE_HEADER_BYTES + tracer.capacity * sizeof(GLuint)), nullptr, GL_DYNAMIC_COPY);
+    }
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, QUEUE_BINDING, tracer.queueBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PATH_BINDING, tracer.pathBuffer);
+    for (GLuint program : {tracer.generateProgram, tracer.extendProgram, tracer.shadeProgram, tracer.connectProgram, tracer.accumulateProgram}) {
+        glProgramUniform1ui(program, glGetUniformLocation(program, "c_pathCapacity"), tracer.capacity);
+    }
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, tracer.queueBuffer);
+
+    for (GLuint sample = 0; sample < samplesPerPixel; ++sample) {
+        reset_queues(tracer.queueBuffer, 0, QUEUE_COUNT);
+        glProgramUniform1ui(tracer.generateProgram, glGetUniformLocation(tracer.generateProgram, "c_wavefrontSample"), sample);
+        glProgramUniform1ui(tracer.generateProgram, glGetUniformLocation(tracer.generateProgram, "c_outputQueue"), 0);
+        dispatch_pixels(tracer.generateProgram, width, height, adaptive, adaptiveWorkBuffer, tracer.queueBuffer);
+
+        // Bounces run until the last one, kernels over queues that emptied early dispatch no workgroups
+        for (GLuint bounce = 0; bounce < numBounces; ++bounce) {
+            GLuint rayQueue = bounce % 2;
+            GLuint nextRayQueue = 1 - rayQueue;
+            reset_queues(tracer.queueBuffer, nextRayQueue, 1);
+            reset_queues(tracer.queueBuffer, SURFACE_QUEUE, QUEUE_COUNT - SURFACE_QUEUE);
+            dispatch_queue(tracer.extendProgram, rayQueue);
+            glProgramUniform1ui(tracer.shadeProgram, glGetUniformLocation(tracer.shadeProgram, "c_bounce"), bounce);
+            glProgramUniform1ui(tracer.shadeProgram, glGetUniformLocation(tracer.shadeProgram, "c_outputQueue"), nextRayQueue);
+            dispatch_queue(tracer.shadeProgram, SURFACE_QUEUE);
+            dispatch_queue(tracer.shadeProgram, DIELECTRIC_QUEUE);
+            dispatch_queue(tracer.connectProgram, SHADOW_QUEUE);
+        }
+    }
+    dispatch_pixels(tracer.accumulateProgram, width, height, adaptive, adaptiveWorkBuffer, tracer.queueBuffer);
+}
@@ -0,0 +1,29 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "glad/glad.h"
+
+// Compute programs and buffers of the wavefront path tracer, an alternative to the compute.glsl megakernel. A frame
+// runs as separate kernels for camera rays, closest hits, shading per material and shadow rays, which hand paths to
+// each other through queues in the WavefrontQueues buffer, each kernel dispatched indirectly over its queue so it only
+// runs for the paths still alive.
+struct WavefrontTracer {
+    GLuint generateProgram = 0;
+    GLuint extendProgram = 0;
+    GLuint shadeProgram = 0;
+    GLuint connectProgram = 0;
+    GLuint accumulateProgram = 0;
+    GLuint queueBuffer = 0;
+    GLuint pathBuffer = 0;
+    unsigned int capacity = 0; // paths the buffers are sized for, one per pixel
+};
+
+void setup_wavefront_tracer(WavefrontTracer& tracer);
+
+// Traces one frame of samplesPerPixel paths per pixel into the accumulation images. With adaptive set the paths start
+// only at the pixels of the adaptive work list, dispatched through its indirect arguments. The settings the kernels
+// share with compute.glsl must already be set on every program.
+void trace_wavefront(WavefrontTracer& tracer, unsigned int width, unsigned int height, unsigned int samplesPerPixel,
+                     unsigned int numBounces, bool adaptive, GLuint adaptiveWorkBuffer);
+
+#endif